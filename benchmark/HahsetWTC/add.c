@@ -2,8 +2,8 @@
 #include <stdlib.h>
 #include <time.h>
 
-#include "../hashset_chain.h"
-#include "../treeset.h"
+#include "../../hashset_chain.h"
+#include "../../treeset.h"
 
 #ifndef TEST_SIZE
 #define TEST_SIZE 1000000
@@ -11,13 +11,14 @@
 
 int main(int argc, char const *argv[])
 {
+	int test_size = (argc > 1) ? atoi(argv[1]) : TEST_SIZE;
 	struct hashset_chain *hset = hashset_create_set();
 	int i;
 	struct timespec begin, finish;
 	double elapsed;
 
 	clock_gettime(CLOCK_MONOTONIC, &begin);
-	for (i = 0; i < TEST_SIZE; ++i)
+	for (i = 0; i < test_size; ++i)
 	{
 		hashset_add(hset, i);
 	}
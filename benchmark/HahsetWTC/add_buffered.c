@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../hashset_chain.h"
+#include "../../treeset.h"
+
+#ifndef TEST_SIZE
+#define TEST_SIZE 1000000
+#endif
+
+int main(int argc, char const *argv[])
+{
+	int test_size = (argc > 1) ? atoi(argv[1]) : TEST_SIZE;
+	struct hashset_chain *hset = hashset_create_set();
+	struct hashset_writer *writer;
+	int i;
+	struct timespec begin, finish;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	writer = hashset_writer_open(hset);
+	for (i = 0; i < test_size; ++i)
+	{
+		hashset_writer_add(writer, i);
+	}
+	hashset_writer_close(writer);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	elapsed = (finish.tv_sec - begin.tv_sec);
+	elapsed += (finish.tv_nsec - begin.tv_nsec) / 1000000000.0;
+	fprintf(stdout, "%f\n", elapsed);
+
+	hashset_free_set(hset);
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../hashset_chain.h"
+#include "../../treeset.h"
+
+#ifndef TEST_SIZE
+#define TEST_SIZE 2000000
+#endif
+
+/* Number of buckets holding most of the elements */
+#define HOT_BUCKETS 3
+
+/*
+ * hashset_add_set(...) with skewed keys: 3/4 of the elements fall into the first
+ * HOT_BUCKETS buckets and the rest are spread over all of them, so that a thread
+ * given a fixed range of the table containing the hot buckets would finish long after others.
+ * Build with -DNUM_THREADS=8 (make bench BENCH_THREADS=8) to see the effect.
+ */
+static int
+skewed_key(int i)
+{
+	if (i % 4 == 3)
+		return i;
+	/* Keys congruent to i % HOT_BUCKETS modulo the table size */
+	return (i / HOT_BUCKETS) * HASHSET_TABLE_SIZE + i % HOT_BUCKETS;
+}
+
+int main(int argc, char const *argv[])
+{
+	int test_size = (argc > 1) ? atoi(argv[1]) : TEST_SIZE;
+	struct hashset_chain *hsetA = hashset_create_set();
+	struct hashset_chain *hsetB = hashset_create_set();
+	int i, *array;
+	struct timespec begin, finish;
+	double elapsed;
+
+	/* Create test data */
+	array = (int *)calloc(test_size, sizeof(int));
+	if (array == NULL) {
+		perror("Failed to allocate memory to array");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < test_size; ++i)
+	{
+		array[i] = skewed_key(i);
+	}
+	hashset_add_array(hsetA, array, test_size/2);
+	hashset_add_array(hsetB, array+test_size/2, test_size - test_size/2);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	hashset_add_set(hsetA, hsetB);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	elapsed = (finish.tv_sec - begin.tv_sec);
+	elapsed += (finish.tv_nsec - begin.tv_nsec) / 1000000000.0;
+	fprintf(stdout, "%f\n", elapsed);
+
+	hashset_free_set(hsetA);
+	hashset_free_set(hsetB);
+	free(array);
+	return 0;
+}
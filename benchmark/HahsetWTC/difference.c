@@ -2,8 +2,8 @@
 #include <stdlib.h>
 #include <time.h>
 
-#include "../hashset_chain.h"
-#include "../treeset.h"
+#include "../../hashset_chain.h"
+#include "../../treeset.h"
 
 #ifndef TEST_SIZE
 #define TEST_SIZE 2000000
@@ -11,6 +11,7 @@
 
 int main(int argc, char const *argv[])
 {
+	int test_size = (argc > 1) ? atoi(argv[1]) : TEST_SIZE;
 	struct hashset_chain *difference_set = hashset_create_set();
 	struct hashset_chain *hsetA = hashset_create_set();
 	struct hashset_chain *hsetB = hashset_create_set();
@@ -19,17 +20,17 @@ int main(int argc, char const *argv[])
 	double elapsed;
 
 	/* Create test data */
-	array = (int *)calloc(TEST_SIZE, sizeof(int));
+	array = (int *)calloc(test_size, sizeof(int));
 	if (array == NULL) {
 		perror("Failed to allocate memory to array");
 		exit(EXIT_FAILURE);
 	}
-	for (i = 0; i < TEST_SIZE; ++i)
+	for (i = 0; i < test_size; ++i)
 	{
 		array[i] = i;
 	}
-	hashset_add_array(hsetA, array, TEST_SIZE);
-	hashset_add_array(hsetB, array, TEST_SIZE/2);
+	hashset_add_array(hsetA, array, test_size);
+	hashset_add_array(hsetB, array, test_size/2);
 
 	clock_gettime(CLOCK_MONOTONIC, &begin);
 	hashset_difference(difference_set, hsetA, hsetB);
@@ -2,8 +2,8 @@
 #include <stdlib.h>
 #include <time.h>
 
-#include "../hashset_chain.h"
-#include "../treeset.h"
+#include "../../hashset_chain.h"
+#include "../../treeset.h"
 
 #ifndef TEST_SIZE
 #define TEST_SIZE 1000000
@@ -11,26 +11,27 @@
 
 int main(int argc, char const *argv[])
 {
+	int test_size = (argc > 1) ? atoi(argv[1]) : TEST_SIZE;
 	struct hashset_chain *hset = hashset_create_set();
 	int i, *array;
 	struct timespec begin, finish;
 	double elapsed;
 
 	/* Create test data */
-	array = (int *)calloc(TEST_SIZE, sizeof(int));
+	array = (int *)calloc(test_size, sizeof(int));
 	if (array == NULL) {
 		perror("Failed to allocate memory to array");
 		exit(EXIT_FAILURE);
 	}
-	for (i = 0; i < TEST_SIZE; ++i)
+	for (i = 0; i < test_size; ++i)
 	{
 		array[i] = i;
 	}
-	hashset_add_array(hset, array, TEST_SIZE);
+	hashset_add_array(hset, array, test_size);
 
 	int result;
 	clock_gettime(CLOCK_MONOTONIC, &begin);
-	result = hashset_find_array(hset, array, TEST_SIZE);
+	result = hashset_find_array(hset, array, test_size);
 	clock_gettime(CLOCK_MONOTONIC, &finish);
 	elapsed = (finish.tv_sec - begin.tv_sec);
 	elapsed += (finish.tv_nsec - begin.tv_nsec) / 1000000000.0;
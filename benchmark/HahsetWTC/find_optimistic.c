@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../../hashset_chain.h"
+#include "../../hashset_internal.h"
+#include "../../treeset.h"
+
+#ifndef TEST_SIZE
+#define TEST_SIZE 1000000
+#endif
+
+/* Lookups done by each reader thread */
+#ifndef LOOKUPS
+#define LOOKUPS 2000000
+#endif
+
+#define MAX_READERS 16
+
+/*
+ * Reader scaling of hashset_find_optimistic(...) with one writer running all the time.
+ * Even numbers below TEST_SIZE stay in the set while the writer keeps adding
+ * and removing odd ones, so readers can check what they find.
+ * As a baseline, the same workload is run with a reader-writer lock per bucket
+ * around hashset_find(...), whose readers write to the lock they share.
+ *
+ * Output: readers, mode, seconds, million lookups per second
+ */
+
+struct bench {
+	struct hashset_chain *set;
+	int use_locks;
+	volatile int stop;
+	pthread_rwlock_t locks[HASHSET_TABLE_SIZE];
+};
+
+struct reader_arg {
+	struct bench *bench;
+	unsigned int seed;
+	long errors;
+};
+
+static void *
+writer(void *arg)
+{
+	struct bench *bench = (struct bench *)arg;
+	unsigned int seed = 1;
+	int data, hash_value;
+
+	while (!bench->stop) {
+		data = (rand_r(&seed) % (TEST_SIZE / 2)) * 2 + 1;
+		hash_value = hashset_hash_code(data);
+		if (bench->use_locks)
+			pthread_rwlock_wrlock(&(bench->locks[hash_value]));
+
+		if (!hashset_add(bench->set, data))
+			hashset_remove(bench->set, data);
+
+		if (bench->use_locks)
+			pthread_rwlock_unlock(&(bench->locks[hash_value]));
+	}
+	return NULL;
+}
+
+static void *
+reader(void *arg)
+{
+	struct reader_arg *reader = (struct reader_arg *)arg;
+	struct bench *bench = reader->bench;
+	int i, data, found, hash_value;
+
+	for (i = 0; i < LOOKUPS; ++i)
+	{
+		data = rand_r(&(reader->seed)) % TEST_SIZE;
+		if (bench->use_locks) {
+			hash_value = hashset_hash_code(data);
+			pthread_rwlock_rdlock(&(bench->locks[hash_value]));
+			found = hashset_find(bench->set, data);
+			pthread_rwlock_unlock(&(bench->locks[hash_value]));
+		}
+		else
+			found = hashset_find_optimistic(bench->set, data);
+
+		if (data % 2 == 0 && !found)
+			reader->errors++;
+	}
+	return NULL;
+}
+
+static int
+run(struct bench *bench, int num_readers)
+{
+	pthread_t writer_thread, reader_threads[MAX_READERS];
+	struct reader_arg args[MAX_READERS];
+	struct timespec begin, finish;
+	double elapsed;
+	long errors;
+	int i;
+
+	bench->stop = 0;
+	pthread_create(&writer_thread, NULL, &writer, bench);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < num_readers; ++i)
+	{
+		args[i].bench  = bench;
+		args[i].seed   = i + 2;
+		args[i].errors = 0;
+		pthread_create(&(reader_threads[i]), NULL, &reader, &(args[i]));
+	}
+	errors = 0;
+	for (i = 0; i < num_readers; ++i)
+	{
+		pthread_join(reader_threads[i], NULL);
+		errors += args[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+
+	bench->stop = 1;
+	pthread_join(writer_thread, NULL);
+
+	elapsed = (finish.tv_sec - begin.tv_sec);
+	elapsed += (finish.tv_nsec - begin.tv_nsec) / 1000000000.0;
+	fprintf(stdout, "%d\t%s\t%f\t%f\n", num_readers,
+			bench->use_locks ? "rwlock" : "optimistic",
+			elapsed, (double)num_readers * LOOKUPS / elapsed / 1000000.0);
+
+	if (errors > 0) {
+		fprintf(stderr, "%ld lookups missed elements that were in set\n", errors);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+	struct bench bench;
+	int i, num_readers, failed;
+
+	bench.set = hashset_create_set();
+	for (i = 0; i < HASHSET_TABLE_SIZE; ++i)
+		pthread_rwlock_init(&(bench.locks[i]), NULL);
+
+	/* Create test data */
+	for (i = 0; i < TEST_SIZE; i += 2)
+	{
+		hashset_add(bench.set, i);
+	}
+
+	failed = 0;
+	for (bench.use_locks = 0; bench.use_locks <= 1; bench.use_locks++)
+		for (num_readers = 1; num_readers <= MAX_READERS; num_readers *= 2)
+			failed |= run(&bench, num_readers);
+
+	for (i = 0; i < HASHSET_TABLE_SIZE; ++i)
+		pthread_rwlock_destroy(&(bench.locks[i]));
+	hashset_free_set(bench.set);
+	return failed;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "../../hashset_chain.h"
+#include "../../hashset_internal.h"
+#include "../workload.h"
+
+/*
+ * Mixed workload on hashset_chain, see ../workload.h for options.
+ * Finds don't lock (hashset_find_optimistic(...)), while inserts and removes
+ * lock the bucket of the key since operations with one element must not
+ * modify a bucket concurrently.
+ */
+static pthread_mutex_t bucket_locks[HASHSET_TABLE_SIZE];
+
+static int
+find(void *ctx, int key)
+{
+	return hashset_find_optimistic((struct hashset_chain *)ctx, key);
+}
+
+static int
+insert(void *ctx, int key)
+{
+	int hash_value, result;
+
+	hash_value = hashset_hash_code(key);
+	pthread_mutex_lock(&(bucket_locks[hash_value]));
+	result = hashset_add((struct hashset_chain *)ctx, key);
+	pthread_mutex_unlock(&(bucket_locks[hash_value]));
+	return result;
+}
+
+static int
+remove_key(void *ctx, int key)
+{
+	int hash_value, result;
+
+	hash_value = hashset_hash_code(key);
+	pthread_mutex_lock(&(bucket_locks[hash_value]));
+	result = hashset_remove((struct hashset_chain *)ctx, key);
+	pthread_mutex_unlock(&(bucket_locks[hash_value]));
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	struct hashset_chain *hset = hashset_create_set();
+	struct workload_ops ops;
+	int i, status;
+
+	for (i = 0; i < HASHSET_TABLE_SIZE; ++i)
+		pthread_mutex_init(&(bucket_locks[i]), NULL);
+
+	ops.name   = "hashset_chain";
+	ops.ctx	   = hset;
+	ops.find   = &find;
+	ops.insert = &insert;
+	ops.remove = &remove_key;
+	status = workload_main(&ops, argc, argv);
+
+	hashset_free_set(hset);
+	return status;
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Compare two result files of run.py and flag regressions.
+
+Results are matched by implementation, benchmark, size and threads.
+A result regresses if its median time grew by more than --threshold and
+the growth is larger than --noise times the larger of the two standard deviations,
+so that noisy runs aren't reported. The exit status is 1 if anything regressed.
+
+Example:
+    $ benchmark/compare.py before.json after.json --threshold 0.05
+"""
+
+import argparse
+import csv
+import json
+import sys
+
+KEY_FIELDS = ("implementation", "benchmark", "size", "threads")
+NUMERIC_FIELDS = ("mean", "median", "stddev", "min", "max")
+
+
+def load(path):
+    if path.endswith(".csv"):
+        with open(path, newline="") as source:
+            rows = list(csv.DictReader(source))
+        for row in rows:
+            row["size"] = int(row["size"])
+            row["threads"] = int(row["threads"])
+            for field in NUMERIC_FIELDS:
+                row[field] = float(row[field])
+    else:
+        with open(path) as source:
+            rows = json.load(source)["results"]
+    return {tuple(row[field] for field in KEY_FIELDS): row for row in rows}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("base", help="results before the change (.json or .csv)")
+    parser.add_argument("new", help="results after the change (.json or .csv)")
+    parser.add_argument("--threshold", type=float, default=0.05,
+                        help="relative growth of the median regarded as a regression (default: %(default)s)")
+    parser.add_argument("--noise", type=float, default=2.0,
+                        help="growth must also exceed this many standard deviations (default: %(default)s)")
+    args = parser.parse_args()
+
+    base = load(args.base)
+    new = load(args.new)
+
+    regressions = 0
+    print("%-14s %-22s %10s %7s %12s %12s %8s" %
+          ("implementation", "benchmark", "size", "threads", "base", "new", "change"))
+    for key in sorted(set(base) & set(new)):
+        before, after = base[key], new[key]
+        growth = after["median"] - before["median"]
+        change = growth / before["median"] if before["median"] > 0 else 0.0
+        noise = args.noise * max(before["stddev"], after["stddev"])
+
+        if change > args.threshold and growth > noise:
+            status = "REGRESSION"
+            regressions += 1
+        elif change < -args.threshold and -growth > noise:
+            status = "improved"
+        else:
+            status = ""
+        print("%-14s %-22s %10d %7d %12.6f %12.6f %+7.1f%% %s" %
+              (key + (before["median"], after["median"], change * 100, status)))
+
+    for key in sorted(set(base) ^ set(new)):
+        print("%s/%s size=%d threads=%d is only in %s" %
+              (key + (args.base if key in base else args.new,)), file=sys.stderr)
+
+    print("%d regression(s)" % regressions)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""Build and run the single-operation benchmarks and write the results as JSON and/or CSV.
+
+Every benchmark takes the number of elements as its argument and prints the time
+in seconds of the measured operation. For each thread count, the benchmarks are
+built with `make bench BENCH_THREADS=<n>` (only hashset_chain depends on it, so
+std::set and std::unordered_set are run once). Each combination of benchmark and
+size is run --warmup times without recording, then --repeat times.
+
+Example:
+    $ benchmark/run.py --sizes 1e3,1e4,1e5,1e6 --threads 1,8 --json before.json
+    $ benchmark/compare.py before.json after.json
+"""
+
+import argparse
+import csv
+import datetime
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# Benchmarks that don't follow the "<size> -> seconds" protocol
+EXCLUDED = {"mixed", "find_optimistic"}
+
+IMPLEMENTATIONS = {
+    "hashset": "HahsetWTC",
+    "set": "std::set",
+    "unordered_set": "std::unordered_set",
+}
+
+CSV_FIELDS = ["implementation", "benchmark", "size", "threads", "repeat",
+              "mean", "median", "stddev", "min", "max"]
+
+
+def parse_list(text, convert):
+    return [convert(item) for item in text.split(",") if item]
+
+
+def parse_size(text):
+    return int(float(text))
+
+
+def benchmarks_of(implementation):
+    directory = os.path.join(ROOT, "benchmark", IMPLEMENTATIONS[implementation])
+    names = []
+    for file_name in sorted(os.listdir(directory)):
+        name, extension = os.path.splitext(file_name)
+        if extension in (".c", ".cpp") and name not in EXCLUDED:
+            names.append(name)
+    return names
+
+
+def build(threads):
+    subprocess.run(["make", "-s", "-C", ROOT, "bench", "BENCH_THREADS=%d" % threads],
+                   check=True)
+
+
+def run_once(binary, size, timeout):
+    completed = subprocess.run([binary, str(size)], stdout=subprocess.PIPE,
+                               universal_newlines=True, timeout=timeout, check=True)
+    return float(completed.stdout.split()[-1])
+
+
+def measure(binary, size, warmup, repeat, timeout):
+    for _ in range(warmup):
+        run_once(binary, size, timeout)
+    return [run_once(binary, size, timeout) for _ in range(repeat)]
+
+
+def summarize(implementation, benchmark, size, threads, runs):
+    return {
+        "implementation": implementation,
+        "benchmark": benchmark,
+        "size": size,
+        "threads": threads,
+        "repeat": len(runs),
+        "mean": statistics.mean(runs),
+        "median": statistics.median(runs),
+        "stddev": statistics.stdev(runs) if len(runs) > 1 else 0.0,
+        "min": min(runs),
+        "max": max(runs),
+        "runs": runs,
+    }
+
+
+def git_commit():
+    try:
+        return subprocess.run(["git", "-C", ROOT, "rev-parse", "HEAD"], stdout=subprocess.PIPE,
+                              stderr=subprocess.DEVNULL, universal_newlines=True,
+                              check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sizes", default="1e3,1e4,1e5,1e6,1e7,1e8",
+                        help="comma separated numbers of elements (default: %(default)s)")
+    parser.add_argument("--threads", default="1,2,4,8",
+                        help="comma separated values of NUM_THREADS (default: %(default)s)")
+    parser.add_argument("--implementations", default=",".join(IMPLEMENTATIONS),
+                        help="comma separated subset of %(default)s")
+    parser.add_argument("--benchmarks", default=None,
+                        help="comma separated benchmark names (default: all)")
+    parser.add_argument("--warmup", type=int, default=1, help="unrecorded runs (default: %(default)s)")
+    parser.add_argument("--repeat", type=int, default=5, help="recorded runs (default: %(default)s)")
+    parser.add_argument("--timeout", type=float, default=600, help="seconds per run (default: %(default)s)")
+    parser.add_argument("--json", help="write results to this JSON file")
+    parser.add_argument("--csv", help="write results to this CSV file")
+    args = parser.parse_args()
+
+    sizes = parse_list(args.sizes, parse_size)
+    thread_counts = parse_list(args.threads, int)
+    implementations = parse_list(args.implementations, str)
+    selected = set(parse_list(args.benchmarks, str)) if args.benchmarks else None
+    for implementation in implementations:
+        if implementation not in IMPLEMENTATIONS:
+            parser.error("unknown implementation %s" % implementation)
+    if args.repeat < 1:
+        parser.error("--repeat must be positive")
+
+    results = []
+    for index, threads in enumerate(thread_counts):
+        build(threads)
+        bench_dir = os.path.join(ROOT, "bench", "p%d" % threads)
+
+        for implementation in implementations:
+            # Only hashset_chain changes with NUM_THREADS
+            if implementation != "hashset" and index > 0:
+                continue
+            for benchmark in benchmarks_of(implementation):
+                if selected is not None and benchmark not in selected:
+                    continue
+                binary = os.path.join(bench_dir, "%s_%s" % (implementation, benchmark))
+                for size in sizes:
+                    recorded_threads = threads if implementation == "hashset" else 1
+                    print("%s/%s size=%d threads=%d" % (implementation, benchmark, size, recorded_threads),
+                          file=sys.stderr, flush=True)
+                    runs = measure(binary, size, args.warmup, args.repeat, args.timeout)
+                    results.append(summarize(implementation, benchmark, size, recorded_threads, runs))
+
+    if args.json:
+        document = {
+            "meta": {
+                "date": datetime.datetime.now().isoformat(timespec="seconds"),
+                "host": platform.node(),
+                "machine": platform.machine(),
+                "cpus": os.cpu_count(),
+                "commit": git_commit(),
+                "warmup": args.warmup,
+                "unit": "seconds",
+            },
+            "results": results,
+        }
+        with open(args.json, "w") as output:
+            json.dump(document, output, indent=2)
+            output.write("\n")
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as output:
+            writer = csv.DictWriter(output, fieldnames=CSV_FIELDS, extrasaction="ignore")
+            writer.writeheader()
+            writer.writerows(results)
+
+    if not args.json and not args.csv:
+        writer = csv.DictWriter(sys.stdout, fieldnames=CSV_FIELDS, extrasaction="ignore")
+        writer.writeheader()
+        writer.writerows(results)
+
+
+if __name__ == "__main__":
+    main()
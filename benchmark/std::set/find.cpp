@@ -1,28 +1,31 @@
+#include <cstdlib>
 #include <iostream>
 #include <set>
 #include <time.h>
+#include <vector>
 
 #ifndef TEST_SIZE
 #define TEST_SIZE 1000000
 #endif
 
-int main()
+int main(int argc, char *argv[])
 {
+  int test_size = (argc > 1) ? std::atoi(argv[1]) : TEST_SIZE;
   std::set<int> s;
-  int array[TEST_SIZE];
+  std::vector<int> array(test_size);
   double elapsed;
   struct timespec begin, finish;
 
   // Set up set and array data
-  for (int i = 0; i < TEST_SIZE; ++i)
+  for (int i = 0; i < test_size; ++i)
   {
     array[i] = i;
   }
-  s.insert(array, array+TEST_SIZE);
+  s.insert(array.begin(), array.end());
 
   /* Find data */
   clock_gettime(CLOCK_MONOTONIC, &begin);
-  for (int i = 0; i < TEST_SIZE; ++i)
+  for (int i = 0; i < test_size; ++i)
   {
     s.find(i);
   }
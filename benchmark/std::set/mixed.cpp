@@ -0,0 +1,45 @@
+#include <mutex>
+#include <set>
+
+#include "../workload.h"
+
+// Mixed workload on std::set guarded by one mutex, see ../workload.h for options.
+struct locked_set
+{
+  std::mutex lock;
+  std::set<int> s;
+};
+
+static int find(void *ctx, int key)
+{
+  locked_set *set = static_cast<locked_set *>(ctx);
+  std::lock_guard<std::mutex> guard(set->lock);
+  return set->s.count(key) > 0;
+}
+
+static int insert(void *ctx, int key)
+{
+  locked_set *set = static_cast<locked_set *>(ctx);
+  std::lock_guard<std::mutex> guard(set->lock);
+  return set->s.insert(key).second;
+}
+
+static int remove_key(void *ctx, int key)
+{
+  locked_set *set = static_cast<locked_set *>(ctx);
+  std::lock_guard<std::mutex> guard(set->lock);
+  return set->s.erase(key) > 0;
+}
+
+int main(int argc, char *argv[])
+{
+  locked_set set;
+  workload_ops ops;
+
+  ops.name = "std::set";
+  ops.ctx = &set;
+  ops.find = find;
+  ops.insert = insert;
+  ops.remove = remove_key;
+  return workload_main(&ops, argc, argv);
+}
@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <iostream>
 #include <set>
 #include <time.h>
@@ -7,14 +8,15 @@
 #define TEST_SIZE 1000000
 #endif
 
-int main()
+int main(int argc, char *argv[])
 {
+  int test_size = (argc > 1) ? std::atoi(argv[1]) : TEST_SIZE;
   std::unordered_set<int> s;
   double elapsed;
   struct timespec begin, finish;
 
   clock_gettime(CLOCK_MONOTONIC, &begin);
-  for (int i = 0; i < TEST_SIZE; ++i)
+  for (int i = 0; i < test_size; ++i)
   {
     s.insert(i);
   }
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "workload.h"
+
+/*
+ * Latency histogram with 16 linear sub-buckets per power of two,
+ * so that a percentile is off by at most 1/16 of its value.
+ */
+#define WORKLOAD_SUB_BITS	 4
+#define WORKLOAD_SUB_BUCKETS (1 << WORKLOAD_SUB_BITS)
+#define WORKLOAD_BUCKETS	 (64 * WORKLOAD_SUB_BUCKETS)
+
+/* zeta(n, theta) is summed exactly up to this many terms and approximated by an integral beyond */
+#define WORKLOAD_ZETA_TERMS	 1000000
+
+enum WORKLOAD_OPERATION {
+	WORKLOAD_FIND,
+	WORKLOAD_INSERT,
+	WORKLOAD_REMOVE,
+	WORKLOAD_OPERATIONS
+};
+
+/* Zipf generator of Gray et al., "Quickly generating billion-record synthetic databases" */
+struct workload_zipf {
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+	double half_pow_theta;
+};
+
+struct workload_shared {
+	struct workload_config *config;
+	struct workload_ops *ops;
+	struct workload_zipf zipf;
+	pthread_barrier_t start;
+	int stop;
+};
+
+struct workload_worker {
+	pthread_t thread;
+	struct workload_shared *shared;
+	uint64_t rng;
+	long long next_key;								// next key of the sequential distribution
+	unsigned long long count[WORKLOAD_OPERATIONS];	// operations done
+	unsigned long long histogram[WORKLOAD_BUCKETS];	// latency in ns of all operations
+};
+
+static uint64_t workload_random(uint64_t *state);
+static double workload_random_double(uint64_t *state);
+static double workload_zeta(int n, double theta);
+static void workload_init_zipf(struct workload_zipf *zipf, int n, double theta);
+static int  workload_next_key(struct workload_worker *worker);
+static long long workload_next_zipf(struct workload_zipf *zipf, uint64_t *rng, int n);
+static int  workload_bucket_of(uint64_t ns);
+static uint64_t workload_value_of(int bucket);
+static uint64_t workload_percentile(const unsigned long long *histogram, unsigned long long total, double percentile);
+static uint64_t workload_now(void);
+static void *workload_worker_main(void *arg);
+static const char *workload_distribution_name(enum workload_distribution distribution);
+
+/*
+ * Parse command line described in workload.h into config.
+ *
+ * @return 1 if succeeded, 0 if an argument is invalid
+ */
+int
+workload_parse_args(struct workload_config *config, int argc, char **argv)
+{
+	int i;
+	const char *value;
+
+	config->threads		   = 1;
+	config->seconds		   = 5.0;
+	config->find_percent   = 90;
+	config->insert_percent = 5;
+	config->remove_percent = 5;
+	config->distribution   = WORKLOAD_UNIFORM;
+	config->theta		   = 0.99;
+	config->keys		   = 1000000;
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 == argc) {
+			fprintf(stderr, "missing value of %s\n", argv[i]);
+			return 0;
+		}
+		value = argv[++i];
+
+		if (strcmp(argv[i - 1], "--threads") == 0)
+			config->threads = atoi(value);
+		else if (strcmp(argv[i - 1], "--seconds") == 0)
+			config->seconds = atof(value);
+		else if (strcmp(argv[i - 1], "--mix") == 0) {
+			if (sscanf(value, "%d/%d/%d", &(config->find_percent),
+					   &(config->insert_percent), &(config->remove_percent)) != 3) {
+				fprintf(stderr, "--mix must be find/insert/remove percentages, e.g. 90/5/5\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i - 1], "--distribution") == 0) {
+			if (strcmp(value, "uniform") == 0)
+				config->distribution = WORKLOAD_UNIFORM;
+			else if (strcmp(value, "zipf") == 0)
+				config->distribution = WORKLOAD_ZIPF;
+			else if (strcmp(value, "sequential") == 0)
+				config->distribution = WORKLOAD_SEQUENTIAL;
+			else {
+				fprintf(stderr, "unknown distribution %s\n", value);
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i - 1], "--theta") == 0)
+			config->theta = atof(value);
+		else if (strcmp(argv[i - 1], "--keys") == 0)
+			config->keys = atoi(value);
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i - 1]);
+			return 0;
+		}
+	}
+
+	if (config->threads <= 0 || config->seconds <= 0 || config->keys <= 0 ||
+		config->find_percent < 0 || config->insert_percent < 0 || config->remove_percent < 0 ||
+		config->find_percent + config->insert_percent + config->remove_percent != 100 ||
+		config->theta <= 0 || config->theta == 1.0) {
+		fprintf(stderr, "invalid configuration\n");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Fill the set with every even key, run the workload on config->threads threads
+ * for config->seconds, and print the result line.
+ *
+ * @return 1 if succeeded, 0 otherwise
+ */
+int
+workload_run(struct workload_config *config, struct workload_ops *ops)
+{
+	int i, j, created;
+	uint64_t begin, finish;
+	unsigned long long total, count[WORKLOAD_OPERATIONS];
+	unsigned long long *histogram;
+	double elapsed;
+	struct timespec duration;
+	struct workload_shared shared;
+	struct workload_worker *workers;
+
+	for (i = 0; i < config->keys; i += 2)
+		ops->insert(ops->ctx, i);
+
+	shared.config = config;
+	shared.ops	  = ops;
+	shared.stop	  = 0;
+	if (config->distribution == WORKLOAD_ZIPF)
+		workload_init_zipf(&(shared.zipf), config->keys, config->theta);
+
+	workers	  = (struct workload_worker *)calloc(config->threads, sizeof(struct workload_worker));
+	histogram = (unsigned long long *)calloc(WORKLOAD_BUCKETS, sizeof(unsigned long long));
+	if (workers == NULL || histogram == NULL) {
+		perror("Failed to allocate memory for workers");
+		free(workers);
+		free(histogram);
+		return 0;
+	}
+	if (pthread_barrier_init(&(shared.start), NULL, config->threads + 1)) {
+		perror("Failed to initialize barrier");
+		free(workers);
+		free(histogram);
+		return 0;
+	}
+
+	for (created = 0; created < config->threads; created++) {
+		workers[created].shared	  = &shared;
+		workers[created].rng	  = 0x9E3779B97F4A7C15ULL * (created + 1);
+		workers[created].next_key = (long long)config->keys * created / config->threads;
+		if (pthread_create(&(workers[created].thread), NULL, &workload_worker_main, &(workers[created]))) {
+			perror("Failed to create worker");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&(shared.start));
+	begin = workload_now();
+
+	duration.tv_sec	 = (time_t)config->seconds;
+	duration.tv_nsec = (long)((config->seconds - duration.tv_sec) * 1000000000.0);
+	nanosleep(&duration, NULL);
+	__atomic_store_n(&(shared.stop), 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < config->threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	finish = workload_now();
+
+	/* Merge results of workers */
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < config->threads; i++) {
+		for (j = 0; j < WORKLOAD_OPERATIONS; j++)
+			count[j] += workers[i].count[j];
+		for (j = 0; j < WORKLOAD_BUCKETS; j++)
+			histogram[j] += workers[i].histogram[j];
+	}
+	total	= count[WORKLOAD_FIND] + count[WORKLOAD_INSERT] + count[WORKLOAD_REMOVE];
+	elapsed = (finish - begin) / 1000000000.0;
+
+	fprintf(stdout, "structure=%s threads=%d mix=%d/%d/%d distribution=%s keys=%d seconds=%f "
+			"ops=%llu finds=%llu inserts=%llu removes=%llu throughput=%f p50_ns=%llu p99_ns=%llu p999_ns=%llu\n",
+			ops->name, config->threads,
+			config->find_percent, config->insert_percent, config->remove_percent,
+			workload_distribution_name(config->distribution), config->keys, elapsed,
+			total, count[WORKLOAD_FIND], count[WORKLOAD_INSERT], count[WORKLOAD_REMOVE],
+			total / elapsed,
+			(unsigned long long)workload_percentile(histogram, total, 0.50),
+			(unsigned long long)workload_percentile(histogram, total, 0.99),
+			(unsigned long long)workload_percentile(histogram, total, 0.999));
+
+	pthread_barrier_destroy(&(shared.start));
+	free(workers);
+	free(histogram);
+	return 1;
+}
+
+/*
+ * Parse the command line and run the workload on ops
+ *
+ * @return exit status of the benchmark
+ */
+int
+workload_main(struct workload_ops *ops, int argc, char **argv)
+{
+	struct workload_config config;
+
+	if (!workload_parse_args(&config, argc, argv))
+		return 2;
+
+	return workload_run(&config, ops) ? 0 : 1;
+}
+
+static void *
+workload_worker_main(void *arg)
+{
+	int key, operation, dice;
+	uint64_t begin, latency;
+	struct workload_worker *worker;
+	struct workload_config *config;
+	struct workload_ops *ops;
+
+	worker = (struct workload_worker *)arg;
+	config = worker->shared->config;
+	ops	   = worker->shared->ops;
+
+	pthread_barrier_wait(&(worker->shared->start));
+
+	while (!__atomic_load_n(&(worker->shared->stop), __ATOMIC_RELAXED)) {
+		dice = (int)(workload_random(&(worker->rng)) % 100);
+		if (dice < config->find_percent)
+			operation = WORKLOAD_FIND;
+		else if (dice < config->find_percent + config->insert_percent)
+			operation = WORKLOAD_INSERT;
+		else
+			operation = WORKLOAD_REMOVE;
+		key = workload_next_key(worker);
+
+		begin = workload_now();
+		switch (operation) {
+		case WORKLOAD_FIND:
+			ops->find(ops->ctx, key);
+			break;
+		case WORKLOAD_INSERT:
+			ops->insert(ops->ctx, key);
+			break;
+		default:
+			ops->remove(ops->ctx, key);
+			break;
+		}
+		latency = workload_now() - begin;
+
+		worker->count[operation]++;
+		worker->histogram[workload_bucket_of(latency)]++;
+	}
+
+	return NULL;
+}
+
+static int
+workload_next_key(struct workload_worker *worker)
+{
+	long long key;
+	struct workload_config *config;
+
+	config = worker->shared->config;
+	switch (config->distribution) {
+	case WORKLOAD_ZIPF:
+		key = workload_next_zipf(&(worker->shared->zipf), &(worker->rng), config->keys);
+		break;
+	case WORKLOAD_SEQUENTIAL:
+		key = worker->next_key++;
+		if (worker->next_key >= config->keys)
+			worker->next_key = 0;
+		break;
+	default:
+		key = (long long)(workload_random(&(worker->rng)) % config->keys);
+		break;
+	}
+
+	return (key < config->keys) ? (int)key : config->keys - 1;
+}
+
+/*
+ * xorshift64*
+ */
+static uint64_t
+workload_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * @return uniform random number in [0, 1)
+ */
+static double
+workload_random_double(uint64_t *state)
+{
+	return (workload_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * sum of 1/i^theta for i = 1..n
+ */
+static double
+workload_zeta(int n, double theta)
+{
+	int i, terms;
+	double sum;
+
+	terms = (n < WORKLOAD_ZETA_TERMS) ? n : WORKLOAD_ZETA_TERMS;
+	sum = 0.0;
+	for (i = 1; i <= terms; i++)
+		sum += 1.0 / pow((double)i, theta);
+
+	/* The rest is close to the integral of x^-theta over [terms + 0.5, n + 0.5] */
+	if (n > terms)
+		sum += (pow(n + 0.5, 1.0 - theta) - pow(terms + 0.5, 1.0 - theta)) / (1.0 - theta);
+
+	return sum;
+}
+
+static void
+workload_init_zipf(struct workload_zipf *zipf, int n, double theta)
+{
+	double zeta2;
+
+	zeta2 = workload_zeta(2, theta);
+	zipf->theta = theta;
+	zipf->alpha = 1.0 / (1.0 - theta);
+	zipf->zetan = workload_zeta(n, theta);
+	zipf->eta	= (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+	zipf->half_pow_theta = pow(0.5, theta);
+}
+
+/*
+ * @return key in [0, n) where key k is drawn with probability proportional to 1/(k+1)^theta
+ */
+static long long
+workload_next_zipf(struct workload_zipf *zipf, uint64_t *rng, int n)
+{
+	double u, uz;
+
+	u  = workload_random_double(rng);
+	uz = u * zipf->zetan;
+
+	if (uz < 1.0)
+		return 0;
+	if (uz < 1.0 + zipf->half_pow_theta)
+		return 1;
+	return (long long)(n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+}
+
+static int
+workload_bucket_of(uint64_t ns)
+{
+	int msb;
+
+	if (ns < WORKLOAD_SUB_BUCKETS)
+		return (int)ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - WORKLOAD_SUB_BITS + 1) * WORKLOAD_SUB_BUCKETS +
+		(int)((ns >> (msb - WORKLOAD_SUB_BITS)) & (WORKLOAD_SUB_BUCKETS - 1));
+}
+
+/*
+ * @return the largest latency counted in bucket
+ */
+static uint64_t
+workload_value_of(int bucket)
+{
+	int shift;
+	uint64_t sub;
+
+	if (bucket < WORKLOAD_SUB_BUCKETS)
+		return (uint64_t)bucket;
+
+	shift = bucket / WORKLOAD_SUB_BUCKETS - 1;
+	sub	  = bucket % WORKLOAD_SUB_BUCKETS;
+	return ((WORKLOAD_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static uint64_t
+workload_percentile(const unsigned long long *histogram,
+					unsigned long long total,
+					double percentile)
+{
+	int i;
+	unsigned long long rank, seen;
+
+	if (total == 0)
+		return 0;
+
+	rank = (unsigned long long)ceil(percentile * total);
+	seen = 0;
+	for (i = 0; i < WORKLOAD_BUCKETS; i++) {
+		seen += histogram[i];
+		if (seen >= rank)
+			return workload_value_of(i);
+	}
+	return workload_value_of(WORKLOAD_BUCKETS - 1);
+}
+
+static uint64_t
+workload_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static const char *
+workload_distribution_name(enum workload_distribution distribution)
+{
+	switch (distribution) {
+	case WORKLOAD_ZIPF:
+		return "zipf";
+	case WORKLOAD_SEQUENTIAL:
+		return "sequential";
+	default:
+		return "uniform";
+	}
+}
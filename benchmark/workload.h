@@ -0,0 +1,59 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Driver of mixed workloads shared by the benchmarks of every set implementation.
+ * A benchmark fills struct workload_ops with its own find/insert/remove and calls
+ * workload_main(...), which parses the command line:
+ *
+ *     --threads N          number of worker threads (default 1)
+ *     --seconds S          duration of the measurement (default 5)
+ *     --mix R/I/D          percentages of find/insert/remove (default 90/5/5)
+ *     --distribution D     uniform, zipf or sequential (default uniform)
+ *     --theta T            skew of zipf (default 0.99)
+ *     --keys K             keys are drawn from [0, K) (default 1000000)
+ *
+ * Before measuring, every even key is inserted so that about half of the finds hit.
+ * Each worker times every operation, and the result is printed as one line of
+ * key=value pairs with throughput and p50/p99/p999 latency.
+ */
+
+enum workload_distribution {
+	WORKLOAD_UNIFORM,
+	WORKLOAD_ZIPF,
+	WORKLOAD_SEQUENTIAL
+};
+
+struct workload_config {
+	int	   threads;
+	double seconds;
+	int	   find_percent;
+	int	   insert_percent;
+	int	   remove_percent;
+	enum workload_distribution distribution;
+	double theta;
+	int	   keys;
+};
+
+/* Operations of the set under test. They MUST be safe to call from any number of threads. */
+struct workload_ops {
+	const char *name;	// name of the implementation in the result line
+	void *ctx;			// passed to all functions below
+	int (*find)(void *ctx, int key);
+	int (*insert)(void *ctx, int key);
+	int (*remove)(void *ctx, int key);
+};
+
+int workload_parse_args(struct workload_config *config, int argc, char **argv);
+int workload_run(struct workload_config *config, struct workload_ops *ops);
+int workload_main(struct workload_ops *ops, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,293 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hashset_async.h"
+
+static struct hashset_future *hashset_async_submit(enum HASHSET_ASYNC_OPERATION operation, struct hashset_chain *result_set, struct hashset_chain *setA, struct hashset_chain *setB, int *array_data, int array_size, hashset_future_callback callback, void *ctx);
+static void hashset_async_run(struct hashset_job *job);
+
+
+/*
+ * @return future of hashset_add_set(setA, setB), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_add_set_async(struct hashset_chain *setA,
+					  struct hashset_chain *setB,
+					  hashset_future_callback callback,
+					  void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_ADD_SET, NULL, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * @return future of hashset_add_array(set, array_data, array_size), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_add_array_async(struct hashset_chain *set,
+						int *array_data,
+						int  array_size,
+						hashset_future_callback callback,
+						void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_ADD_ARRAY, NULL, set, NULL, array_data, array_size, callback, ctx);
+}
+
+/*
+ * @return future of hashset_remove_set(setA, setB), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_remove_set_async(struct hashset_chain *setA,
+						 struct hashset_chain *setB,
+						 hashset_future_callback callback,
+						 void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_REMOVE_SET, NULL, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * @return future of hashset_remove_array(set, array_data, array_size), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_remove_array_async(struct hashset_chain *set,
+						   int *array_data,
+						   int  array_size,
+						   hashset_future_callback callback,
+						   void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_REMOVE_ARRAY, NULL, set, NULL, array_data, array_size, callback, ctx);
+}
+
+/*
+ * @return future of hashset_find_set(setA, setB), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_find_set_async(struct hashset_chain *setA,
+					   struct hashset_chain *setB,
+					   hashset_future_callback callback,
+					   void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_FIND_SET, NULL, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * @return future of hashset_find_array(set, array_data, array_size), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_find_array_async(struct hashset_chain *set,
+						 int *array_data,
+						 int  array_size,
+						 hashset_future_callback callback,
+						 void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_FIND_ARRAY, NULL, set, NULL, array_data, array_size, callback, ctx);
+}
+
+/*
+ * @return future of hashset_retain_set(setA, setB), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_retain_set_async(struct hashset_chain *setA,
+						 struct hashset_chain *setB,
+						 hashset_future_callback callback,
+						 void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_RETAIN_SET, NULL, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * @return future of hashset_retain_array(set, array_data, array_size), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_retain_array_async(struct hashset_chain *set,
+						   int *array_data,
+						   int  array_size,
+						   hashset_future_callback callback,
+						   void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_RETAIN_ARRAY, NULL, set, NULL, array_data, array_size, callback, ctx);
+}
+
+/*
+ * @return future of hashset_union(union_set, setA, setB), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_union_async(struct hashset_chain *union_set,
+					struct hashset_chain *setA,
+					struct hashset_chain *setB,
+					hashset_future_callback callback,
+					void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_UNION, union_set, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * @return future of hashset_intersection(intersection_set, setA, setB), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_intersection_async(struct hashset_chain *intersection_set,
+						   struct hashset_chain *setA,
+						   struct hashset_chain *setB,
+						   hashset_future_callback callback,
+						   void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_INTERSECTION, intersection_set, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * @return future of hashset_difference(difference_set, setA, setB), NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_difference_async(struct hashset_chain *difference_set,
+						 struct hashset_chain *setA,
+						 struct hashset_chain *setB,
+						 hashset_future_callback callback,
+						 void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_DIFFERENCE, difference_set, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * @return future of hashset_symmetric_difference(symmetric_difference_set, setA, setB),
+ *         NULL if it fails to allocate memory
+ */
+struct hashset_future *
+hashset_symmetric_difference_async(struct hashset_chain *symmetric_difference_set,
+								   struct hashset_chain *setA,
+								   struct hashset_chain *setB,
+								   hashset_future_callback callback,
+								   void *ctx)
+{
+	return hashset_async_submit(HASHSET_ASYNC_SYMMETRIC_DIFFERENCE, symmetric_difference_set, setA, setB, NULL, 0, callback, ctx);
+}
+
+/*
+ * Check if the operation of future is done without waiting.
+ *
+ * @return 1 if done (and its callback returned), 0 otherwise
+ */
+int
+hashset_future_poll(struct hashset_future *future)
+{
+	if (future == NULL)
+		return 1;
+	return __atomic_load_n(&(future->job.done), __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wait until the operation of future is done. If no worker has taken it yet,
+ * the calling thread does it by itself.
+ * Only one thread may wait for a future.
+ *
+ * @return the return value of the operation, 0 if future is NULL
+ */
+int
+hashset_future_wait(struct hashset_future *future)
+{
+	if (future == NULL)
+		return 0;
+	hashset_pool_join(&(future->job));
+	return future->result;
+}
+
+/*
+ * Wait for the operation of future if it's not done yet, then free future
+ */
+void
+hashset_future_free(struct hashset_future *future)
+{
+	if (future == NULL)
+		return;
+	hashset_pool_join(&(future->job));
+	free(future);
+}
+
+static struct hashset_future *
+hashset_async_submit(enum HASHSET_ASYNC_OPERATION operation,
+					 struct hashset_chain *result_set,
+					 struct hashset_chain *setA,
+					 struct hashset_chain *setB,
+					 int *array_data,
+					 int  array_size,
+					 hashset_future_callback callback,
+					 void *ctx)
+{
+	struct hashset_future *future;
+
+	future = (struct hashset_future *)calloc(1, sizeof(struct hashset_future));
+	if (future == NULL) {
+		perror("Failed to allocate memory to future");
+		return NULL;
+	}
+	future->operation  = operation;
+	future->result_set = result_set;
+	future->setA	   = setA;
+	future->setB	   = setB;
+	future->array_data = array_data;
+	future->array_size = array_size;
+	future->callback   = callback;
+	future->ctx		   = ctx;
+	future->job.function = &hashset_async_run;
+
+	hashset_pool_fork(&(future->job));
+	return future;
+}
+
+/*
+ * Do the operation of future, run by a worker of the pool
+ */
+static void
+hashset_async_run(struct hashset_job *job)
+{
+	struct hashset_future *future;
+	int result;
+
+	future = (struct hashset_future *)job;
+	switch(future->operation) {
+		case HASHSET_ASYNC_ADD_SET:
+			result = hashset_add_set(future->setA, future->setB);
+			break;
+		case HASHSET_ASYNC_ADD_ARRAY:
+			result = hashset_add_array(future->setA, future->array_data, future->array_size);
+			break;
+		case HASHSET_ASYNC_REMOVE_SET:
+			result = hashset_remove_set(future->setA, future->setB);
+			break;
+		case HASHSET_ASYNC_REMOVE_ARRAY:
+			result = hashset_remove_array(future->setA, future->array_data, future->array_size);
+			break;
+		case HASHSET_ASYNC_FIND_SET:
+			result = hashset_find_set(future->setA, future->setB);
+			break;
+		case HASHSET_ASYNC_FIND_ARRAY:
+			result = hashset_find_array(future->setA, future->array_data, future->array_size);
+			break;
+		case HASHSET_ASYNC_RETAIN_SET:
+			result = hashset_retain_set(future->setA, future->setB);
+			break;
+		case HASHSET_ASYNC_RETAIN_ARRAY:
+			result = hashset_retain_array(future->setA, future->array_data, future->array_size);
+			break;
+		case HASHSET_ASYNC_UNION:
+			result = hashset_union(future->result_set, future->setA, future->setB);
+			break;
+		case HASHSET_ASYNC_INTERSECTION:
+			result = hashset_intersection(future->result_set, future->setA, future->setB);
+			break;
+		case HASHSET_ASYNC_DIFFERENCE:
+			result = hashset_difference(future->result_set, future->setA, future->setB);
+			break;
+		case HASHSET_ASYNC_SYMMETRIC_DIFFERENCE:
+			result = hashset_symmetric_difference(future->result_set, future->setA, future->setB);
+			break;
+		default:
+			result = 0;
+	}
+
+	future->result = result;
+	if (future->callback != NULL)
+		future->callback(future, result, future->ctx);
+}
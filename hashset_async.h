@@ -0,0 +1,84 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_ASYNC_H
+#define HASHSET_ASYNC_H
+
+#include "hashset_chain.h"
+#include "hashset_pool.h"
+
+/*
+ * Asynchronous set operations.
+ *
+ * hashset_*_async(...) return right away with a future while the operation
+ * runs on a worker of the pool of hashset_pool.h, so that a thread such as
+ * an event loop can start several independent operations and keep working.
+ * Each operation still uses NUM_THREADS threads of its own, and up to
+ * NUM_THREADS operations run at once while the others wait in order.
+ * With NUM_THREADS 1 there are no workers and the operation is done before
+ * hashset_*_async(...) returns.
+ *
+ * Sets and arrays given MUST NOT be modified or freed until the operation is done.
+ *
+ *     future = hashset_add_array_async(set, array, size, NULL, NULL);
+ *     ... do something else ...
+ *     if (hashset_future_poll(future)) ...
+ *     result = hashset_future_wait(future);
+ *     hashset_future_free(future);
+ *
+ * If callback is given, it's called by the worker with the result of the
+ * operation once it's done, before hashset_future_poll(...) reports it.
+ * It may start other operations, but MUST NOT wait for or free future.
+ */
+
+enum HASHSET_ASYNC_OPERATION {
+	HASHSET_ASYNC_ADD_SET,
+	HASHSET_ASYNC_ADD_ARRAY,
+	HASHSET_ASYNC_REMOVE_SET,
+	HASHSET_ASYNC_REMOVE_ARRAY,
+	HASHSET_ASYNC_FIND_SET,
+	HASHSET_ASYNC_FIND_ARRAY,
+	HASHSET_ASYNC_RETAIN_SET,
+	HASHSET_ASYNC_RETAIN_ARRAY,
+	HASHSET_ASYNC_UNION,
+	HASHSET_ASYNC_INTERSECTION,
+	HASHSET_ASYNC_DIFFERENCE,
+	HASHSET_ASYNC_SYMMETRIC_DIFFERENCE
+};
+
+struct hashset_future;
+
+typedef void (*hashset_future_callback)(struct hashset_future *future, int result, void *ctx);
+
+struct hashset_future {
+	struct hashset_job job;		// MUST be the first member, see hashset_pool.h
+	enum HASHSET_ASYNC_OPERATION operation;
+	struct hashset_chain *result_set;	// Only for union, intersection, and (symmetric) difference
+	struct hashset_chain *setA;
+	struct hashset_chain *setB;	// Not used for operations with ***array***
+	int *  array_data;			// Not used for operations with ***set***
+	int    array_size;			// Not used for operations with ***set***
+	hashset_future_callback callback;
+	void * ctx;
+
+	int    result;				// return value of the operation, valid once done
+};
+
+struct hashset_future *hashset_add_set_async(struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_add_array_async(struct hashset_chain *set, int *array_data, int array_size, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_remove_set_async(struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_remove_array_async(struct hashset_chain *set, int *array_data, int array_size, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_find_set_async(struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_find_array_async(struct hashset_chain *set, int *array_data, int array_size, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_retain_set_async(struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_retain_array_async(struct hashset_chain *set, int *array_data, int array_size, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_union_async(struct hashset_chain *union_set, struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_intersection_async(struct hashset_chain *intersection_set, struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_difference_async(struct hashset_chain *difference_set, struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+struct hashset_future *hashset_symmetric_difference_async(struct hashset_chain *symmetric_difference_set, struct hashset_chain *setA, struct hashset_chain *setB, hashset_future_callback callback, void *ctx);
+int  hashset_future_poll(struct hashset_future *future);
+int  hashset_future_wait(struct hashset_future *future);
+void hashset_future_free(struct hashset_future *future);
+
+#endif
@@ -6,15 +6,21 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
 #include "hashset_chain.h"
+#include "hashset_instrument.h"
+#include "hashset_internal.h"
+#include "hashset_trace.h"
 #include "treeset.h"
 
 /* only used for operations with ARRAY */
 static pthread_once_t atmostonece_for_table_lock_init = PTHREAD_ONCE_INIT;
 static pthread_mutex_t table_locks[HASHSET_TABLE_SIZE];
 
-static int  hashset_hash_code(int data);
+static void *hashset_free_set_in_background(void *arg);
+static void hashset_clear_in_buckets(struct bucket_task *task);
 static int  hashset_operation_template_with_data(struct hashset_chain *set, int data, int (*treeset_function)(struct tree_set*, int));
 static int  hashset_operation_template_with_set(enum SET_OPERATION operation, struct hashset_chain *setA, struct hashset_chain *setB);
 static int  hashset_operation_template_with_array(enum SET_OPERATION operation, struct hashset_chain *set, int *array_data, int  array_size);
@@ -23,10 +29,94 @@ static int  hashset_set_operation(enum SET_OPERATION operation, struct hashset_c
 static int  hashset_create_thread(pthread_t *tid, struct task_data *data, struct thread_task *tasks, int num_threads);
 static int  hashset_compute_proper_number_of_threads(struct hashset_chain *setB, int array_size);
 static void hashset_setup_task_data(struct task_data *data, enum SET_OPERATION operation, struct hashset_chain *setA, struct hashset_chain *setB, int *array_data, int  array_size);
+static void hashset_sort_buckets_by_work(struct task_data *data);
 static void hashset_setup_thread_task(struct task_data *data, struct thread_task *task, int from, int to);
 static void *hashset_thread_operation(void *arg);
 static void hashset_operate_with_all_elements_of_set(struct thread_task *task);
 static void hashset_operate_with_all_elements_of_array(struct thread_task *task);
+static int  hashset_run_range_tasks(struct bucket_task *tasks, int num_threads, int size, int bind, void (*function)(struct bucket_task *), void *arg);
+static void *hashset_bucket_thread_operation(void *arg);
+static void hashset_foreach_in_buckets(struct bucket_task *task);
+static void hashset_reduce_in_buckets(struct bucket_task *task);
+static int  hashset_filter(struct hashset_chain *set, int (*treeset_function)(struct tree_set *, int (*)(int, void *), void *), int (*predicate)(int data, void *ctx), void *ctx);
+static void hashset_filter_in_buckets(struct bucket_task *task);
+static void hashset_batch_in_buckets(struct bucket_task *task);
+static int  hashset_batch_contains(int data, void *ctx);
+static int  hashset_many(struct hashset_chain *out, struct hashset_chain **sets, int k, void (*function)(struct bucket_task *));
+static void hashset_union_many_in_buckets(struct bucket_task *task);
+static void hashset_intersection_many_in_buckets(struct bucket_task *task);
+static void hashset_heap_sift_down(int *heap, int size, int *heads, int index);
+static void hashset_to_array_in_buckets(struct bucket_task *task);
+static void hashset_merge_runs_in_slices(struct bucket_task *task);
+static int  hashset_lower_bound(int *array, int size, long long data);
+static int  hashset_compare_int(const void *a, const void *b);
+
+/* Arguments shared by threads of hashset_parallel_foreach(...) */
+struct foreach_data {
+	struct hashset_chain *set;
+	void (*function)(int data, void *ctx);
+	void  *ctx;
+};
+
+/* Arguments shared by threads of hashset_remove_if(...) and hashset_retain_if(...) */
+struct filter_data {
+	struct hashset_chain *set;
+	int (*treeset_function)(struct tree_set *, int (*)(int, void *), void *);
+	int (*predicate)(int data, void *ctx);
+	void *ctx;
+};
+
+/*
+ * Arguments shared by threads of hashset_batch_run(...)
+ * Elements of operation o of the batch in bucket i are
+ * elements[offsets[i * batch->count + o]] to elements[offsets[i * batch->count + o + 1] - 1].
+ */
+struct batch_data {
+	struct hashset_batch *batch;
+	int *elements;
+	int *offsets;
+};
+
+/* Elements of a retain operation in one bucket, sorted for hashset_batch_contains(...) */
+struct batch_retain {
+	int *array;
+	int  size;
+};
+
+/* Arguments shared by threads of hashset_union_many(...) and hashset_intersection_many(...) */
+struct many_data {
+	struct hashset_chain *out;
+	struct hashset_chain **sets;
+	int k;
+	int failed;					// 1 if a thread failed to allocate memory
+};
+
+/*
+ * Arguments shared by threads of hashset_to_array(...)
+ * Chain i is written to runs[offsets[i]] and clipped so that no more than
+ * runs_size elements are written in total.
+ * For sorted output, slice t of the merge covers values in [boundaries[t], boundaries[t+1]).
+ */
+struct to_array_data {
+	struct hashset_chain *set;
+	int *runs;
+	int  runs_size;
+	int  offsets[HASHSET_TABLE_SIZE + 1];
+	int *array_data;			// Only used for sorted output
+	int  array_size;			// Only used for sorted output
+	long long boundaries[HASHSET_TABLE_SIZE + 1];
+};
+
+static long long hashset_count_less_than_in_runs(struct to_array_data *data, long long value);
+static long long hashset_find_rank_boundary(struct to_array_data *data, long long rank);
+
+/* Arguments shared by threads of hashset_parallel_reduce(...) */
+struct reduce_data {
+	struct hashset_chain *set;
+	long long (*map)(int data);
+	long long (*combine)(long long, long long);
+	long long identity;
+};
 
 /*
  * Create hashset with initialization of table as well
@@ -45,6 +135,10 @@ hashset_create_set()
 
 	/* Initialize set */
 	set->size = 0;
+	set->writers	  = 0;
+	set->snapshotting = 0;
+	pthread_mutex_init(&(set->snapshot_lock), NULL);
+	pthread_cond_init(&(set->snapshot_cond), NULL);
 	for (i=0; i<HASHSET_TABLE_SIZE; i++) {
 		chain = treeset_create_set();
 		if (chain == NULL)
@@ -61,6 +155,8 @@ free_set:
 		chain = set->table[j];
 		treeset_free_set(chain);
 	}
+	pthread_cond_destroy(&(set->snapshot_cond));
+	pthread_mutex_destroy(&(set->snapshot_lock));
 	free(set);
 	return NULL;
 
@@ -70,6 +166,7 @@ succeess:
 
 /*
  * Free set and chains
+ * Nodes of chains are freed by multiple threads, see hashset_clear(...)
  */
 void
 hashset_free_set(struct hashset_chain *set)
@@ -80,21 +177,192 @@ hashset_free_set(struct hashset_chain *set)
 	if (set == NULL)
 		return;
 
+	hashset_clear(set);
 	for (i=0; i<HASHSET_TABLE_SIZE; i++) {
 		chain = set->table[i];
 		treeset_free_set(chain);
 	}
 
+	pthread_cond_destroy(&(set->snapshot_cond));
+	pthread_mutex_destroy(&(set->snapshot_lock));
 	free(set);
 }
 
 /*
+ * Free set on a background thread and return immediately.
+ * Caller MUST NOT touch set after calling this function.
+ * If the background thread can't be created, set is freed before returning.
+ *
+ * @return 1 if set is freed in background, 0 if freed by the calling thread
+ */
+int
+hashset_free_set_deferred(struct hashset_chain *set)
+{
+	int error;
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	if (set == NULL)
+		return 0;
+
+	error = pthread_attr_init(&attr);
+	if (!error) {
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		error = pthread_create(&tid, &attr, &hashset_free_set_in_background, set);
+		pthread_attr_destroy(&attr);
+	}
+
+	if (error) {
+		hashset_free_set(set);
+		return 0;
+	}
+	return 1;
+}
+
+static void *
+hashset_free_set_in_background(void *arg)
+{
+	hashset_free_set((struct hashset_chain *)arg);
+	return NULL;
+}
+
+/*
+ * Remove all elements from set so that set can be reused.
+ * Chains are freed by multiple threads.
+ */
+void
+hashset_clear(struct hashset_chain *set)
+{
+	int num_threads;
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+
+	if (set == NULL)
+		return;
+
+	hashset_begin_write(set);
+	num_threads = hashset_number_of_bucket_threads();
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_clear_in_buckets, set);
+
+	set->size = 0;
+	hashset_end_write(set);
+}
+
+/*
+ * Take a consistent snapshot of set in O(HASHSET_TABLE_SIZE).
+ * Each chain of the snapshot shares its nodes with set (see treeset_snapshot(...)),
+ * and nodes are copied only when set or the snapshot modifies them afterwards.
+ * Modifications in progress are completed before the snapshot is taken and
+ * new ones wait for it, so the snapshot never contains half of an operation.
+ * The snapshot is a set as any other: scan it from any threads while set keeps
+ * being modified, and free it with hashset_free_set(...)
+ *
+ * @return pointer to a new set, NULL if memory allocation failed
+ */
+struct hashset_chain *
+hashset_snapshot(struct hashset_chain *set)
+{
+	int i, j;
+	struct hashset_chain *snapshot;
+
+	if (set == NULL)
+		return NULL;
+
+	snapshot = (struct hashset_chain *)malloc(sizeof(struct hashset_chain));
+	if (snapshot == NULL) {
+		perror("Failed to allocate memory to snapshot");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&(set->snapshot_lock));
+	while (set->snapshotting)
+		pthread_cond_wait(&(set->snapshot_cond), &(set->snapshot_lock));
+	/* Pairs with the increment of writers in hashset_begin_write(...) */
+	__atomic_store_n(&(set->snapshotting), 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&(set->writers), __ATOMIC_SEQ_CST) > 0)
+		pthread_cond_wait(&(set->snapshot_cond), &(set->snapshot_lock));
+
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		snapshot->table[i] = treeset_snapshot(set->table[i]);
+		if (snapshot->table[i] == NULL)
+			break;
+	}
+	snapshot->size = set->size;
+
+	__atomic_store_n(&(set->snapshotting), 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&(set->snapshot_cond));
+	pthread_mutex_unlock(&(set->snapshot_lock));
+
+	if (i < HASHSET_TABLE_SIZE) {
+		perror("Failed to allocate memory to snapshot");
+		for (j = 0; j < i; j++)
+			treeset_free_set(snapshot->table[j]);
+		free(snapshot);
+		return NULL;
+	}
+
+	snapshot->writers	   = 0;
+	snapshot->snapshotting = 0;
+	pthread_mutex_init(&(snapshot->snapshot_lock), NULL);
+	pthread_cond_init(&(snapshot->snapshot_cond), NULL);
+	return snapshot;
+}
+
+/*
+ * Enter a modification of set, waiting while a snapshot is being taken.
+ * Every modifying function of this library is surrounded by hashset_begin_write(...)
+ * and hashset_end_write(...), so they're only needed by modules of the library that
+ * modify chains directly.
+ * Calls MUST NOT be nested in a thread, or it may wait for a snapshot forever.
+ *
+ * Without a snapshot pending, it's one atomic increment and snapshot_lock isn't touched,
+ * so writers of different buckets don't serialize on it.
+ */
+void
+hashset_begin_write(struct hashset_chain *set)
+{
+	for (;;) {
+		/* Either the snapshot sees this writer, or this writer sees the snapshot */
+		__atomic_add_fetch(&(set->writers), 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&(set->snapshotting), __ATOMIC_SEQ_CST))
+			return;
+
+		/* Back off so that the snapshot can be taken, and wait for it */
+		hashset_end_write(set);
+		pthread_mutex_lock(&(set->snapshot_lock));
+		while (set->snapshotting)
+			pthread_cond_wait(&(set->snapshot_cond), &(set->snapshot_lock));
+		pthread_mutex_unlock(&(set->snapshot_lock));
+	}
+}
+
+/*
+ * Leave a modification of set entered by hashset_begin_write(...)
+ */
+void
+hashset_end_write(struct hashset_chain *set)
+{
+	if (__atomic_sub_fetch(&(set->writers), 1, __ATOMIC_SEQ_CST) == 0 &&
+		__atomic_load_n(&(set->snapshotting), __ATOMIC_SEQ_CST)) {
+		/* Taking the lock makes sure the snapshot is waiting, or hasn't checked writers yet */
+		pthread_mutex_lock(&(set->snapshot_lock));
+		pthread_cond_broadcast(&(set->snapshot_cond));
+		pthread_mutex_unlock(&(set->snapshot_lock));
+	}
+}
+
+/*
+ * @return index of table that data belongs to
+ *
  * FIXME(mas): too simple to distribute data equally to table...
  */
-static int
+int
 hashset_hash_code(int data)
 {
-	return data % HASHSET_TABLE_SIZE;
+	int hash_value;
+
+	/* % keeps the sign of data, so negative data is shifted into the table */
+	hash_value = data % HASHSET_TABLE_SIZE;
+	return (hash_value < 0) ? hash_value + HASHSET_TABLE_SIZE : hash_value;
 }
 
 /*
@@ -256,6 +524,375 @@ hashset_find(struct hashset_chain *set,
 	return found;
 }
 
+/*
+ * Check if data is in set while other threads may be modifying set.
+ * The chain is walked without locks and the walk is validated by the version
+ * of the chain (see treeset_find_optimistic(...)), so concurrent lookups never
+ * write to the set and don't contend with each other.
+ * Modifications of the same bucket MUST still be serialized,
+ * e.g. by doing them from one thread or only by array operations.
+ *
+ * @return 1 if true 0 otherwise
+ */
+int
+hashset_find_optimistic(struct hashset_chain *set,
+						int data)
+{
+	int hash_value;
+
+	if (set == NULL) return 0;
+
+	hash_value = hashset_hash_code(data);
+	return treeset_find_optimistic(set->table[hash_value], data);
+}
+
+/*
+ * Open a buffered writer of set for the calling thread.
+ * hashset_writer_add(...) only puts data in the buffer of the writer,
+ * and buffered elements are added to set when the buffer is full or
+ * by hashset_writer_flush(...) and hashset_writer_close(...).
+ * Elements of a bucket are sorted and merged into the chain under one lock
+ * acquisition, so per-element costs of hashset_add(...) are amortized over the batch.
+ *
+ * Flushes can run concurrently with other writers and array operations on set,
+ * but not with operations with one element such as hashset_add(...).
+ * Buffered elements are not visible in set until they're flushed.
+ *
+ * @return pointer to a new writer, NULL if memory allocation failed
+ */
+struct hashset_writer *
+hashset_writer_open(struct hashset_chain *set)
+{
+	struct hashset_writer *writer;
+
+	if (set == NULL) return NULL;
+
+	writer = (struct hashset_writer *)malloc(sizeof(struct hashset_writer));
+	if (writer == NULL) {
+		perror("Failed to allocate memory for writer");
+		return NULL;
+	}
+
+	writer->set	  = set;
+	writer->count = 0;
+	return writer;
+}
+
+/*
+ * Buffer data to be added to the set of writer.
+ * The buffer is flushed first if it's full.
+ *
+ * @return 1 if data was buffered, 0 if flushing the buffer failed
+ */
+int
+hashset_writer_add(struct hashset_writer *writer,
+				   int data)
+{
+	int success;
+
+	if (writer == NULL) return 0;
+
+	success = 1;
+	if (writer->count == HASHSET_WRITER_BUFFER_SIZE)
+		success = hashset_writer_flush(writer);
+
+	writer->buffer[writer->count++] = data;
+	return success;
+}
+
+/*
+ * Add all buffered elements to the set of writer.
+ * Elements are grouped by bucket, and each group is sorted and deduplicated
+ * before any lock is taken. Then each chain is locked once to merge its group
+ * with treeset_add_sorted_array(...).
+ * The buffer is empty on return even if it fails.
+ *
+ * @return 1 if succeeded, 0 if some elements couldn't be added
+ */
+int
+hashset_writer_flush(struct hashset_writer *writer)
+{
+	int i, j, k, hash_value, error, success;
+	int offsets[HASHSET_TABLE_SIZE + 1];
+	int next[HASHSET_TABLE_SIZE];
+	int sizes[HASHSET_TABLE_SIZE];
+	struct hashset_chain *set;
+
+	if (writer == NULL) return 0;
+	if (writer->count == 0) return 1;
+
+	set = writer->set;
+
+	/* Group elements by bucket */
+	memset(offsets, 0, sizeof(offsets));
+	for (i = 0; i < writer->count; i++)
+		offsets[hashset_hash_code(writer->buffer[i]) + 1]++;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		offsets[i + 1] += offsets[i];
+		next[i] = offsets[i];
+	}
+	for (i = 0; i < writer->count; i++) {
+		hash_value = hashset_hash_code(writer->buffer[i]);
+		writer->runs[next[hash_value]++] = writer->buffer[i];
+	}
+	writer->count = 0;
+
+	/* Sort each group and drop duplicates */
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		sizes[i] = offsets[i + 1] - offsets[i];
+		if (sizes[i] <= 1)
+			continue;
+
+		qsort(writer->runs + offsets[i], sizes[i], sizeof(int), &hashset_compare_int);
+		for (j = offsets[i] + 1, k = offsets[i] + 1; j < offsets[i + 1]; j++)
+			if (writer->runs[j] != writer->runs[k - 1])
+				writer->runs[k++] = writer->runs[j];
+		sizes[i] = k - offsets[i];
+	}
+
+	error = pthread_once(&atmostonece_for_table_lock_init, hashset_table_lock_mutex_initialization);
+	if (error) {
+		perror("Failed to initialize table locks for writer");
+		return 0;
+	}
+
+	success = 1;
+	hashset_begin_write(set);
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		if (sizes[i] == 0)
+			continue;
+
+		error = HASHSET_INSTRUMENT_LOCK(&(table_locks[i]), i);
+		if (error) {
+			perror("Failed to lock bucket for writer");
+			success = 0;
+			continue;
+		}
+
+		/*** CRITICAL SECTION ****/
+		treeset_add_sorted_array(set->table[i], writer->runs + offsets[i], sizes[i]);
+		/*** CRITICAL SECTION ****/
+
+		pthread_mutex_unlock(&(table_locks[i]));
+	}
+	hashset_update_size(set);
+	hashset_end_write(set);
+
+	return success;
+}
+
+/*
+ * Flush and free writer. The set of writer is not freed.
+ *
+ * @return result of hashset_writer_flush(...)
+ */
+int
+hashset_writer_close(struct hashset_writer *writer)
+{
+	int success;
+
+	if (writer == NULL) return 0;
+
+	success = hashset_writer_flush(writer);
+	free(writer);
+	return success;
+}
+
+/*
+ * Create an empty batch of operations with arrays on set.
+ *
+ * A sequence such as hashset_add_array(...), hashset_remove_array(...) and
+ * hashset_find_array(...) on the same set starts and joins threads for each call.
+ * Queued with hashset_batch_enqueue(...) instead, all of them are done by
+ * hashset_batch_run(...) in one parallel pass: elements of all operations are
+ * grouped by bucket once, and each thread applies the operations to its chains
+ * in the order they were queued, locking each chain once.
+ * So an element added by one operation is found by a later one as if they were run one by one.
+ *
+ * @return pointer to a new batch, NULL if memory allocation failed
+ */
+struct hashset_batch *
+hashset_batch_create(struct hashset_chain *set)
+{
+	struct hashset_batch *batch;
+
+	if (set == NULL) return NULL;
+
+	batch = (struct hashset_batch *)calloc(1, sizeof(struct hashset_batch));
+	if (batch == NULL) {
+		perror("Failed to allocate memory for batch");
+		return NULL;
+	}
+
+	batch->set = set;
+	return batch;
+}
+
+/*
+ * Queue operation with array_data at the end of batch.
+ * operation is one of ADD, REMOVE, FIND and RETAIN, as hashset_add_array(...),
+ * hashset_remove_array(...), hashset_find_array(...) and hashset_retain_array(...).
+ * array_data is not copied.
+ *
+ * @return index of the operation for hashset_batch_result(...), -1 on failure
+ */
+int
+hashset_batch_enqueue(struct hashset_batch *batch,
+					  enum SET_OPERATION operation,
+					  int *array_data,
+					  int  array_size)
+{
+	int capacity;
+	struct hashset_batch_op *ops;
+
+	if (batch == NULL ||
+		array_size < 0 ||
+		(array_data == NULL && array_size > 0))
+		return -1;
+
+	if (batch->count == batch->capacity) {
+		capacity = (batch->capacity == 0) ? 16 : batch->capacity * 2;
+		ops = (struct hashset_batch_op *)realloc(batch->ops, capacity * sizeof(struct hashset_batch_op));
+		if (ops == NULL) {
+			perror("Failed to allocate memory for batch operations");
+			return -1;
+		}
+		batch->ops		= ops;
+		batch->capacity = capacity;
+	}
+
+	batch->ops[batch->count].operation	= operation;
+	batch->ops[batch->count].array_data = array_data;
+	batch->ops[batch->count].array_size = array_size;
+	batch->ops[batch->count].result		= 0;
+	return batch->count++;
+}
+
+/*
+ * Apply all operations of batch to its set in one parallel pass.
+ * Like array operations, it can run concurrently with array operations and
+ * buffered writers on the set, but not with operations with one element.
+ * Operations stay in batch for hashset_batch_result(...) until hashset_batch_clear(...).
+ *
+ * @return 1 if all operations were applied, 0 otherwise
+ */
+int
+hashset_batch_run(struct hashset_batch *batch)
+{
+	int i, o, j, n, hash_value, total, num_threads, success;
+	int *elements, *offsets, *next;
+	struct hashset_batch_op *op;
+	struct bucket_task *tasks;
+	struct batch_data data;
+
+	if (batch == NULL) return 0;
+	if (batch->count <= 0) return 1;
+
+	n = batch->count;
+	total = 0;
+	for (o = 0; o < n; o++) {
+		batch->ops[o].result = 1;
+		total += batch->ops[o].array_size;
+	}
+
+	success = 0;
+	elements = (int *)malloc((total > 0 ? total : 1) * sizeof(int));
+	offsets  = (int *)calloc((size_t)HASHSET_TABLE_SIZE * n + 1, sizeof(int));
+	next	 = (int *)malloc((size_t)HASHSET_TABLE_SIZE * n * sizeof(int));
+	if (elements == NULL || offsets == NULL || next == NULL) {
+		perror("Failed to allocate memory to run batch");
+		goto free_end;
+	}
+
+	/* Group elements by bucket, and by operation in the order of the batch within a bucket */
+	for (o = 0; o < n; o++) {
+		op = &(batch->ops[o]);
+		for (j = 0; j < op->array_size; j++)
+			offsets[hashset_hash_code(op->array_data[j]) * n + o + 1]++;
+	}
+	for (i = 0; i < HASHSET_TABLE_SIZE * n; i++) {
+		offsets[i + 1] += offsets[i];
+		next[i] = offsets[i];
+	}
+	for (o = 0; o < n; o++) {
+		op = &(batch->ops[o]);
+		for (j = 0; j < op->array_size; j++) {
+			hash_value = hashset_hash_code(op->array_data[j]);
+			elements[next[hash_value * n + o]++] = op->array_data[j];
+		}
+	}
+
+	if (pthread_once(&atmostonece_for_table_lock_init, hashset_table_lock_mutex_initialization)) {
+		perror("Failed to initialize table locks for batch");
+		goto free_end;
+	}
+
+	num_threads = hashset_number_of_bucket_threads();
+	if (num_threads > total / HASHSET_BATCH_ELEMENTS_PER_THREAD)
+		num_threads = total / HASHSET_BATCH_ELEMENTS_PER_THREAD;
+	if (num_threads < 1)
+		num_threads = 1;
+	tasks = (struct bucket_task *)calloc(num_threads, sizeof(struct bucket_task));
+	if (tasks == NULL) {
+		perror("Failed to allocate task memory");
+		goto free_end;
+	}
+
+	data.batch	  = batch;
+	data.elements = elements;
+	data.offsets  = offsets;
+	hashset_begin_write(batch->set);
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_batch_in_buckets, &data);
+	hashset_update_size(batch->set);
+	hashset_end_write(batch->set);
+
+	success = 1;
+	for (i = 0; i < num_threads; i++)
+		success &= (tasks[i].result == 0);
+	free(tasks);
+
+free_end:
+	free(elements);
+	free(offsets);
+	free(next);
+	return success;
+}
+
+/*
+ * @return result of the index-th operation of batch after hashset_batch_run(...),
+ *         i.e. what hashset_*_array(...) of the operation would return, always 1 for RETAIN.
+ *         0 if index is invalid.
+ */
+int
+hashset_batch_result(struct hashset_batch *batch,
+					 int index)
+{
+	if (batch == NULL || index < 0 || index >= batch->count)
+		return 0;
+	return batch->ops[index].result;
+}
+
+/*
+ * Remove all operations from batch to queue new ones
+ */
+void
+hashset_batch_clear(struct hashset_batch *batch)
+{
+	if (batch == NULL) return;
+	batch->count = 0;
+}
+
+/*
+ * Free batch. The set of batch and arrays of operations are not freed.
+ */
+void
+hashset_batch_free(struct hashset_batch *batch)
+{
+	if (batch == NULL) return;
+	free(batch->ops);
+	free(batch);
+}
+
 /*
  * Check if all elements in setB are in setA
  *
@@ -457,30 +1094,362 @@ hashset_symmetric_difference(struct hashset_chain *symmetric_difference_set,
 }
 
 /*
- * Template to do set operation with an element data
+ * Union of k sets. Like hashset_union(...), out SHOULD be an empty set provided by
+ * caller function, and MUST NOT be one of sets.
+ * Each bucket is done at once for all k sets: their chains are merged in order through
+ * a heap of the next element of each chain, and the chain of out is written once.
+ * Buckets are distributed over threads.
  *
- * @param set
- * @param data
- * @param treeset_function set operation defined in treeset.h
- * @return result of operation
+ * @return 1 if some elements are added to out, 0 otherwise (also on failure).
  */
-static int
-hashset_operation_template_with_data(
-	struct hashset_chain *set,
-	int data,
+int
+hashset_union_many(struct hashset_chain *out,
+				   struct hashset_chain **sets,
+				   int k)
+{
+	return hashset_many(out, sets, k, &hashset_union_many_in_buckets);
+}
+
+/*
+ * Intersection of k sets. Like hashset_intersection(...), out SHOULD be an empty set
+ * provided by caller function, and MUST NOT be one of sets.
+ * In each bucket, the elements of the smallest chain are the candidates, and they're
+ * checked against the other chains from the smaller to the larger one, so candidates
+ * only get fewer and the bucket is given up as soon as none is left.
+ * Buckets are distributed over threads.
+ *
+ * @return 1 if some elements are added to out, 0 otherwise (also on failure).
+ */
+int
+hashset_intersection_many(struct hashset_chain *out,
+						  struct hashset_chain **sets,
+						  int k)
+{
+	return hashset_many(out, sets, k, &hashset_intersection_many_in_buckets);
+}
+
+/*
+ * Set up iter to walk all elements in set
+ */
+void
+hashset_iter_init(struct hashset_iter *iter,
+				  struct hashset_chain *set)
+{
+	iter->set   = set;
+	iter->index = 0;
+	treeset_iter_init(&(iter->chain_iter), (set == NULL) ? NULL : set->table[0]);
+}
+
+/*
+ * Read the next element of set
+ *
+ * @param iter
+ * @param data where the element is stored
+ * @return 1 if an element is read, 0 if there's no more element
+ */
+int
+hashset_iter_next(struct hashset_iter *iter,
+				  int *data)
+{
+	if (iter->set == NULL)
+		return 0;
+
+	while (!treeset_iter_next(&(iter->chain_iter), data)) {
+		/* Current chain is exhausted, move on to the next one */
+		if (++(iter->index) >= HASHSET_TABLE_SIZE)
+			return 0;
+		treeset_iter_init(&(iter->chain_iter), iter->set->table[iter->index]);
+	}
+
+	return 1;
+}
+
+/*
+ * Call function(data, ctx) for every element of set.
+ * Chains are distributed over threads, so function MUST be thread-safe
+ * and the order of calls is not defined.
+ *
+ * @return 1 if operation succeeded, 0 otherwise
+ */
+int
+hashset_parallel_foreach(struct hashset_chain *set,
+						 void (*function)(int data, void *ctx),
+						 void *ctx)
+{
+	int num_threads, success;
+	struct bucket_task *tasks;
+	struct foreach_data data;
+
+	if (set == NULL || function == NULL)
+		return 0;
+
+	num_threads = hashset_number_of_bucket_threads();
+	tasks = (struct bucket_task *)calloc(num_threads, sizeof(struct bucket_task));
+	if (tasks == NULL) {
+		perror("Failed to allocate task memory");
+		return 0;
+	}
+
+	data.set	  = set;
+	data.function = function;
+	data.ctx	  = ctx;
+	success = hashset_run_bucket_tasks(tasks, num_threads, &hashset_foreach_in_buckets, &data);
+
+	free(tasks);
+	return success;
+}
+
+/*
+ * Map every element of set and combine the mapped values, i.e.
+ *     combine(... combine(combine(identity, map(x1)), map(x2)) ..., map(xn))
+ * Each thread accumulates its own chains starting from identity and
+ * the per-thread accumulators are combined at the end.
+ * Thus combine MUST be associative and identity MUST be its identity element.
+ *
+ * @return combined value, identity if set is empty or invalid
+ */
+long long
+hashset_parallel_reduce(struct hashset_chain *set,
+						long long (*map)(int data),
+						long long (*combine)(long long, long long),
+						long long identity)
+{
+	int i, num_threads;
+	long long result;
+	struct bucket_task *tasks;
+	struct reduce_data data;
+
+	if (set == NULL || map == NULL || combine == NULL)
+		return identity;
+
+	num_threads = hashset_number_of_bucket_threads();
+	tasks = (struct bucket_task *)calloc(num_threads, sizeof(struct bucket_task));
+	if (tasks == NULL) {
+		perror("Failed to allocate task memory");
+		return identity;
+	}
+
+	data.set	  = set;
+	data.map	  = map;
+	data.combine  = combine;
+	data.identity = identity;
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_reduce_in_buckets, &data);
+
+	/* Merge per-thread accumulators */
+	result = identity;
+	for (i = 0; i < num_threads; i++)
+		result = combine(result, tasks[i].result);
+
+	free(tasks);
+	return result;
+}
+
+/*
+ * Remove all elements of set for which predicate(data, ctx) returns non-zero.
+ * Each chain is filtered and rebuilt in one pass, and chains are
+ * distributed over threads, so predicate MUST be thread-safe.
+ *
+ * @return number of removed elements
+ */
+int
+hashset_remove_if(struct hashset_chain *set,
+				  int (*predicate)(int data, void *ctx),
+				  void *ctx)
+{
+	int removed;
+	int (*remove_if_func)(struct tree_set *, int (*)(int, void *), void *);
+
+	remove_if_func = &treeset_remove_if;
+	removed = hashset_filter(set, remove_if_func, predicate, ctx);
+
+	return removed;
+}
+
+/*
+ * Keep only elements of set for which predicate(data, ctx) returns non-zero.
+ * See hashset_remove_if(...) as well.
+ *
+ * @return number of removed elements
+ */
+int
+hashset_retain_if(struct hashset_chain *set,
+				  int (*predicate)(int data, void *ctx),
+				  void *ctx)
+{
+	int removed;
+	int (*retain_if_func)(struct tree_set *, int (*)(int, void *), void *);
+
+	retain_if_func = &treeset_retain_if;
+	removed = hashset_filter(set, retain_if_func, predicate, ctx);
+
+	return removed;
+}
+
+/*
+ * Template of hashset_remove_if(...) and hashset_retain_if(...)
+ *
+ * @param set
+ * @param treeset_function filter function defined in treeset.h
+ * @param predicate
+ * @param ctx
+ * @return number of removed elements
+ */
+static int
+hashset_filter(struct hashset_chain *set,
+			   int (*treeset_function)(struct tree_set *, int (*)(int, void *), void *),
+			   int (*predicate)(int data, void *ctx),
+			   void *ctx)
+{
+	int i, num_threads, removed;
+	struct bucket_task *tasks;
+	struct filter_data data;
+
+	if (set == NULL || predicate == NULL)
+		return 0;
+
+	num_threads = hashset_number_of_bucket_threads();
+	tasks = (struct bucket_task *)calloc(num_threads, sizeof(struct bucket_task));
+	if (tasks == NULL) {
+		perror("Failed to allocate task memory");
+		return 0;
+	}
+
+	data.set			  = set;
+	data.treeset_function = treeset_function;
+	data.predicate		  = predicate;
+	data.ctx			  = ctx;
+	hashset_begin_write(set);
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_filter_in_buckets, &data);
+
+	removed = 0;
+	for (i = 0; i < num_threads; i++)
+		removed += (int)tasks[i].result;
+
+	hashset_update_size(set);
+	hashset_end_write(set);
+	free(tasks);
+	return removed;
+}
+
+/*
+ * Shallow copy elements of set to array_data.
+ * Each thread copies its chains to their own offsets computed from chain sizes.
+ * If sorted is non-zero, the already sorted chains are then merged
+ * in parallel so that array_data is in accending order.
+ *
+ * @param set
+ * @param array_data array to store elements
+ * @param array_size maximum number of elements the array can store
+ * @param sorted non-zero to sort elements in accending order
+ * @return number of elements stored, or -1 if memory allocation failed
+ *
+ * [NOTE]
+ * If array_size is smaller than the set size, only array_size elements are stored,
+ * which are the smallest ones when sorted.
+ */
+int
+hashset_to_array(struct hashset_chain *set,
+				 int *array_data,
+				 int  array_size,
+				 int  sorted)
+{
+	int i, num_threads, num_slices, total, stored;
+	struct bucket_task *tasks;
+	struct to_array_data *data;
+
+	if (set == NULL			||
+		array_data == NULL	||
+		array_size < 0)
+		return 0;
+
+	num_threads = hashset_number_of_bucket_threads();
+	tasks = (struct bucket_task *)calloc(num_threads, sizeof(struct bucket_task));
+	data  = (struct to_array_data *)malloc(sizeof(struct to_array_data));
+	if (tasks == NULL || data == NULL) {
+		perror("Failed to allocate task memory");
+		stored = -1;
+		goto end;
+	}
+
+	/* Compute where each chain starts */
+	total = 0;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		data->offsets[i] = total;
+		total += set->table[i]->size;
+	}
+	data->offsets[HASHSET_TABLE_SIZE] = total;
+	data->set = set;
+	stored	  = (total < array_size) ? total : array_size;
+
+	if (!sorted) {
+		data->runs		= array_data;
+		data->runs_size = array_size;
+		hashset_run_bucket_tasks(tasks, num_threads, &hashset_to_array_in_buckets, data);
+		goto end;
+	}
+
+	/* Sorted: copy chains as sorted runs first, then merge them into array_data */
+	data->runs = (int *)malloc((total > 0 ? total : 1) * sizeof(int));
+	if (data->runs == NULL) {
+		perror("Failed to allocate memory to merge chains");
+		stored = -1;
+		goto end;
+	}
+	data->runs_size  = total;
+	data->array_data = array_data;
+	data->array_size = array_size;
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_to_array_in_buckets, data);
+
+	/*
+	 * Split the output into slices of the same number of elements.
+	 * Slices don't overlap in value, thus each thread can merge its slice independently.
+	 */
+	num_slices = (total < num_threads) ? 1 : num_threads;
+	data->boundaries[0]			 = (long long)INT_MIN;
+	data->boundaries[num_slices] = (long long)INT_MAX + 1;
+	for (i = 1; i < num_slices; i++)
+		data->boundaries[i] = hashset_find_rank_boundary(data, (long long)total * i / num_slices);
+
+	hashset_run_range_tasks(tasks, num_slices, num_slices, 0, &hashset_merge_runs_in_slices, data);
+	free(data->runs);
+
+end:
+	free(tasks);
+	free(data);
+	return stored;
+}
+
+/*
+ * Template to do set operation with an element data
+ *
+ * @param set
+ * @param data
+ * @param treeset_function set operation defined in treeset.h
+ * @return result of operation
+ */
+static int
+hashset_operation_template_with_data(
+	struct hashset_chain *set,
+	int data,
 	int (*treeset_function)(struct tree_set*, int))
 {
-	int hash_value, result;
+	int hash_value, result, writes;
 	struct tree_set *chain;
 
 	if (set == NULL) return 0;
 
+	writes = (treeset_function != &treeset_find);
+	if (writes)
+		hashset_begin_write(set);
+
 	hash_value = hashset_hash_code(data);
 	chain 	   = set->table[hash_value];
 
 	result = treeset_function(chain, data);
 	hashset_update_size(set);
 
+	if (writes)
+		hashset_end_write(set);
 	return result;
 }
 
@@ -505,9 +1474,14 @@ hashset_operation_template_with_set(
 	if (setA == NULL || setB == NULL)
 		return 0;
 
+	if (operation != FIND)
+		hashset_begin_write(setA);
+
 	result = hashset_set_operation(operation, setA, setB, NULL, -1);
 	hashset_update_size(setA);
 
+	if (operation != FIND)
+		hashset_end_write(setA);
 	return result;
 }
 
@@ -535,9 +1509,14 @@ hashset_operation_template_with_array(
 		array_size < 0)
 		return 0;
 
+	if (operation != FIND)
+		hashset_begin_write(set);
+
 	result = hashset_set_operation(operation, set, NULL, array_data, array_size);
 	hashset_update_size(set);
 
+	if (operation != FIND)
+		hashset_end_write(set);
 	return result;
 }
 
@@ -579,9 +1558,14 @@ hashset_set_operation(enum SET_OPERATION operation,
 	pthread_t *tid;
 	struct task_data *data;
 	struct thread_task *tasks;
+#ifdef HASHSET_TRACE
+	unsigned long long operation_begin, phase_begin;
+#endif
 
+	HASHSET_TRACE_BEGIN(operation_begin);
 	num_threads = hashset_compute_proper_number_of_threads(setB, array_size);
 	/* Set up pthreads, data for task, tasks, and pthread_once for array operations */
+	HASHSET_TRACE_BEGIN(phase_begin);
 	tid = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
 	if (tid == NULL) {
 		perror("Failed to allocate pthread memory");
@@ -609,11 +1593,15 @@ hashset_set_operation(enum SET_OPERATION operation,
 
 	/* Set up task data */
 	hashset_setup_task_data(data, operation, setA, setB, array_data, array_size);
+	HASHSET_TRACE_END("alloc", hashset_trace_operation(operation), phase_begin, 0, num_threads);
 
 	/* Create threads as many threads as being set up */
+	HASHSET_TRACE_BEGIN(phase_begin);
 	hashset_create_thread(tid, data, tasks, num_threads);
+	HASHSET_TRACE_END("create_threads", hashset_trace_operation(operation), phase_begin, 0, num_threads);
 
 	/* Wait for thread execution */
+	HASHSET_TRACE_BEGIN(phase_begin);
 	for (i = 0; i < num_threads; i++)
 	{
 		if (pthread_equal(pthread_self(), tid[i]))
@@ -623,6 +1611,7 @@ hashset_set_operation(enum SET_OPERATION operation,
 		if (error)
 			perror("failed to join thread");
 	}
+	HASHSET_TRACE_END("join", hashset_trace_operation(operation), phase_begin, 0, num_threads);
 
 	success = 1;
 	for (i = 0; i < num_threads; i++)
@@ -639,6 +1628,7 @@ free_tid_end:
 	free(tid);
 
 end:
+	HASHSET_TRACE_END("hashset_set_operation", hashset_trace_operation(operation), operation_begin, 0, num_threads);
 	return success;
 }
 
@@ -669,6 +1659,7 @@ hashset_create_thread(pthread_t *tid,
 
 		/* Create task with proper set operation */
 		hashset_setup_thread_task(data, &(tasks[i]), from, to);
+		tasks[i].node = (data->setB != NULL) ? hashset_numa_node_of_thread(i, num_threads) : -1;
 
 		/* Create threads */
 		error = pthread_create(tid + i, NULL, &hashset_thread_operation, &tasks[i]);
@@ -719,6 +1710,49 @@ hashset_setup_task_data(struct task_data *data,
 	data->setB = setB;
 	data->array_data = array_data;
 	data->array_size = array_size;
+
+	if (setB != NULL)
+		hashset_sort_buckets_by_work(data);
+}
+
+/*
+ * Order the work queue of data so that the largest chains are taken first.
+ * The work of a bucket is estimated as the sum of sizes of both chains.
+ * With buckets of very different sizes (skewed data), threads which took
+ * large chains early don't get more, and others share the small ones,
+ * so they finish at almost the same time unlike with fixed ranges of the table.
+ *
+ * With HASHSET_NUMA, buckets are first grouped by their node so that
+ * each node has its own queue (see hashset_numa_node_of_bucket(...)).
+ */
+static void
+hashset_sort_buckets_by_work(struct task_data *data)
+{
+	int i, j, bucket, node;
+	long long work[HASHSET_TABLE_SIZE];
+
+	data->num_nodes = hashset_numa_nodes();
+	if (data->num_nodes > HASHSET_NUMA_MAX_NODES)
+		data->num_nodes = HASHSET_NUMA_MAX_NODES;
+
+	/* Insertion sort as the table is small. Buckets of a node are contiguous in the table. */
+	node = 0;
+	data->node_begin[0] = 0;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+	{
+		while (node < hashset_numa_node_of_bucket(i))
+			data->node_begin[++node] = i;
+		work[i] = (long long)data->setA->table[i]->size + data->setB->table[i]->size;
+		bucket = i;
+		for (j = i; j > data->node_begin[node] && work[data->buckets[j-1]] < work[bucket]; j--)
+			data->buckets[j] = data->buckets[j-1];
+		data->buckets[j] = bucket;
+	}
+	while (node < data->num_nodes)
+		data->node_begin[++node] = HASHSET_TABLE_SIZE;
+
+	for (node = 0; node < data->num_nodes; node++)
+		data->next_bucket[node] = data->node_begin[node];
 }
 
 /*
@@ -775,48 +1809,70 @@ static void *
 hashset_thread_operation(void *arg)
 {	
 	struct thread_task *task;
+#if defined(HASHSET_INSTRUMENT) || defined(HASHSET_TRACE)
+	unsigned long long begin;
+#endif
 	task = (struct thread_task *)arg;
 
+	/*
+	 * Nodes allocated from now on by this thread are in memory of its node.
+	 * Elements of a slice of array go to buckets of any node, so threads of
+	 * operations with array have no node and are left where they are.
+	 */
+	hashset_numa_bind_thread(task->node);
+
+	HASHSET_INSTRUMENT_BEGIN(begin);
+	HASHSET_TRACE_BEGIN(begin);
 	if (task->data->setB) // Indicates that we'll operate with set, NOT ARRAY.
 		hashset_operate_with_all_elements_of_set(task);
 	else
 		hashset_operate_with_all_elements_of_array(task);
+	HASHSET_INSTRUMENT_END(operations[task->data->operation], begin);
+	HASHSET_TRACE_END("task", hashset_trace_operation(task->data->operation), begin, task->from, task->to);
 
 	return NULL;
 }
 
 /*
- * Actual set operation by one thread. Each thread has its own task doing the operation
- * between table[i] to table[j] of setA and setB. They do set operation using
- * table[i] of setA and setB where from <= i < to.
+ * Actual set operation by one thread. Each thread takes the next table index i
+ * from the work queue of its node until it's empty, then from queues of other nodes,
+ * and does set operation using table[i] of setA and setB.
  * This is correct as, for example, table[i] of setA and setB has elements whose hash values
  * are the same. So any elements in the table[i] simply belong to table[i] of ANY set based on
  * our definition.
  *
  * [NOTE]
- * The range of the operation for hash table is determined in hashset_create_thread(...)
+ * The order of the queue is determined in hashset_sort_buckets_by_work(...)
  */
 static void
 hashset_operate_with_all_elements_of_set(struct thread_task *task)
 {
-	int i, from, to, success_bit;
+	int i, n, node, next, success_bit;
 	struct task_data *data;
 	struct hashset_chain *setA, *setB;
 	struct tree_set *chainA, *chainB;
 	int (*treeset_function)(struct tree_set *, struct tree_set *);
+#ifdef HASHSET_TRACE
+	unsigned long long chain_begin;
+#endif
 
-	from = task->from;
-	to   = task->to;
 	data = task->data;
 	setA = data->setA;
 	setB = data->setB;
 	treeset_function = task->function_with_chain;
 
 	success_bit = 1;
-	for (i=from; i < to; i++) {
-		chainA = setA->table[i];
-		chainB = setB->table[i];
-		success_bit &= treeset_function(chainA, chainB);
+	for (n = 0; n < data->num_nodes; n++)
+	{
+		node = (task->node + n) % data->num_nodes;
+		while ((next = __atomic_fetch_add(&(data->next_bucket[node]), 1, __ATOMIC_RELAXED)) < data->node_begin[node+1]) {
+			i = data->buckets[next];
+			HASHSET_TRACE_BEGIN(chain_begin);
+			chainA = setA->table[i];
+			chainB = setB->table[i];
+			success_bit &= treeset_function(chainA, chainB);
+			HASHSET_TRACE_END("chain", hashset_trace_operation(data->operation), chain_begin, i, i + 1);
+		}
 	}
 
 	task->success = success_bit; //check if all treeset_function operation succeeded.
@@ -853,7 +1909,7 @@ hashset_operate_with_all_elements_of_array(struct thread_task *task)
 		hash_value = hashset_hash_code(d);
 
 		/* mutex lock for set->table[hash_value] */
-		error = pthread_mutex_lock(&(table_locks[hash_value]));
+		error = HASHSET_INSTRUMENT_LOCK(&(table_locks[hash_value]), hash_value);
 		if (error) {
 			task->success = 0;
 			return;
@@ -874,3 +1930,622 @@ hashset_operate_with_all_elements_of_array(struct thread_task *task)
 
 	task->success = success_bit;
 }
+
+/*
+ * Compute the number of threads for operations over the table.
+ * Use this to size tasks for hashset_run_bucket_tasks(...)
+ */
+int
+hashset_number_of_bucket_threads(void)
+{
+	return (HASHSET_TABLE_SIZE < NUM_THREADS) ? HASHSET_TABLE_SIZE : NUM_THREADS;
+}
+
+/*
+ * Split the table into num_threads ranges and run function for each range on its own thread.
+ * The first range is done by the calling thread, and so is any range whose thread
+ * failed to be created.
+ * This is the building block for operations that work chain by chain, such as
+ * hashset_parallel_foreach(...) here or hashset_load(...) in hashset_io.c
+ *
+ * @param tasks array of num_threads tasks, filled by this function
+ * @param num_threads number of threads, at most hashset_number_of_bucket_threads()
+ * @param function called once per task
+ * @param arg set to task->arg of every task
+ * @return 1 if all threads were joined, 0 otherwise
+ */
+int
+hashset_run_bucket_tasks(struct bucket_task *tasks,
+						 int num_threads,
+						 void (*function)(struct bucket_task *),
+						 void *arg)
+{
+	return hashset_run_range_tasks(tasks, num_threads, HASHSET_TABLE_SIZE, 1, function, arg);
+}
+
+/*
+ * Same as hashset_run_bucket_tasks(...) but splits index range [0, size) instead of the table.
+ * num_threads MUST NOT be bigger than HASHSET_TABLE_SIZE.
+ *
+ * @param bind 1 if ranges are buckets, so that each created thread is bound to the
+ *        node of its first bucket. The calling thread is never bound.
+ */
+static int
+hashset_run_range_tasks(struct bucket_task *tasks,
+						int num_threads,
+						int size,
+						int bind,
+						void (*function)(struct bucket_task *),
+						void *arg)
+{
+	int i, error, success, next_index, task_size_per_thread;
+	pthread_t tid[HASHSET_TABLE_SIZE];
+	int created[HASHSET_TABLE_SIZE];
+
+	next_index = 0;
+	for (i = 0; i < num_threads; i++)
+	{
+		task_size_per_thread = (size - next_index) / (num_threads - i);
+
+		tasks[i].from	  = next_index;
+		tasks[i].to		  = (i == num_threads-1) ? size : next_index + task_size_per_thread;
+		tasks[i].result	  = 0;
+		tasks[i].arg	  = arg;
+		tasks[i].function = function;
+		tasks[i].node	  = (bind && i > 0) ? hashset_numa_node_of_bucket(tasks[i].from) : -1;
+
+		next_index += task_size_per_thread;
+	}
+
+	for (i = 1; i < num_threads; i++)
+	{
+		error = pthread_create(tid + i, NULL, &hashset_bucket_thread_operation, &tasks[i]);
+		created[i] = !error;
+	}
+
+	hashset_bucket_thread_operation(&tasks[0]);
+
+	success = 1;
+	for (i = 1; i < num_threads; i++)
+	{
+		if (!created[i]) {
+			tasks[i].node = -1;
+			hashset_bucket_thread_operation(&tasks[i]);
+			continue;
+		}
+
+		error = pthread_join(tid[i], NULL);
+		if (error) {
+			perror("failed to join thread");
+			success = 0;
+		}
+	}
+
+	return success;
+}
+
+static void *
+hashset_bucket_thread_operation(void *arg)
+{
+	struct bucket_task *task;
+#ifdef HASHSET_INSTRUMENT
+	unsigned long long begin;
+#endif
+	task = (struct bucket_task *)arg;
+
+	/* Nodes of chains of the range are allocated in memory of their node */
+	hashset_numa_bind_thread(task->node);
+
+	HASHSET_INSTRUMENT_BEGIN(begin);
+	task->function(task);
+	HASHSET_INSTRUMENT_END(bucket_tasks, begin);
+
+	return NULL;
+}
+
+static void
+hashset_foreach_in_buckets(struct bucket_task *task)
+{
+	int i, d;
+	struct foreach_data *data;
+	struct treeset_iter iter;
+
+	data = (struct foreach_data *)task->arg;
+	for (i = task->from; i < task->to; i++) {
+		treeset_iter_init(&iter, data->set->table[i]);
+		while (treeset_iter_next(&iter, &d))
+			data->function(d, data->ctx);
+	}
+}
+
+static void
+hashset_reduce_in_buckets(struct bucket_task *task)
+{
+	int i, d;
+	long long accumulator;
+	struct reduce_data *data;
+	struct treeset_iter iter;
+
+	data = (struct reduce_data *)task->arg;
+	accumulator = data->identity;
+	for (i = task->from; i < task->to; i++) {
+		treeset_iter_init(&iter, data->set->table[i]);
+		while (treeset_iter_next(&iter, &d))
+			accumulator = data->combine(accumulator, data->map(d));
+	}
+
+	task->result = accumulator;
+}
+
+static void
+hashset_filter_in_buckets(struct bucket_task *task)
+{
+	int i, removed;
+	struct filter_data *data;
+
+	data = (struct filter_data *)task->arg;
+	removed = 0;
+	for (i = task->from; i < task->to; i++)
+		removed += data->treeset_function(data->set->table[i], data->predicate, data->ctx);
+
+	task->result = removed;
+}
+
+/*
+ * Apply operations of the batch to chains of task in the order of the batch.
+ * task->result is the number of chains that couldn't be locked.
+ */
+static void
+hashset_batch_in_buckets(struct bucket_task *task)
+{
+	int i, o, j, n, from, to, result;
+	struct batch_data *data;
+	struct hashset_batch_op *op;
+	struct tree_set *chain;
+	struct batch_retain retain;
+
+	data = (struct batch_data *)task->arg;
+	n = data->batch->count;
+	task->result = 0;
+	for (i = task->from; i < task->to; i++) {
+		if (HASHSET_INSTRUMENT_LOCK(&(table_locks[i]), i)) {
+			task->result++;
+			for (o = 0; o < n; o++)
+				__atomic_store_n(&(data->batch->ops[o].result), 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/*** CRITICAL SECTION ****/
+		chain = data->batch->set->table[i];
+		for (o = 0; o < n; o++) {
+			op	 = &(data->batch->ops[o]);
+			from = data->offsets[i * n + o];
+			to	 = data->offsets[i * n + o + 1];
+
+			result = 1;
+			switch(op->operation) {
+				case ADD:
+					for (j = from; j < to; j++)
+						result &= treeset_add(chain, data->elements[j]);
+					break;
+				case REMOVE:
+					for (j = from; j < to; j++)
+						result &= treeset_remove(chain, data->elements[j]);
+					break;
+				case FIND:
+					for (j = from; j < to; j++)
+						result &= treeset_find(chain, data->elements[j]);
+					break;
+				case RETAIN:
+					/* Even a chain without elements of the operation is retained, i.e. cleared */
+					retain.array = data->elements + from;
+					retain.size	 = to - from;
+					qsort(retain.array, retain.size, sizeof(int), &hashset_compare_int);
+					treeset_retain_if(chain, &hashset_batch_contains, &retain);
+					break;
+				default:
+					;
+			}
+			if (!result)
+				__atomic_store_n(&(op->result), 0, __ATOMIC_RELAXED);
+		}
+		/*** CRITICAL SECTION ****/
+
+		pthread_mutex_unlock(&(table_locks[i]));
+	}
+}
+
+/*
+ * Predicate of retain operations of hashset_batch_in_buckets(...)
+ */
+static int
+hashset_batch_contains(int data,
+					   void *ctx)
+{
+	struct batch_retain *retain;
+
+	retain = (struct batch_retain *)ctx;
+	return bsearch(&data, retain->array, retain->size, sizeof(int), &hashset_compare_int) != NULL;
+}
+
+/*
+ * Template of hashset_union_many(...) and hashset_intersection_many(...)
+ */
+static int
+hashset_many(struct hashset_chain *out,
+			 struct hashset_chain **sets,
+			 int k,
+			 void (*function)(struct bucket_task *))
+{
+	int i, num_threads, modified;
+	struct bucket_task *tasks;
+	struct many_data data;
+
+	if (out == NULL || sets == NULL || k <= 0)
+		return 0;
+	for (i = 0; i < k; i++)
+		if (sets[i] == NULL || sets[i] == out)
+			return 0;
+
+	num_threads = hashset_number_of_bucket_threads();
+	tasks = (struct bucket_task *)calloc(num_threads, sizeof(struct bucket_task));
+	if (tasks == NULL) {
+		perror("Failed to allocate task memory");
+		return 0;
+	}
+
+	data.out	= out;
+	data.sets	= sets;
+	data.k		= k;
+	data.failed = 0;
+	hashset_begin_write(out);
+	hashset_run_bucket_tasks(tasks, num_threads, function, &data);
+	hashset_update_size(out);
+	hashset_end_write(out);
+
+	modified = 0;
+	for (i = 0; i < num_threads; i++)
+		modified |= (tasks[i].result > 0);
+	free(tasks);
+
+	return data.failed ? 0 : modified;
+}
+
+/*
+ * k-way merge of chains of each bucket of task.
+ * heap holds indexes of the chains that still have elements, ordered by heads,
+ * the next element of each chain. Equal elements of several chains come out one
+ * after the other, so duplicates are dropped by comparing with the last one written.
+ * task->result is the number of chains of out modified.
+ */
+static void
+hashset_union_many_in_buckets(struct bucket_task *task)
+{
+	int i, j, k, size, capacity, heap_size, count, top;
+	int *heap, *heads, *buffer;
+	struct many_data *data;
+	struct treeset_iter *iters;
+
+	data = (struct many_data *)task->arg;
+	k = data->k;
+	task->result = 0;
+
+	buffer	 = NULL;
+	capacity = 0;
+	heap  = (int *)malloc(k * sizeof(int));
+	heads = (int *)malloc(k * sizeof(int));
+	iters = (struct treeset_iter *)malloc(k * sizeof(struct treeset_iter));
+	if (heap == NULL || heads == NULL || iters == NULL) {
+		perror("Failed to allocate memory for union of sets");
+		__atomic_store_n(&(data->failed), 1, __ATOMIC_RELAXED);
+		goto end;
+	}
+
+	for (i = task->from; i < task->to; i++) {
+		size = 0;
+		heap_size = 0;
+		for (j = 0; j < k; j++) {
+			size += data->sets[j]->table[i]->size;
+			treeset_iter_init(&(iters[j]), data->sets[j]->table[i]);
+			if (treeset_iter_next(&(iters[j]), &(heads[j])))
+				heap[heap_size++] = j;
+		}
+		if (heap_size == 0)
+			continue;
+
+		if (size > capacity) {
+			free(buffer);
+			capacity = size;
+			buffer = (int *)malloc(capacity * sizeof(int));
+			if (buffer == NULL) {
+				perror("Failed to allocate memory for union of sets");
+				__atomic_store_n(&(data->failed), 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+
+		for (j = heap_size / 2 - 1; j >= 0; j--)
+			hashset_heap_sift_down(heap, heap_size, heads, j);
+
+		count = 0;
+		while (heap_size > 0) {
+			top = heap[0];
+			if (count == 0 || buffer[count - 1] != heads[top])
+				buffer[count++] = heads[top];
+
+			if (!treeset_iter_next(&(iters[top]), &(heads[top])))
+				heap[0] = heap[--heap_size];
+			hashset_heap_sift_down(heap, heap_size, heads, 0);
+		}
+
+		task->result += treeset_add_sorted_array(data->out->table[i], buffer, count);
+	}
+
+end:
+	free(buffer);
+	free(heap);
+	free(heads);
+	free(iters);
+}
+
+/*
+ * Restore the order of the min-heap of chain indexes below index
+ */
+static void
+hashset_heap_sift_down(int *heap,
+					   int size,
+					   int *heads,
+					   int index)
+{
+	int child, tmp;
+
+	while ((child = 2 * index + 1) < size) {
+		if (child + 1 < size && heads[heap[child + 1]] < heads[heap[child]])
+			child++;
+		if (heads[heap[index]] <= heads[heap[child]])
+			break;
+		tmp = heap[index];
+		heap[index] = heap[child];
+		heap[child] = tmp;
+		index = child;
+	}
+}
+
+/*
+ * Intersection of chains of each bucket of task, smallest chain first.
+ * Candidates are checked against a chain by looking each of them up when they're far fewer
+ * than the elements of the chain, otherwise by walking both in order.
+ * task->result is the number of chains of out modified.
+ */
+static void
+hashset_intersection_many_in_buckets(struct bucket_task *task)
+{
+	int i, j, m, k, size, capacity, count, kept, has, d;
+	int *order, *buffer;
+	struct tree_set *chain;
+	struct many_data *data;
+	struct treeset_iter iter;
+
+	data = (struct many_data *)task->arg;
+	k = data->k;
+	task->result = 0;
+
+	buffer	 = NULL;
+	capacity = 0;
+	order = (int *)malloc(k * sizeof(int));
+	if (order == NULL) {
+		perror("Failed to allocate memory for intersection of sets");
+		__atomic_store_n(&(data->failed), 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (i = task->from; i < task->to; i++) {
+		/* Insertion sort of chains by size as k is small */
+		for (j = 0; j < k; j++) {
+			size = data->sets[j]->table[i]->size;
+			for (m = j; m > 0 && data->sets[order[m-1]]->table[i]->size > size; m--)
+				order[m] = order[m-1];
+			order[m] = j;
+		}
+
+		size = data->sets[order[0]]->table[i]->size;
+		if (size == 0)
+			continue;
+
+		if (size > capacity) {
+			free(buffer);
+			capacity = size;
+			buffer = (int *)malloc(capacity * sizeof(int));
+			if (buffer == NULL) {
+				perror("Failed to allocate memory for intersection of sets");
+				__atomic_store_n(&(data->failed), 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+
+		treeset_to_array(data->sets[order[0]]->table[i], buffer, size);
+		count = size;
+		for (j = 1; j < k && count > 0; j++) {
+			chain = data->sets[order[j]]->table[i];
+			kept = 0;
+			if (count < chain->size / 16) {
+				for (m = 0; m < count; m++)
+					if (treeset_find(chain, buffer[m]))
+						buffer[kept++] = buffer[m];
+			}
+			else {
+				treeset_iter_init(&iter, chain);
+				has = treeset_iter_next(&iter, &d);
+				for (m = 0; m < count && has; m++) {
+					while (has && d < buffer[m])
+						has = treeset_iter_next(&iter, &d);
+					if (has && d == buffer[m])
+						buffer[kept++] = buffer[m];
+				}
+			}
+			count = kept;
+		}
+
+		if (count > 0)
+			task->result += treeset_add_sorted_array(data->out->table[i], buffer, count);
+	}
+
+	free(buffer);
+	free(order);
+}
+
+static void
+hashset_to_array_in_buckets(struct bucket_task *task)
+{
+	int i, offset, size;
+	struct to_array_data *data;
+
+	data = (struct to_array_data *)task->arg;
+	for (i = task->from; i < task->to; i++) {
+		offset = data->offsets[i];
+		if (offset >= data->runs_size)
+			break;
+
+		size = data->offsets[i+1] - offset;
+		if (size > data->runs_size - offset)
+			size = data->runs_size - offset;
+		treeset_to_array(data->set->table[i], data->runs + offset, size);
+	}
+}
+
+/*
+ * Merge the part of every run that falls into the slices [from, to) into array_data.
+ * The smallest head of runs is picked by a binary heap of run indexes.
+ */
+static void
+hashset_merge_runs_in_slices(struct bucket_task *task)
+{
+	int i, j, k, t, run, child, heap_size, out, end;
+	int heap[HASHSET_TABLE_SIZE], head[HASHSET_TABLE_SIZE], tail[HASHSET_TABLE_SIZE];
+	struct to_array_data *data;
+	int *runs;
+
+	data = (struct to_array_data *)task->arg;
+	runs = data->runs;
+
+	for (t = task->from; t < task->to; t++) {
+		/* Locate the slice in each run and in the output */
+		out = 0;
+		heap_size = 0;
+		for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+			int size = data->offsets[i+1] - data->offsets[i];
+			head[i] = data->offsets[i] + hashset_lower_bound(runs + data->offsets[i], size, data->boundaries[t]);
+			tail[i] = data->offsets[i] + hashset_lower_bound(runs + data->offsets[i], size, data->boundaries[t+1]);
+			out += head[i] - data->offsets[i];
+			if (head[i] < tail[i])
+				heap[heap_size++] = i;
+		}
+
+		/* Heapify */
+		for (k = heap_size / 2 - 1; k >= 0; k--) {
+			run = heap[k];
+			for (j = k; (child = 2*j + 1) < heap_size; j = child) {
+				if (child + 1 < heap_size && runs[head[heap[child+1]]] < runs[head[heap[child]]])
+					child++;
+				if (runs[head[run]] <= runs[head[heap[child]]])
+					break;
+				heap[j] = heap[child];
+			}
+			heap[j] = run;
+		}
+
+		end = data->array_size;
+		while (heap_size > 0 && out < end) {
+			run = heap[0];
+			data->array_data[out++] = runs[head[run]++];
+
+			/* Drop exhausted run and sift down the new top */
+			if (head[run] == tail[run])
+				run = heap[--heap_size];
+			for (j = 0; (child = 2*j + 1) < heap_size; j = child) {
+				if (child + 1 < heap_size && runs[head[heap[child+1]]] < runs[head[heap[child]]])
+					child++;
+				if (runs[head[run]] <= runs[head[heap[child]]])
+					break;
+				heap[j] = heap[child];
+			}
+			if (heap_size > 0)
+				heap[j] = run;
+		}
+	}
+}
+
+/*
+ * @return index of the first element in sorted array that is not less than data
+ */
+static int
+hashset_lower_bound(int *array, int size, long long data)
+{
+	int from, to, mid;
+
+	from = 0;
+	to	 = size;
+	while (from < to) {
+		mid = from + (to - from) / 2;
+		if (array[mid] < data)
+			from = mid + 1;
+		else
+			to = mid;
+	}
+	return from;
+}
+
+static long long
+hashset_count_less_than_in_runs(struct to_array_data *data, long long value)
+{
+	int i;
+	long long count;
+
+	count = 0;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+		count += hashset_lower_bound(data->runs + data->offsets[i], data->offsets[i+1] - data->offsets[i], value);
+
+	return count;
+}
+
+/*
+ * Binary-search the value domain for the smallest value v such that
+ * at least rank elements are less than v.
+ */
+static long long
+hashset_find_rank_boundary(struct to_array_data *data, long long rank)
+{
+	long long from, to, mid;
+
+	from = INT_MIN;
+	to	 = (long long)INT_MAX + 1;
+	while (from < to) {
+		mid = from + (to - from) / 2;
+		if (hashset_count_less_than_in_runs(data, mid) < rank)
+			from = mid + 1;
+		else
+			to = mid;
+	}
+	return from;
+}
+
+static void
+hashset_clear_in_buckets(struct bucket_task *task)
+{
+	int i;
+	struct hashset_chain *set;
+
+	set = (struct hashset_chain *)task->arg;
+	for (i = task->from; i < task->to; i++)
+		treeset_clear(set->table[i]);
+}
+
+static int
+hashset_compare_int(const void *a, const void *b)
+{
+	int x, y;
+
+	x = *(const int *)a;
+	y = *(const int *)b;
+	return (x > y) - (x < y);
+}
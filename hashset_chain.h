@@ -5,13 +5,21 @@
 #ifndef HASHSET_CHAIN_H
 #define HASHSET_CHAIN_H
 
+#include <pthread.h>
+
+#include "hashset_numa.h"
+#include "treeset.h"
+
 /*
  * DO NOT make NUM_THREADS bigger than HASHSET_TABLE_SIZE
  * It's not worth for you when intending to improve performance.
  * Also, they must be both positive numbers.
+ * NUM_THREADS can be given at compile time, e.g. -DNUM_THREADS=8.
  */
 #define HASHSET_TABLE_SIZE 31
+#ifndef NUM_THREADS
 #define NUM_THREADS 1
+#endif
 
 enum SET_OPERATION {
 	ADD,
@@ -23,6 +31,23 @@ enum SET_OPERATION {
 struct hashset_chain {
 	int size; /* total number of elements in set */
 	struct tree_set *table[HASHSET_TABLE_SIZE];
+
+	/* Gate between modifications and hashset_snapshot(...), see hashset_begin_write(...) */
+	int writers;		/* number of modifications in progress */
+	int snapshotting;	/* 1 while a snapshot is waiting for or taking the set */
+	pthread_mutex_t snapshot_lock;
+	pthread_cond_t	snapshot_cond;
+};
+
+/*
+ * Cursor over all elements of a hashset. Elements are read chain by chain,
+ * in accending order within each chain. No memory is allocated.
+ * The set MUST NOT be modified while iterating.
+ */
+struct hashset_iter {
+	struct hashset_chain *set;
+	int index;						// index of table currently walked
+	struct treeset_iter chain_iter;	// cursor over set->table[index]
 };
 
 struct task_data {
@@ -31,19 +56,74 @@ struct task_data {
 	struct hashset_chain *setB;	// Not used for operations with ***array***
 	int *  array_data;			// Not used for operations with ***set***
 	int    array_size;			// Not used for operaitons with ***set***
+
+	/*
+	 * Work queues of operations with ***set***, one per NUMA node (a single one without HASHSET_NUMA):
+	 * buckets[node_begin[n]] to buckets[node_begin[n+1]-1] are table indexes of node n in descending
+	 * order of the sizes of both chains, taken one by one by threads through next_bucket[n].
+	 */
+	int    buckets[HASHSET_TABLE_SIZE];
+	int    node_begin[HASHSET_NUMA_MAX_NODES + 1];
+	int    next_bucket[HASHSET_NUMA_MAX_NODES];
+	int    num_nodes;
 };
 
 struct thread_task {
-	int	   from, to;	// Ranges of index to do set operation
+	int	   from, to;	// Ranges of index to do set operation (array only, sets share the queue of data)
 	int	   success;		// 1 if operation succedded(e.g. success of add/remove or find element), otherwise 0
+	int	   node;		// NUMA node the thread runs on, whose queue it takes buckets from first
 	struct task_data * data;
 	/* Callback functions */
 	int (*function_with_data)(struct tree_set*, int); 				// Not used for operation with ***set***
 	int (*function_with_chain)(struct tree_set*, struct tree_set*); // Not used for operation with ***array***
 };
 
+/* Number of elements a buffered writer holds before adding them to the set */
+#define HASHSET_WRITER_BUFFER_SIZE 4096
+
+/*
+ * Buffered writer for adding elements one by one at a high rate.
+ * Each thread opens its own writer, and elements are added to the set in batches:
+ * sorted per bucket and merged into each chain under one lock acquisition.
+ * See hashset_writer_open(...).
+ */
+struct hashset_writer {
+	struct hashset_chain *set;
+	int count;								// number of elements in buffer
+	int buffer[HASHSET_WRITER_BUFFER_SIZE];	// elements in order of hashset_writer_add(...)
+	int runs[HASHSET_WRITER_BUFFER_SIZE];	// elements of buffer grouped by bucket while flushing
+};
+
+/* Batches with fewer elements than this per thread are run by fewer threads */
+#define HASHSET_BATCH_ELEMENTS_PER_THREAD 4096
+
+/*
+ * Operation with an array queued in a batch, see hashset_batch_create(...)
+ *
+ * result is set by hashset_batch_run(...) and is what hashset_*_array(...) would
+ * return for ADD, REMOVE and FIND. For RETAIN it's always 1: each chain keeps the
+ * elements of the operation in its bucket, and a chain with none of them is
+ * cleared, but unlike hashset_retain_array(...) no failure is reported through it.
+ */
+struct hashset_batch_op {
+	enum SET_OPERATION operation;
+	int *  array_data;		// MUST stay valid until hashset_batch_run(...) returns
+	int    array_size;
+	int    result;			// see above
+};
+
+struct hashset_batch {
+	struct hashset_chain *set;
+	int count;					// number of operations in ops
+	int capacity;
+	struct hashset_batch_op *ops;
+};
+
 struct hashset_chain *hashset_create_set();
 void hashset_free_set(struct hashset_chain *set);
+int  hashset_free_set_deferred(struct hashset_chain *set);
+void hashset_clear(struct hashset_chain *set);
+struct hashset_chain *hashset_snapshot(struct hashset_chain *set);
 int  hashset_size(struct hashset_chain *set);
 void hashset_update_size(struct hashset_chain *set);
 int  hashset_add(struct hashset_chain *set, int data);
@@ -53,6 +133,17 @@ int  hashset_remove(struct hashset_chain *set, int data);
 int  hashset_remove_set(struct hashset_chain *setA, struct hashset_chain *setB);
 int  hashset_remove_array(struct hashset_chain *set, int *array_data, int  array_size);
 int  hashset_find(struct hashset_chain *set, int data);
+int  hashset_find_optimistic(struct hashset_chain *set, int data);
+struct hashset_writer *hashset_writer_open(struct hashset_chain *set);
+int  hashset_writer_add(struct hashset_writer *writer, int data);
+int  hashset_writer_flush(struct hashset_writer *writer);
+int  hashset_writer_close(struct hashset_writer *writer);
+struct hashset_batch *hashset_batch_create(struct hashset_chain *set);
+int  hashset_batch_enqueue(struct hashset_batch *batch, enum SET_OPERATION operation, int *array_data, int array_size);
+int  hashset_batch_run(struct hashset_batch *batch);
+int  hashset_batch_result(struct hashset_batch *batch, int index);
+void hashset_batch_clear(struct hashset_batch *batch);
+void hashset_batch_free(struct hashset_batch *batch);
 int  hashset_find_set(struct hashset_chain *setA, struct hashset_chain *setB);
 int  hashset_find_array(struct hashset_chain *set, int *array_data, int  array_size);
 int  hashset_retain_set(struct hashset_chain *setA, struct hashset_chain *setB);
@@ -61,5 +152,14 @@ int  hashset_union(struct hashset_chain *union_set, struct hashset_chain *setA,
 int  hashset_intersection(struct hashset_chain *intersection_set, struct hashset_chain *setA, struct hashset_chain *setB);
 int  hashset_difference(struct hashset_chain *difference_set, struct hashset_chain *setA, struct hashset_chain *setB);
 int  hashset_symmetric_difference(struct hashset_chain *symmetric_difference_set, struct hashset_chain *setA, struct hashset_chain *setB);
+int  hashset_union_many(struct hashset_chain *out, struct hashset_chain **sets, int k);
+int  hashset_intersection_many(struct hashset_chain *out, struct hashset_chain **sets, int k);
+void hashset_iter_init(struct hashset_iter *iter, struct hashset_chain *set);
+int  hashset_iter_next(struct hashset_iter *iter, int *data);
+int  hashset_to_array(struct hashset_chain *set, int *array_data, int array_size, int sorted);
+int  hashset_parallel_foreach(struct hashset_chain *set, void (*function)(int data, void *ctx), void *ctx);
+int  hashset_remove_if(struct hashset_chain *set, int (*predicate)(int data, void *ctx), void *ctx);
+int  hashset_retain_if(struct hashset_chain *set, int (*predicate)(int data, void *ctx), void *ctx);
+long long hashset_parallel_reduce(struct hashset_chain *set, long long (*map)(int data), long long (*combine)(long long, long long), long long identity);
 
 #endif
\ No newline at end of file
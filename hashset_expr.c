@@ -0,0 +1,402 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hashset_expr.h"
+#include "hashset_internal.h"
+#include "treeset.h"
+
+/* Node of an expression in postfix order, see hashset_expr_compile(...) */
+struct expr_step {
+	enum HASHSET_EXPR_TYPE type;
+	int leaf;			// index of set in sets of expr_data, HASHSET_EXPR_SET only
+};
+
+/* Arguments shared by threads of hashset_expr_evaluate(...) and hashset_expr_count(...) */
+struct expr_data {
+	struct hashset_chain *sets[HASHSET_EXPR_MAX_SETS];	// distinct sets of expr, by leaf
+	int num_sets;
+	struct expr_step *steps;	// expr in postfix order
+	int num_steps;
+	struct hashset_chain *result_set;	// NULL to count only
+	int failed;							// 1 if a thread failed to allocate memory
+};
+
+static struct hashset_expr *hashset_expr_new(enum HASHSET_EXPR_TYPE type, struct hashset_expr *left, struct hashset_expr *right);
+static int  hashset_expr_count_nodes(struct hashset_expr *expr);
+static int  hashset_expr_compile(struct hashset_expr *expr, struct expr_data *data);
+static int  hashset_expr_is_true(struct expr_data *data, char *stack, uint64_t members);
+static long long hashset_expr_run(struct hashset_chain *result_set, struct hashset_expr *expr);
+static void hashset_expr_in_buckets(struct bucket_task *task);
+
+
+/*
+ * @return expression whose value is set, NULL if set is NULL or memory allocation failed
+ */
+struct hashset_expr *
+hashset_expr_set(struct hashset_chain *set)
+{
+	struct hashset_expr *expr;
+
+	if (set == NULL) return NULL;
+
+	expr = (struct hashset_expr *)calloc(1, sizeof(struct hashset_expr));
+	if (expr == NULL) {
+		perror("Failed to allocate memory for expression");
+		return NULL;
+	}
+	expr->type = HASHSET_EXPR_SET;
+	expr->set  = set;
+	return expr;
+}
+
+/*
+ * @return expression of elements in left or right
+ */
+struct hashset_expr *
+hashset_expr_union(struct hashset_expr *left,
+				   struct hashset_expr *right)
+{
+	return hashset_expr_new(HASHSET_EXPR_UNION, left, right);
+}
+
+/*
+ * @return expression of elements in both left and right
+ */
+struct hashset_expr *
+hashset_expr_intersection(struct hashset_expr *left,
+						  struct hashset_expr *right)
+{
+	return hashset_expr_new(HASHSET_EXPR_INTERSECTION, left, right);
+}
+
+/*
+ * @return expression of elements in left but not in right
+ */
+struct hashset_expr *
+hashset_expr_difference(struct hashset_expr *left,
+						struct hashset_expr *right)
+{
+	return hashset_expr_new(HASHSET_EXPR_DIFFERENCE, left, right);
+}
+
+/*
+ * @return expression of elements in exactly one of left and right
+ */
+struct hashset_expr *
+hashset_expr_symmetric_difference(struct hashset_expr *left,
+								  struct hashset_expr *right)
+{
+	return hashset_expr_new(HASHSET_EXPR_SYMMETRIC_DIFFERENCE, left, right);
+}
+
+/*
+ * Free expr and all its subexpressions. Sets are not freed.
+ */
+void
+hashset_expr_free(struct hashset_expr *expr)
+{
+	if (expr == NULL) return;
+
+	hashset_expr_free(expr->left);
+	hashset_expr_free(expr->right);
+	free(expr);
+}
+
+/*
+ * Add elements of the value of expr to result_set.
+ * result_set SHOULD be an empty set provided by caller function, like the one of
+ * hashset_union(...), and MUST NOT be one of the sets of expr.
+ * Each chain of result_set is written once from the sorted elements of its bucket.
+ *
+ * @return number of elements of the value of expr,
+ *         -1 if result_set is in expr, expr has too many sets or memory allocation failed
+ */
+long long
+hashset_expr_evaluate(struct hashset_chain *result_set,
+					  struct hashset_expr *expr)
+{
+	if (result_set == NULL) return -1;
+	return hashset_expr_run(result_set, expr);
+}
+
+/*
+ * @return number of elements of the value of expr without storing them,
+ *         -1 if expr has too many sets or memory allocation failed
+ */
+long long
+hashset_expr_count(struct hashset_expr *expr)
+{
+	return hashset_expr_run(NULL, expr);
+}
+
+static struct hashset_expr *
+hashset_expr_new(enum HASHSET_EXPR_TYPE type,
+				 struct hashset_expr *left,
+				 struct hashset_expr *right)
+{
+	struct hashset_expr *expr;
+
+	if (left == NULL || right == NULL) {
+		hashset_expr_free(left);
+		hashset_expr_free(right);
+		return NULL;
+	}
+
+	expr = (struct hashset_expr *)calloc(1, sizeof(struct hashset_expr));
+	if (expr == NULL) {
+		perror("Failed to allocate memory for expression");
+		hashset_expr_free(left);
+		hashset_expr_free(right);
+		return NULL;
+	}
+	expr->type	= type;
+	expr->left	= left;
+	expr->right = right;
+	return expr;
+}
+
+/*
+ * @return number of nodes of expr
+ */
+static int
+hashset_expr_count_nodes(struct hashset_expr *expr)
+{
+	if (expr->type == HASHSET_EXPR_SET)
+		return 1;
+	return 1 + hashset_expr_count_nodes(expr->left) + hashset_expr_count_nodes(expr->right);
+}
+
+/*
+ * Append expr to data->steps in postfix order, and give each distinct set of expr
+ * an index (leaf) in data->sets, so that a set used several times in expr is walked
+ * only once per bucket. Leaves are kept in the steps instead of expr, so the same
+ * expression can be evaluated by several threads at once.
+ *
+ * @return 1 if succeeded, 0 if there are more than HASHSET_EXPR_MAX_SETS sets
+ */
+static int
+hashset_expr_compile(struct hashset_expr *expr,
+					 struct expr_data *data)
+{
+	int i;
+
+	if (expr->type != HASHSET_EXPR_SET) {
+		if (!hashset_expr_compile(expr->left, data) ||
+			!hashset_expr_compile(expr->right, data))
+			return 0;
+		data->steps[data->num_steps++].type = expr->type;
+		return 1;
+	}
+
+	for (i = 0; i < data->num_sets; i++)
+		if (data->sets[i] == expr->set)
+			break;
+	if (i == HASHSET_EXPR_MAX_SETS)
+		return 0;
+	if (i == data->num_sets)
+		data->sets[data->num_sets++] = expr->set;
+
+	data->steps[data->num_steps].type = HASHSET_EXPR_SET;
+	data->steps[data->num_steps].leaf = i;
+	data->num_steps++;
+	return 1;
+}
+
+/*
+ * Run the steps of data on a stack of values of subexpressions.
+ *
+ * @param stack at least data->num_steps bytes, owned by the calling thread
+ * @param members bit i is 1 if the element is in data->sets[i]
+ * @return 1 if the element is in the value of the expression, 0 otherwise
+ */
+static int
+hashset_expr_is_true(struct expr_data *data,
+					 char *stack,
+					 uint64_t members)
+{
+	int i, top;
+	char left, right;
+
+	top = 0;
+	for (i = 0; i < data->num_steps; i++) {
+		if (data->steps[i].type == HASHSET_EXPR_SET) {
+			stack[top++] = (members >> data->steps[i].leaf) & 1;
+			continue;
+		}
+
+		right = stack[--top];
+		left  = stack[--top];
+		switch(data->steps[i].type) {
+			case HASHSET_EXPR_UNION:
+				stack[top++] = left | right;
+				break;
+			case HASHSET_EXPR_INTERSECTION:
+				stack[top++] = left & right;
+				break;
+			case HASHSET_EXPR_DIFFERENCE:
+				stack[top++] = left & !right;
+				break;
+			case HASHSET_EXPR_SYMMETRIC_DIFFERENCE:
+				stack[top++] = left ^ right;
+				break;
+			default:
+				stack[top++] = 0;
+		}
+	}
+	return stack[0];
+}
+
+/*
+ * Template of hashset_expr_evaluate(...) and hashset_expr_count(...)
+ */
+static long long
+hashset_expr_run(struct hashset_chain *result_set,
+				 struct hashset_expr *expr)
+{
+	int i, num_threads;
+	long long count;
+	struct bucket_task *tasks;
+	struct expr_data data;
+
+	if (expr == NULL) return -1;
+
+	data.num_sets	= 0;
+	data.num_steps	= 0;
+	data.result_set = result_set;
+	data.failed		= 0;
+	data.steps = (struct expr_step *)malloc(hashset_expr_count_nodes(expr) * sizeof(struct expr_step));
+	if (data.steps == NULL) {
+		perror("Failed to allocate memory for expression");
+		return -1;
+	}
+	if (!hashset_expr_compile(expr, &data))
+		goto free_steps_end;
+	for (i = 0; i < data.num_sets; i++)
+		if (data.sets[i] == result_set)
+			goto free_steps_end;
+
+	num_threads = hashset_number_of_bucket_threads();
+	tasks = (struct bucket_task *)calloc(num_threads, sizeof(struct bucket_task));
+	if (tasks == NULL) {
+		perror("Failed to allocate task memory");
+		goto free_steps_end;
+	}
+
+	if (result_set != NULL)
+		hashset_begin_write(result_set);
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_expr_in_buckets, &data);
+	if (result_set != NULL) {
+		hashset_update_size(result_set);
+		hashset_end_write(result_set);
+	}
+
+	count = 0;
+	for (i = 0; i < num_threads; i++)
+		count += tasks[i].result;
+	free(tasks);
+	free(data.steps);
+
+	return data.failed ? -1 : count;
+
+free_steps_end:
+	free(data.steps);
+	return -1;
+}
+
+/*
+ * Merge chains of all sets of the expression bucket by bucket, in accending order.
+ * At each step the smallest element among the chains is taken, and members tells which
+ * sets have it. It's in the value of the expression if the expression is true for members.
+ */
+static void
+hashset_expr_in_buckets(struct bucket_task *task)
+{
+	int i, k, num_sets, size, capacity, min;
+	int heads[HASHSET_EXPR_MAX_SETS];
+	int has[HASHSET_EXPR_MAX_SETS];
+	int *buffer;
+	char *stack;
+	uint64_t members;
+	long long count;
+	struct expr_data *data;
+	struct treeset_iter *iters;
+
+	data = (struct expr_data *)task->arg;
+	num_sets = data->num_sets;
+	count	 = 0;
+	buffer	 = NULL;
+	capacity = 0;
+
+	iters = (struct treeset_iter *)malloc(num_sets * sizeof(struct treeset_iter));
+	stack = (char *)malloc(data->num_steps);
+	if (iters == NULL || stack == NULL) {
+		perror("Failed to allocate memory for iterators");
+		__atomic_store_n(&(data->failed), 1, __ATOMIC_RELAXED);
+		free(iters);
+		free(stack);
+		return;
+	}
+
+	for (i = task->from; i < task->to; i++) {
+		size = 0;
+		for (k = 0; k < num_sets; k++) {
+			treeset_iter_init(&(iters[k]), data->sets[k]->table[i]);
+			has[k] = treeset_iter_next(&(iters[k]), &(heads[k]));
+			size  += data->sets[k]->table[i]->size;
+		}
+
+		/* The value has at most as many elements as all chains together */
+		if (data->result_set != NULL && size > capacity) {
+			free(buffer);
+			capacity = size;
+			buffer = (int *)malloc(capacity * sizeof(int));
+			if (buffer == NULL) {
+				perror("Failed to allocate memory for elements of expression");
+				__atomic_store_n(&(data->failed), 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+
+		size = 0;
+		for (;;) {
+			/* Smallest head and the sets that have it */
+			members = 0;
+			min = 0;
+			for (k = 0; k < num_sets; k++) {
+				if (!has[k])
+					continue;
+				if (members == 0 || heads[k] < min) {
+					min = heads[k];
+					members = (uint64_t)1 << k;
+				}
+				else if (heads[k] == min)
+					members |= (uint64_t)1 << k;
+			}
+			if (members == 0)
+				break;
+
+			if (hashset_expr_is_true(data, stack, members)) {
+				count++;
+				if (data->result_set != NULL)
+					buffer[size++] = min;
+			}
+
+			for (k = 0; k < num_sets; k++)
+				if ((members >> k) & 1)
+					has[k] = treeset_iter_next(&(iters[k]), &(heads[k]));
+		}
+
+		if (data->result_set != NULL && size > 0)
+			treeset_add_sorted_array(data->result_set->table[i], buffer, size);
+	}
+
+	free(buffer);
+	free(iters);
+	free(stack);
+	task->result = count;
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_EXPR_H
+#define HASHSET_EXPR_H
+
+#include "hashset_chain.h"
+
+/*
+ * Expressions of sets evaluated without intermediate sets.
+ *
+ * Query such as (A | B) \ (C & D) is built as a tree:
+ *
+ *     expr = hashset_expr_difference(
+ *                hashset_expr_union(hashset_expr_set(A), hashset_expr_set(B)),
+ *                hashset_expr_intersection(hashset_expr_set(C), hashset_expr_set(D)));
+ *     count = hashset_expr_evaluate(result, expr);    // or hashset_expr_count(expr)
+ *     hashset_expr_free(expr);
+ *
+ * As all sets share the hash function, bucket i of the result only depends on
+ * bucket i of every set. So for each bucket, the chains of all distinct sets of
+ * the expression are walked in order at once, and an element goes to the result
+ * if the expression is true for the sets that contain it.
+ * Buckets are distributed over threads like hashset_parallel_foreach(...).
+ *
+ * Constructors return NULL if memory allocation fails, or if any argument is NULL,
+ * in which case the other argument is freed, so they can be nested as above.
+ * Sets of an expression MUST NOT be modified while it's evaluated. An expression
+ * is only read when evaluated, so several threads may evaluate it at once.
+ */
+
+/* Number of distinct sets an expression can have */
+#define HASHSET_EXPR_MAX_SETS 64
+
+enum HASHSET_EXPR_TYPE {
+	HASHSET_EXPR_SET,
+	HASHSET_EXPR_UNION,
+	HASHSET_EXPR_INTERSECTION,
+	HASHSET_EXPR_DIFFERENCE,
+	HASHSET_EXPR_SYMMETRIC_DIFFERENCE
+};
+
+struct hashset_expr {
+	enum HASHSET_EXPR_TYPE type;
+	struct hashset_chain *set;		// HASHSET_EXPR_SET only
+	struct hashset_expr *left;		// Not used for HASHSET_EXPR_SET
+	struct hashset_expr *right;		// Not used for HASHSET_EXPR_SET
+};
+
+struct hashset_expr *hashset_expr_set(struct hashset_chain *set);
+struct hashset_expr *hashset_expr_union(struct hashset_expr *left, struct hashset_expr *right);
+struct hashset_expr *hashset_expr_intersection(struct hashset_expr *left, struct hashset_expr *right);
+struct hashset_expr *hashset_expr_difference(struct hashset_expr *left, struct hashset_expr *right);
+struct hashset_expr *hashset_expr_symmetric_difference(struct hashset_expr *left, struct hashset_expr *right);
+void hashset_expr_free(struct hashset_expr *expr);
+long long hashset_expr_evaluate(struct hashset_chain *result_set, struct hashset_expr *expr);
+long long hashset_expr_count(struct hashset_expr *expr);
+
+#endif
@@ -0,0 +1,605 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashset_frozen.h"
+#include "hashset_internal.h"
+#include "treeset.h"
+
+static const int *hashset_frozen_run(struct hashset_frozen *frozen, int index, int *count);
+static int  hashset_frozen_search_run(const int *run, int count, int data);
+static int  hashset_operation_template_with_frozen(enum SET_OPERATION operation, struct hashset_chain *set, struct hashset_frozen *frozen);
+static struct hashset_frozen *hashset_freeze_unmodified(struct hashset_chain *set);
+static void hashset_freeze_in_buckets(struct bucket_task *task);
+static void hashset_verify_in_buckets(struct bucket_task *task);
+static void hashset_operate_with_frozen_in_buckets(struct bucket_task *task);
+static void hashset_count_intersection_in_buckets(struct bucket_task *task);
+static int  hashset_keep_if_found_in_run(int data, void *ctx);
+
+/* Arguments shared by threads of operations with frozen set */
+struct frozen_data {
+	enum SET_OPERATION operation;	// Not used for freeze/verify/count
+	struct hashset_chain  *set;
+	struct hashset_frozen *frozen;
+};
+
+/* Context for hashset_keep_if_found_in_run(...) */
+struct run_cursor {
+	const int *run;
+	int count;
+	int next;		// index of the next element to compare
+};
+
+/*
+ * Create a frozen copy of set. set is not modified and can be freed afterwards.
+ * As the image is sized before chains are copied, the copy is made from
+ * hashset_snapshot(...) of set, so set may be modified meanwhile.
+ * Chains are copied to their runs by multiple threads.
+ *
+ * @return pointer to a new frozen set, NULL if memory allocation failed
+ */
+struct hashset_frozen *
+hashset_freeze(struct hashset_chain *set)
+{
+	struct hashset_chain *snapshot;
+	struct hashset_frozen *frozen;
+
+	if (set == NULL)
+		return NULL;
+
+	snapshot = hashset_snapshot(set);
+	if (snapshot == NULL)
+		return NULL;
+	frozen = hashset_freeze_unmodified(snapshot);
+	hashset_free_set(snapshot);
+
+	return frozen;
+}
+
+/*
+ * Map a snapshot file as a frozen set.
+ * Pages are shared with other processes mapping the same file. Only the header is
+ * checked here; call hashset_frozen_verify(...) to check every run as well.
+ *
+ * @return pointer to a new frozen set, NULL if the file can't be mapped.
+ *		   errno is EINVAL if the file is broken.
+ */
+struct hashset_frozen *
+hashset_frozen_map(const char *path)
+{
+	int fd, error;
+	struct stat st;
+	char *map;
+	struct hashset_frozen *frozen;
+
+	if (path == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if ((uint64_t)st.st_size < sizeof(struct hashset_file_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	error = hashset_file_validate(map, st.st_size);
+	if (!error && (((const struct hashset_file_header *)map)->flags & HASHSET_FILE_PACKED))
+		error = EINVAL; // packed runs can't be searched in place
+	if (error) {
+		munmap(map, st.st_size);
+		errno = error;
+		return NULL;
+	}
+
+	frozen = (struct hashset_frozen *)malloc(sizeof(struct hashset_frozen));
+	if (frozen == NULL) {
+		munmap(map, st.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	frozen->image	   = map;
+	frozen->image_size = st.st_size;
+	frozen->mapped	   = 1;
+	frozen->size	   = (int)((const struct hashset_file_header *)map)->total;
+	frozen->buckets	   = (const struct hashset_file_bucket *)(map + sizeof(struct hashset_file_header));
+
+	return frozen;
+}
+
+/*
+ * Save frozen set to path as it is, which is a snapshot file readable by
+ * hashset_load(...) and hashset_frozen_map(...)
+ * The file is written to "<path>.tmp" first and renamed to path after fsync(2).
+ *
+ * @return 1 if frozen set is saved, 0 otherwise
+ */
+int
+hashset_frozen_save(struct hashset_frozen *frozen,
+					const char *path)
+{
+	int fd, success;
+	char *tmp_path;
+
+	if (frozen == NULL || path == NULL)
+		return 0;
+
+	tmp_path = (char *)malloc(strlen(path) + sizeof(".tmp"));
+	if (tmp_path == NULL) {
+		perror("Failed to allocate memory to path");
+		return 0;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Failed to open snapshot file");
+		free(tmp_path);
+		return 0;
+	}
+
+	success = hashset_write_all(fd, frozen->image, frozen->image_size) && fsync(fd) == 0;
+	if (!success)
+		perror("Failed to write snapshot file");
+	close(fd);
+
+	if (success && rename(tmp_path, path) < 0) {
+		perror("Failed to rename snapshot file");
+		success = 0;
+	}
+	if (!success)
+		unlink(tmp_path);
+
+	free(tmp_path);
+	return success;
+}
+
+/*
+ * Check checksum and order of every run. Runs are checked by multiple threads.
+ *
+ * @return 1 if frozen set is valid, 0 otherwise
+ */
+int
+hashset_frozen_verify(struct hashset_frozen *frozen)
+{
+	int i, num_threads, valid;
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct frozen_data data;
+
+	if (frozen == NULL)
+		return 0;
+
+	data.set	= NULL;
+	data.frozen = frozen;
+	num_threads = hashset_number_of_bucket_threads();
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_verify_in_buckets, &data);
+
+	valid = 1;
+	for (i = 0; i < num_threads; i++)
+		valid &= (tasks[i].result == 0);
+
+	return valid;
+}
+
+/*
+ * Free frozen set, or unmap it if it is mapped from a file
+ */
+void
+hashset_frozen_free(struct hashset_frozen *frozen)
+{
+	if (frozen == NULL)
+		return;
+
+	if (frozen->mapped)
+		munmap(frozen->image, frozen->image_size);
+	else
+		free(frozen->image);
+
+	free(frozen);
+}
+
+/*
+ * @return total number of elements in frozen set
+ * Time complexity O(1)
+ */
+int
+hashset_frozen_size(struct hashset_frozen *frozen)
+{
+	if (frozen == NULL)
+		return 0;
+
+	return frozen->size;
+}
+
+/*
+ * Check if data is in frozen set by binary search on the run of its chain
+ *
+ * @return 1 if true 0 otherwise
+ */
+int
+hashset_frozen_find(struct hashset_frozen *frozen,
+					int data)
+{
+	int count;
+	const int *run;
+
+	if (frozen == NULL)
+		return 0;
+
+	run = hashset_frozen_run(frozen, hashset_hash_code(data), &count);
+	return hashset_frozen_search_run(run, count, data);
+}
+
+/*
+ * Check if all elements in array are in frozen set
+ *
+ * @return 1 if true 0 otherwise
+ */
+int
+hashset_frozen_find_array(struct hashset_frozen *frozen,
+						  int *array_data,
+						  int  array_size)
+{
+	int i;
+
+	if (frozen == NULL	   ||
+		array_data == NULL ||
+		array_size < 0)
+		return 0;
+
+	for (i = 0; i < array_size; i++) {
+		if (!hashset_frozen_find(frozen, array_data[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Count elements that are in both frozen set and set without building the intersection.
+ * Each chain of set is merged with its run in order, by multiple threads.
+ *
+ * @return number of common elements
+ */
+int
+hashset_frozen_intersection_size(struct hashset_frozen *frozen,
+								 struct hashset_chain *set)
+{
+	int i, num_threads, count;
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct frozen_data data;
+
+	if (frozen == NULL || set == NULL)
+		return 0;
+
+	data.set	= set;
+	data.frozen = frozen;
+	num_threads = hashset_number_of_bucket_threads();
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_count_intersection_in_buckets, &data);
+
+	count = 0;
+	for (i = 0; i < num_threads; i++)
+		count += (int)tasks[i].result;
+
+	return count;
+}
+
+/*
+ * Add all elements in frozen set into set
+ * Empty chains are built directly from runs in O(N).
+ *
+ * @return 1 if some elements are added into set, 0 otherwise.
+ */
+int
+hashset_add_frozen(struct hashset_chain *set,
+				   struct hashset_frozen *frozen)
+{
+	return hashset_operation_template_with_frozen(ADD, set, frozen);
+}
+
+/*
+ * Remove all elements in frozen set from set
+ *
+ * @return 1 if operation succeeded, 0 otherwise
+ */
+int
+hashset_remove_frozen(struct hashset_chain *set,
+					  struct hashset_frozen *frozen)
+{
+	return hashset_operation_template_with_frozen(REMOVE, set, frozen);
+}
+
+/*
+ * Check if all elements in frozen set are in set
+ *
+ * @return 1 if true 0 otherwise
+ */
+int
+hashset_find_frozen(struct hashset_chain *set,
+					struct hashset_frozen *frozen)
+{
+	return hashset_operation_template_with_frozen(FIND, set, frozen);
+}
+
+/*
+ * Intersect set with frozen set
+ * After the operation, set contains elements that are only found in frozen set
+ *
+ * @return 1 if operation succeeded, 0 otherwise
+ */
+int
+hashset_retain_frozen(struct hashset_chain *set,
+					  struct hashset_frozen *frozen)
+{
+	return hashset_operation_template_with_frozen(RETAIN, set, frozen);
+}
+
+/*
+ * Template to do set operation on set using frozen set, chain by chain in parallel.
+ * Result of each chain is combined as in hashset_set_operation(...), i.e.
+ * set is modified if any chain is, and FIND succeeds if all chains do.
+ */
+static int
+hashset_operation_template_with_frozen(enum SET_OPERATION operation,
+									   struct hashset_chain *set,
+									   struct hashset_frozen *frozen)
+{
+	int i, num_threads, result;
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct frozen_data data;
+
+	/* Never proceed if inputs are invalid */
+	if (set == NULL || frozen == NULL)
+		return 0;
+
+	data.operation = operation;
+	data.set	   = set;
+	data.frozen	   = frozen;
+	if (operation != FIND)
+		hashset_begin_write(set);
+	num_threads = hashset_number_of_bucket_threads();
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_operate_with_frozen_in_buckets, &data);
+
+	result = (operation == ADD) ? 0 : 1;
+	for (i = 0; i < num_threads; i++) {
+		if (operation == ADD)
+			result |= (int)tasks[i].result;
+		else
+			result &= (int)tasks[i].result;
+	}
+
+	hashset_update_size(set);
+	if (operation != FIND)
+		hashset_end_write(set);
+	return result;
+}
+
+/*
+ * @return the run of table[index] and its number of elements in *count
+ */
+static const int *
+hashset_frozen_run(struct hashset_frozen *frozen,
+				   int index,
+				   int *count)
+{
+	*count = frozen->buckets[index].count;
+	return (const int *)(frozen->image + frozen->buckets[index].offset);
+}
+
+/*
+ * Binary-search sorted run for data
+ * @return 1 if found, otherwise 0
+ */
+static int
+hashset_frozen_search_run(const int *run,
+						  int count,
+						  int data)
+{
+	int from, to, mid;
+
+	from = 0;
+	to	 = count;
+	while (from < to) {
+		mid = from + (to - from) / 2;
+		if (run[mid] < data)
+			from = mid + 1;
+		else
+			to = mid;
+	}
+	return from < count && run[from] == data;
+}
+
+/*
+ * Body of hashset_freeze(...). set MUST NOT be modified until it returns.
+ */
+static struct hashset_frozen *
+hashset_freeze_unmodified(struct hashset_chain *set)
+{
+	int num_threads;
+	struct hashset_frozen *frozen;
+	struct hashset_file_header *header, layout_header;
+	struct hashset_file_bucket *buckets, layout_buckets[HASHSET_TABLE_SIZE];
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct frozen_data data;
+
+	frozen = (struct hashset_frozen *)malloc(sizeof(struct hashset_frozen));
+	if (frozen == NULL) {
+		perror("Failed to allocate memory to frozen set");
+		return NULL;
+	}
+
+	/* Compute layout on stack first to know the size of image */
+	frozen->image_size = hashset_file_layout(set, &layout_header, layout_buckets);
+	frozen->image = (char *)calloc(frozen->image_size, 1);
+	if (frozen->image == NULL) {
+		perror("Failed to allocate memory to frozen set");
+		free(frozen);
+		return NULL;
+	}
+	memcpy(frozen->image, &layout_header, sizeof(layout_header));
+	memcpy(frozen->image + sizeof(layout_header), layout_buckets, sizeof(layout_buckets));
+
+	header	= (struct hashset_file_header *)frozen->image;
+	buckets = (struct hashset_file_bucket *)(frozen->image + sizeof(struct hashset_file_header));
+	frozen->mapped	= 0;
+	frozen->size	= (int)header->total;
+	frozen->buckets = buckets;
+
+	/* Copy chains and compute run checksums */
+	data.set	= set;
+	data.frozen = frozen;
+	num_threads = hashset_number_of_bucket_threads();
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_freeze_in_buckets, &data);
+
+	header->checksum = hashset_file_header_checksum(header, buckets);
+	return frozen;
+}
+
+static void
+hashset_freeze_in_buckets(struct bucket_task *task)
+{
+	int i, count;
+	const int *run;
+	struct frozen_data *data;
+	struct hashset_file_bucket *bucket;
+
+	data = (struct frozen_data *)task->arg;
+	for (i = task->from; i < task->to; i++) {
+		bucket = (struct hashset_file_bucket *)&(data->frozen->buckets[i]);
+		run	   = hashset_frozen_run(data->frozen, i, &count);
+
+		treeset_to_array(data->set->table[i], (int *)run, count);
+		bucket->checksum = hashset_checksum(run, bucket->size);
+	}
+}
+
+/*
+ * task->result is 0 if all runs in range are valid, EINVAL otherwise
+ */
+static void
+hashset_verify_in_buckets(struct bucket_task *task)
+{
+	int i, j, count;
+	const int *run;
+	struct frozen_data *data;
+
+	data = (struct frozen_data *)task->arg;
+	for (i = task->from; i < task->to; i++) {
+		run = hashset_frozen_run(data->frozen, i, &count);
+
+		if (hashset_checksum(run, data->frozen->buckets[i].size) != data->frozen->buckets[i].checksum) {
+			task->result = EINVAL;
+			return;
+		}
+		for (j = 0; j < count; j++) {
+			if ((j > 0 && run[j-1] >= run[j]) || hashset_hash_code(run[j]) != i) {
+				task->result = EINVAL;
+				return;
+			}
+		}
+	}
+}
+
+static void
+hashset_operate_with_frozen_in_buckets(struct bucket_task *task)
+{
+	int i, j, count, result;
+	const int *run;
+	struct tree_set *chain;
+	struct frozen_data *data;
+	struct run_cursor cursor;
+
+	data   = (struct frozen_data *)task->arg;
+	result = (data->operation == ADD) ? 0 : 1;
+	for (i = task->from; i < task->to; i++) {
+		chain = data->set->table[i];
+		run	  = hashset_frozen_run(data->frozen, i, &count);
+
+		switch (data->operation) {
+			case ADD:
+				result |= treeset_add_sorted_array(chain, run, count);
+				break;
+			case REMOVE:
+				for (j = 0; j < count; j++)
+					treeset_remove(chain, run[j]);
+				break;
+			case FIND:
+				for (j = 0; j < count && result; j++)
+					result &= treeset_find(chain, run[j]);
+				break;
+			case RETAIN:
+				cursor.run	 = run;
+				cursor.count = count;
+				cursor.next	 = 0;
+				treeset_retain_if(chain, &hashset_keep_if_found_in_run, &cursor);
+				break;
+			default:
+				;
+		}
+	}
+
+	task->result = result;
+}
+
+static void
+hashset_count_intersection_in_buckets(struct bucket_task *task)
+{
+	int i, j, d, count, common;
+	const int *run;
+	struct frozen_data *data;
+	struct treeset_iter iter;
+
+	data   = (struct frozen_data *)task->arg;
+	common = 0;
+	for (i = task->from; i < task->to; i++) {
+		run = hashset_frozen_run(data->frozen, i, &count);
+
+		j = 0;
+		treeset_iter_init(&iter, data->set->table[i]);
+		while (j < count && treeset_iter_next(&iter, &d)) {
+			while (j < count && run[j] < d)
+				j++;
+			if (j < count && run[j] == d)
+				common++;
+		}
+	}
+
+	task->result = common;
+}
+
+/*
+ * Predicate for treeset_retain_if(...) that keeps data iff it is in the run.
+ * As data is given in accending order, the cursor only moves forward.
+ */
+static int
+hashset_keep_if_found_in_run(int data, void *ctx)
+{
+	struct run_cursor *cursor;
+
+	cursor = (struct run_cursor *)ctx;
+	while (cursor->next < cursor->count && cursor->run[cursor->next] < data)
+		cursor->next++;
+
+	return cursor->next < cursor->count && cursor->run[cursor->next] == data;
+}
@@ -0,0 +1,44 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_FROZEN_H
+#define HASHSET_FROZEN_H
+
+#include <stdint.h>
+
+#include "hashset_chain.h"
+#include "hashset_io.h"
+
+/*
+ * Immutable set for sets that are built once and then only queried.
+ *
+ * Elements of each chain are stored as one contiguous sorted array, and the whole
+ * image has exactly the layout of a snapshot file (see hashset_io.h).
+ * Thus a frozen set saved by hashset_frozen_save(...) or a set saved by hashset_save(...)
+ * can be mapped by hashset_frozen_map(...) from any number of processes,
+ * which share the same pages without deserialization.
+ */
+struct hashset_frozen {
+	char	*image;			// snapshot image
+	uint64_t image_size;	// size of image in bytes
+	int		 mapped;		// 1 if image is mapped from a file, 0 if allocated by hashset_freeze(...)
+	int		 size;			// total number of elements
+	const struct hashset_file_bucket *buckets;
+};
+
+struct hashset_frozen *hashset_freeze(struct hashset_chain *set);
+struct hashset_frozen *hashset_frozen_map(const char *path);
+int  hashset_frozen_save(struct hashset_frozen *frozen, const char *path);
+int  hashset_frozen_verify(struct hashset_frozen *frozen);
+void hashset_frozen_free(struct hashset_frozen *frozen);
+int  hashset_frozen_size(struct hashset_frozen *frozen);
+int  hashset_frozen_find(struct hashset_frozen *frozen, int data);
+int  hashset_frozen_find_array(struct hashset_frozen *frozen, int *array_data, int array_size);
+int  hashset_frozen_intersection_size(struct hashset_frozen *frozen, struct hashset_chain *set);
+int  hashset_add_frozen(struct hashset_chain *set, struct hashset_frozen *frozen);
+int  hashset_remove_frozen(struct hashset_chain *set, struct hashset_frozen *frozen);
+int  hashset_find_frozen(struct hashset_chain *set, struct hashset_frozen *frozen);
+int  hashset_retain_frozen(struct hashset_chain *set, struct hashset_frozen *frozen);
+
+#endif
@@ -0,0 +1,286 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashset_instrument.h"
+
+static void *hashset_instrument_dump_thread(void *arg);
+static void hashset_instrument_print_timing(FILE *stream, const char *name, const struct hashset_instrument_timing *timing);
+
+/* State of the thread started by hashset_instrument_start_dump(...) */
+struct instrument_dump {
+	int running;
+	int stop;
+	int interval_ms;
+	void *ctx;
+	void (*hook)(const struct hashset_instrument_stats *stats, void *ctx);
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static struct instrument_dump instrument_dump = {
+	0, 0, 0, NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+#ifdef HASHSET_INSTRUMENT
+
+struct hashset_instrument_stats hashset_instrument_counters;
+
+/*
+ * Lock the mutex of bucket, counting the acquisition
+ * and, if another thread holds it, the contention and time spent waiting.
+ *
+ * @return result of pthread_mutex_lock(...)
+ */
+int
+hashset_instrument_lock(pthread_mutex_t *lock,
+						int bucket)
+{
+	int error;
+	unsigned long long begin;
+
+	__atomic_add_fetch(&(hashset_instrument_counters.lock_acquisitions[bucket]), 1, __ATOMIC_RELAXED);
+
+	error = pthread_mutex_trylock(lock);
+	if (error != EBUSY)
+		return error;
+
+	begin = hashset_instrument_now();
+	error = pthread_mutex_lock(lock);
+	__atomic_add_fetch(&(hashset_instrument_counters.lock_contentions[bucket]), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(hashset_instrument_counters.lock_wait_ns[bucket]),
+					   hashset_instrument_now() - begin, __ATOMIC_RELAXED);
+	return error;
+}
+
+/*
+ * @return monotonic time in ns
+ */
+unsigned long long
+hashset_instrument_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Add a task that started at begin to timing
+ */
+void
+hashset_instrument_record(struct hashset_instrument_timing *timing,
+						  unsigned long long begin)
+{
+	unsigned long long elapsed, max;
+
+	elapsed = hashset_instrument_now() - begin;
+	__atomic_add_fetch(&(timing->count), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(timing->total_ns), elapsed, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&(timing->max_ns), __ATOMIC_RELAXED);
+	while (elapsed > max &&
+		   !__atomic_compare_exchange_n(&(timing->max_ns), &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#endif
+
+/*
+ * @return 1 if the library is compiled with HASHSET_INSTRUMENT, otherwise 0
+ */
+int
+hashset_instrument_enabled(void)
+{
+#ifdef HASHSET_INSTRUMENT
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Copy the current counters into stats (all zeros without HASHSET_INSTRUMENT)
+ */
+void
+hashset_instrument_get(struct hashset_instrument_stats *stats)
+{
+#ifdef HASHSET_INSTRUMENT
+	unsigned long long *to, *from;
+	size_t i;
+
+	/* The struct consists of counters only, so they're read one by one */
+	to	 = (unsigned long long *)stats;
+	from = (unsigned long long *)&hashset_instrument_counters;
+	for (i = 0; i < sizeof(struct hashset_instrument_stats) / sizeof(unsigned long long); i++)
+		to[i] = __atomic_load_n(from + i, __ATOMIC_RELAXED);
+#else
+	memset(stats, 0, sizeof(struct hashset_instrument_stats));
+#endif
+}
+
+/*
+ * Set all counters to 0
+ */
+void
+hashset_instrument_reset(void)
+{
+#ifdef HASHSET_INSTRUMENT
+	unsigned long long *counters;
+	size_t i;
+
+	counters = (unsigned long long *)&hashset_instrument_counters;
+	for (i = 0; i < sizeof(struct hashset_instrument_stats) / sizeof(unsigned long long); i++)
+		__atomic_store_n(counters + i, 0, __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+ * Print stats in a human readable form.
+ * Buckets whose lock was never taken are omitted.
+ */
+void
+hashset_instrument_print(FILE *stream,
+						 const struct hashset_instrument_stats *stats)
+{
+	int i;
+	static const char *operation_names[] = { "add", "remove", "find", "retain" };
+
+	fprintf(stream, "rotations %llu, nodes allocated %llu, freed %llu\n",
+			stats->rotations, stats->nodes_allocated, stats->nodes_freed);
+
+	for (i = 0; i <= RETAIN; i++)
+		hashset_instrument_print_timing(stream, operation_names[i], &(stats->operations[i]));
+	hashset_instrument_print_timing(stream, "bucket", &(stats->bucket_tasks));
+
+	fprintf(stream, "bucket\tlocks\tcontended\twait_ms\n");
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+	{
+		if (stats->lock_acquisitions[i] == 0)
+			continue;
+		fprintf(stream, "%d\t%llu\t%llu\t%.3f\n", i, stats->lock_acquisitions[i],
+				stats->lock_contentions[i], stats->lock_wait_ns[i] / 1000000.0);
+	}
+}
+
+static void
+hashset_instrument_print_timing(FILE *stream,
+								const char *name,
+								const struct hashset_instrument_timing *timing)
+{
+	if (timing->count == 0)
+		return;
+	fprintf(stream, "%s tasks %llu, mean %.3f ms, max %.3f ms\n", name, timing->count,
+			timing->total_ns / 1000000.0 / timing->count, timing->max_ns / 1000000.0);
+}
+
+/*
+ * Start a thread calling hook with the current counters every interval_ms.
+ * If hook is NULL, the counters are printed to stderr by hashset_instrument_print(...).
+ * Only one dump thread runs at a time.
+ *
+ * @return 1 if the thread is started, 0 if it's already running, the interval isn't positive
+ *		   or the library is compiled without HASHSET_INSTRUMENT
+ */
+int
+hashset_instrument_start_dump(void (*hook)(const struct hashset_instrument_stats *stats, void *ctx),
+							  void *ctx,
+							  int interval_ms)
+{
+	int error;
+
+	if (!hashset_instrument_enabled() || interval_ms <= 0)
+		return 0;
+
+	pthread_mutex_lock(&(instrument_dump.lock));
+	if (instrument_dump.running) {
+		pthread_mutex_unlock(&(instrument_dump.lock));
+		return 0;
+	}
+
+	instrument_dump.hook		= hook;
+	instrument_dump.ctx			= ctx;
+	instrument_dump.interval_ms = interval_ms;
+	instrument_dump.stop		= 0;
+	error = pthread_create(&(instrument_dump.tid), NULL, &hashset_instrument_dump_thread, &instrument_dump);
+	if (error) {
+		pthread_mutex_unlock(&(instrument_dump.lock));
+		perror("Failed to create thread for dumping counters");
+		return 0;
+	}
+	instrument_dump.running = 1;
+	pthread_mutex_unlock(&(instrument_dump.lock));
+
+	return 1;
+}
+
+/*
+ * Stop the thread started by hashset_instrument_start_dump(...) and wait for it.
+ * The hook is not called any more after this returns.
+ */
+void
+hashset_instrument_stop_dump(void)
+{
+	pthread_t tid;
+
+	pthread_mutex_lock(&(instrument_dump.lock));
+	if (!instrument_dump.running || instrument_dump.stop) {
+		pthread_mutex_unlock(&(instrument_dump.lock));
+		return;
+	}
+	instrument_dump.stop = 1;
+	tid = instrument_dump.tid;
+	pthread_cond_signal(&(instrument_dump.cond));
+	pthread_mutex_unlock(&(instrument_dump.lock));
+
+	pthread_join(tid, NULL);
+
+	pthread_mutex_lock(&(instrument_dump.lock));
+	instrument_dump.running = 0;
+	pthread_mutex_unlock(&(instrument_dump.lock));
+}
+
+static void *
+hashset_instrument_dump_thread(void *arg)
+{
+	struct instrument_dump *dump;
+	struct hashset_instrument_stats stats;
+	struct timespec deadline;
+
+	dump = (struct instrument_dump *)arg;
+
+	pthread_mutex_lock(&(dump->lock));
+	while (!dump->stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec  += dump->interval_ms / 1000;
+		deadline.tv_nsec += (dump->interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while (!dump->stop && pthread_cond_timedwait(&(dump->cond), &(dump->lock), &deadline) != ETIMEDOUT)
+			;
+		if (dump->stop)
+			break;
+
+		/* The hook runs without the lock so that it may take as long as it likes */
+		pthread_mutex_unlock(&(dump->lock));
+		hashset_instrument_get(&stats);
+		if (dump->hook != NULL)
+			dump->hook(&stats, dump->ctx);
+		else
+			hashset_instrument_print(stderr, &stats);
+		pthread_mutex_lock(&(dump->lock));
+	}
+	pthread_mutex_unlock(&(dump->lock));
+
+	return NULL;
+}
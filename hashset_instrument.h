@@ -0,0 +1,80 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_INSTRUMENT_H
+#define HASHSET_INSTRUMENT_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "hashset_chain.h"
+
+/*
+ * Counters of lock contention and hot paths of the library.
+ *
+ * They're only collected if the library is compiled with -DHASHSET_INSTRUMENT,
+ * e.g. *make CFLAGS="-g -Wall -pthread -DHASHSET_INSTRUMENT"*.
+ * Otherwise the macros below expand to nothing (or to the plain pthread call),
+ * and hashset_instrument_get(...) reports zeros.
+ *
+ * Counters are updated with relaxed atomics, so a snapshot taken while
+ * other threads are running is not consistent across counters.
+ */
+struct hashset_instrument_timing {
+	unsigned long long count;		// number of tasks run
+	unsigned long long total_ns;	// sum of wall time of tasks
+	unsigned long long max_ns;		// longest task
+};
+
+struct hashset_instrument_stats {
+	/* Locks of buckets taken by operations with array and buffered writers */
+	unsigned long long lock_acquisitions[HASHSET_TABLE_SIZE];
+	unsigned long long lock_contentions[HASHSET_TABLE_SIZE];	// acquisitions that had to wait
+	unsigned long long lock_wait_ns[HASHSET_TABLE_SIZE];		// time spent waiting
+
+	/* Trees */
+	unsigned long long rotations;		// single rotations, a double rotation counts 2
+	unsigned long long nodes_allocated;	// including copies of nodes shared with snapshots
+	unsigned long long nodes_freed;
+
+	/* Threads of set operations, indexed by enum SET_OPERATION */
+	struct hashset_instrument_timing operations[RETAIN + 1];
+	/* Threads of hashset_run_bucket_tasks(...), e.g. foreach/reduce/filter/to_array */
+	struct hashset_instrument_timing bucket_tasks;
+};
+
+#ifdef HASHSET_INSTRUMENT
+
+extern struct hashset_instrument_stats hashset_instrument_counters;
+
+#define HASHSET_INSTRUMENT_COUNT(counter) \
+	__atomic_add_fetch(&(hashset_instrument_counters.counter), 1, __ATOMIC_RELAXED)
+#define HASHSET_INSTRUMENT_LOCK(lock, bucket) \
+	hashset_instrument_lock((lock), (bucket))
+#define HASHSET_INSTRUMENT_BEGIN(begin) \
+	((begin) = hashset_instrument_now())
+#define HASHSET_INSTRUMENT_END(timing, begin) \
+	hashset_instrument_record(&(hashset_instrument_counters.timing), (begin))
+
+int  hashset_instrument_lock(pthread_mutex_t *lock, int bucket);
+unsigned long long hashset_instrument_now(void);
+void hashset_instrument_record(struct hashset_instrument_timing *timing, unsigned long long begin);
+
+#else
+
+#define HASHSET_INSTRUMENT_COUNT(counter)		((void)0)
+#define HASHSET_INSTRUMENT_LOCK(lock, bucket)	pthread_mutex_lock(lock)
+#define HASHSET_INSTRUMENT_BEGIN(begin)			((void)0)
+#define HASHSET_INSTRUMENT_END(timing, begin)	((void)0)
+
+#endif
+
+int  hashset_instrument_enabled(void);
+void hashset_instrument_get(struct hashset_instrument_stats *stats);
+void hashset_instrument_reset(void);
+void hashset_instrument_print(FILE *stream, const struct hashset_instrument_stats *stats);
+int  hashset_instrument_start_dump(void (*hook)(const struct hashset_instrument_stats *stats, void *ctx), void *ctx, int interval_ms);
+void hashset_instrument_stop_dump(void);
+
+#endif
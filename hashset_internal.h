@@ -0,0 +1,34 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_INTERNAL_H
+#define HASHSET_INTERNAL_H
+
+#include "hashset_chain.h"
+
+/*
+ * Plumbing shared by the modules of the library, such as hashset_io.c and
+ * hashset_expr.c. It's not part of the API: only .c files of the library
+ * include this header, and applications use hashset_chain.h.
+ */
+
+/*
+ * Task for operations that walk whole chains without a second set or array,
+ * such as hashset_parallel_foreach(...). One task is run by one thread.
+ */
+struct bucket_task {
+	int	   from, to;	// Ranges of table index to operate on
+	long long result;	// Per-thread result, merged by the caller after join
+	void  *arg;			// Argument shared by all tasks
+	void (*function)(struct bucket_task *task);
+	int    node;		// NUMA node the thread is bound to, -1 if it isn't
+};
+
+int  hashset_hash_code(int data);
+void hashset_begin_write(struct hashset_chain *set);
+void hashset_end_write(struct hashset_chain *set);
+int  hashset_number_of_bucket_threads(void);
+int  hashset_run_bucket_tasks(struct bucket_task *tasks, int num_threads, void (*function)(struct bucket_task *), void *arg);
+
+#endif
@@ -0,0 +1,1085 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashset_io.h"
+#include "hashset_internal.h"
+#include "treeset.h"
+#include "treeset_packed.h"
+
+/* Number of elements buffered before write(2) when saving a run */
+#define HASHSET_IO_BUFFER_SIZE 4096
+
+/*
+ * hashset_import_fd(...) parses HASHSET_IMPORT_CHUNK_SIZE elements at a time,
+ * and at most HASHSET_IMPORT_SLOTS chunks are in flight, which bounds its memory.
+ */
+#define HASHSET_IMPORT_READ_SIZE  65536
+#define HASHSET_IMPORT_CHUNK_SIZE 65536
+#define HASHSET_IMPORT_SLOTS	  4
+
+/* FNV-1a parameters, applied to 64-bit words instead of bytes */
+#define HASHSET_CHECKSUM_SEED  0xcbf29ce484222325ULL
+#define HASHSET_CHECKSUM_PRIME 0x100000001b3ULL
+
+static uint64_t hashset_checksum_update(uint64_t checksum, const void *data, uint64_t size);
+static int  hashset_save_with_flags(struct hashset_chain *set, const char *path, uint32_t flags);
+static int  hashset_save_unmodified(struct hashset_chain *set, const char *path, uint32_t flags);
+static int  hashset_write_run(int fd, struct tree_set *chain, struct hashset_file_bucket *bucket);
+static int  hashset_write_packed_run(int fd, struct treeset_packed *packed, struct hashset_file_bucket *bucket);
+static void hashset_pack_in_buckets(struct bucket_task *task);
+static void hashset_load_in_buckets(struct bucket_task *task);
+static int  hashset_load_run(struct tree_set *chain, int index, const struct hashset_file_bucket *bucket, const char *map);
+static int  hashset_load_packed_run(struct tree_set *chain, int index, const struct hashset_file_bucket *bucket, const char *map);
+static int  hashset_packed_stream_next(void *ctx, int *data);
+static void *hashset_import_worker(void *arg);
+
+/* Arguments shared by threads of hashset_load(...) */
+struct load_data {
+	struct hashset_chain *set;
+	const char *map;
+	const struct hashset_file_bucket *buckets;
+	uint32_t flags;
+};
+
+/* Context of hashset_packed_stream_next(...) */
+struct packed_stream {
+	struct treeset_packed_iter iter;
+	int index;		// bucket the elements must hash to
+	int misplaced;	// 1 if an element of another bucket was read
+};
+
+/* Arguments shared by threads of hashset_save_packed(...) */
+struct pack_data {
+	struct hashset_chain  *set;
+	struct treeset_packed *packed[HASHSET_TABLE_SIZE];
+};
+
+/*
+ * State of hashset_import_fd(...) parser kept between read(2) calls,
+ * as a number may be split across two reads.
+ */
+struct import_parser {
+	int format;					// HASHSET_IMPORT_TEXT or HASHSET_IMPORT_INT32LE
+	int in_number;				// text: 1 while a number is being read
+	int negative;				// text: 1 if the number has '-'
+	int digits;					// text: number of digits read so far
+	long long value;			// text: absolute value read so far
+	int num_pending;			// binary: bytes of the next element read so far
+	unsigned char pending[4];
+	int error;
+};
+
+/* Elements of one parsed chunk, grouped by bucket: bucket i is data[starts[i]] ... data[starts[i+1]-1] */
+struct import_chunk {
+	int *data;
+	int  starts[HASHSET_TABLE_SIZE + 1];
+	int  pending;				// number of workers that haven't added this chunk yet
+};
+
+/* Pipeline shared by the reader (calling thread) and workers of hashset_import_fd(...) */
+struct import_data {
+	struct hashset_chain *set;
+	struct import_chunk chunks[HASHSET_IMPORT_SLOTS];	// ring of chunks, chunk n is in chunks[n % HASHSET_IMPORT_SLOTS]
+	int produced;				// number of chunks handed to workers
+	int finished;				// 1 when no more chunk is produced
+	pthread_mutex_t lock;
+	pthread_cond_t	filled;		// signaled when a chunk is produced or finished is set
+	pthread_cond_t	freed;		// signaled when pending of a chunk gets 0
+};
+
+static int  hashset_import_parse(struct import_parser *parser, const unsigned char *bytes, size_t size, int *array_data, int capacity, size_t *consumed);
+static int  hashset_import_parse_end(struct import_parser *parser, int *array_data);
+static void hashset_import_partition(const int *array_data, int count, struct import_chunk *chunk);
+static void hashset_import_add_chunk(struct bucket_task *task, struct import_chunk *chunk);
+
+/*
+ * Save set to a snapshot file.
+ * The file is written to "<path>.tmp" first and renamed to path after fsync(2),
+ * so path always holds either the old or the new snapshot.
+ * What's saved is hashset_snapshot(...) of set, so set may be modified meanwhile.
+ *
+ * @return 1 if set is saved, 0 otherwise
+ */
+int
+hashset_save(struct hashset_chain *set,
+			 const char *path)
+{
+	return hashset_save_with_flags(set, path, 0);
+}
+
+/*
+ * Save set to a snapshot file with delta/varint encoded runs.
+ * Chains are encoded by multiple threads before writing.
+ * The file is smaller but can't be mapped by hashset_frozen_map(...)
+ *
+ * @return 1 if set is saved, 0 otherwise
+ */
+int
+hashset_save_packed(struct hashset_chain *set,
+					const char *path)
+{
+	return hashset_save_with_flags(set, path, HASHSET_FILE_PACKED);
+}
+
+/*
+ * Template of hashset_save(...) and hashset_save_packed(...)
+ * The layout of the file is computed before chains are written, so they're
+ * written from a snapshot that can't change in between.
+ */
+static int
+hashset_save_with_flags(struct hashset_chain *set,
+						const char *path,
+						uint32_t flags)
+{
+	int success;
+	struct hashset_chain *snapshot;
+
+	if (set == NULL || path == NULL)
+		return 0;
+
+	snapshot = hashset_snapshot(set);
+	if (snapshot == NULL)
+		return 0;
+	success = hashset_save_unmodified(snapshot, path, flags);
+	hashset_free_set(snapshot);
+
+	return success;
+}
+
+/*
+ * Save set, which MUST NOT be modified until it returns, see hashset_save_with_flags(...)
+ */
+static int
+hashset_save_unmodified(struct hashset_chain *set,
+						const char *path,
+						uint32_t flags)
+{
+	int i, fd, success;
+	char *tmp_path;
+	struct hashset_file_header header;
+	struct hashset_file_bucket buckets[HASHSET_TABLE_SIZE];
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct pack_data *pack;
+
+	hashset_file_layout(set, &header, buckets);
+	header.flags = flags;
+
+	/* Packed runs have to be encoded before laying them out */
+	pack = NULL;
+	if (flags & HASHSET_FILE_PACKED) {
+		pack = (struct pack_data *)calloc(1, sizeof(struct pack_data));
+		if (pack == NULL) {
+			perror("Failed to allocate memory to pack set");
+			return 0;
+		}
+		pack->set = set;
+		hashset_run_bucket_tasks(tasks, hashset_number_of_bucket_threads(), &hashset_pack_in_buckets, pack);
+
+		for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+			if (pack->packed[i] == NULL) {
+				success = 0;
+				goto free_pack_end;
+			}
+			buckets[i].size = pack->packed[i]->nbytes;
+		}
+		hashset_file_place_runs(buckets);
+	}
+
+	success  = 0;
+	tmp_path = (char *)malloc(strlen(path) + sizeof(".tmp"));
+	if (tmp_path == NULL) {
+		perror("Failed to allocate memory to path");
+		goto free_pack_end;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Failed to open snapshot file");
+		free(tmp_path);
+		goto free_pack_end;
+	}
+
+	/* Write runs first as checksums in the bucket table are computed while writing */
+	if (lseek(fd, sizeof(header) + sizeof(buckets), SEEK_SET) < 0)
+		goto close_end;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		if (pack != NULL)
+			success = hashset_write_packed_run(fd, pack->packed[i], &buckets[i]);
+		else
+			success = hashset_write_run(fd, set->table[i], &buckets[i]);
+		if (!success)
+			goto close_end;
+	}
+	success = 0;
+
+	header.checksum = hashset_file_header_checksum(&header, buckets);
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		pwrite(fd, buckets, sizeof(buckets), sizeof(header)) != sizeof(buckets))
+		goto close_end;
+	if (fsync(fd) < 0)
+		goto close_end;
+	success = 1;
+
+close_end:
+	if (!success)
+		perror("Failed to write snapshot file");
+	close(fd);
+
+	if (success && rename(tmp_path, path) < 0) {
+		perror("Failed to rename snapshot file");
+		success = 0;
+	}
+	if (!success)
+		unlink(tmp_path);
+	free(tmp_path);
+
+free_pack_end:
+	if (pack != NULL) {
+		for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+			treeset_packed_free(pack->packed[i]);
+		free(pack);
+	}
+	return success;
+}
+
+/*
+ * Load a set from a snapshot file written by hashset_save(...) or hashset_save_packed(...)
+ * The file is mapped into memory and each chain is built as a balanced tree
+ * directly from its sorted run in O(N). Chains are verified and built by multiple threads.
+ * Packed runs are decoded on the fly while building, without a temporary array.
+ *
+ * @return pointer to a new set, NULL if the file can't be read.
+ *		   errno is EINVAL if the file is broken and ENOMEM if memory ran out.
+ */
+struct hashset_chain *
+hashset_load(const char *path)
+{
+	int i, fd, error, num_threads;
+	struct stat st;
+	char *map;
+	struct hashset_chain *set;
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct load_data data;
+
+	if (path == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if ((uint64_t)st.st_size < sizeof(struct hashset_file_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	set = NULL;
+	error = hashset_file_validate(map, st.st_size);
+	if (error)
+		goto unmap_end;
+
+	set = hashset_create_set();
+	if (set == NULL) {
+		error = ENOMEM;
+		goto unmap_end;
+	}
+
+	data.set	 = set;
+	data.map	 = map;
+	data.buckets = (const struct hashset_file_bucket *)(map + sizeof(struct hashset_file_header));
+	data.flags	 = ((const struct hashset_file_header *)map)->flags;
+
+	num_threads = hashset_number_of_bucket_threads();
+	hashset_run_bucket_tasks(tasks, num_threads, &hashset_load_in_buckets, &data);
+	for (i = 0; i < num_threads; i++) {
+		if (tasks[i].result)
+			error = (int)tasks[i].result;
+	}
+
+	if (error) {
+		hashset_free_set(set);
+		set = NULL;
+	}
+	else {
+		hashset_update_size(set);
+	}
+
+unmap_end:
+	munmap(map, st.st_size);
+	if (error)
+		errno = error;
+	return set;
+}
+
+/*
+ * Import elements read from fd into set, without holding the whole input in memory.
+ *
+ * The calling thread reads and parses the input in chunks and partitions each chunk by bucket.
+ * Worker threads, each of which owns a range of buckets, add the chunk to their chains
+ * while the next chunk is being parsed. At most HASHSET_IMPORT_SLOTS chunks are in memory.
+ *
+ * HASHSET_IMPORT_TEXT: decimal numbers, optionally signed, separated by whitespaces.
+ * HASHSET_IMPORT_INT32LE: little endian int32 without any header.
+ *
+ * set MUST NOT be used by other threads until this function returns,
+ * and hashset_snapshot(...) of set waits for the whole import.
+ * Elements read before an error are left in set.
+ *
+ * @return 1 if the whole input is imported, 0 otherwise.
+ *		   errno is EINVAL if the input is malformed.
+ */
+int
+hashset_import_fd(struct hashset_chain *set,
+				  int fd,
+				  int format)
+{
+	int i, num_threads, num_chunks, count, success, eof;
+	int created[HASHSET_TABLE_SIZE];
+	int *array_data;
+	unsigned char *buffer;
+	size_t position, length, consumed;
+	ssize_t bytes_read;
+	pthread_t tid[HASHSET_TABLE_SIZE];
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct import_chunk *chunk;
+	struct import_parser parser;
+	struct import_data *data;
+
+	if (set == NULL || fd < 0 ||
+		(format != HASHSET_IMPORT_TEXT && format != HASHSET_IMPORT_INT32LE)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	buffer	   = (unsigned char *)malloc(HASHSET_IMPORT_READ_SIZE);
+	array_data = (int *)malloc(HASHSET_IMPORT_CHUNK_SIZE * sizeof(int));
+	data	   = (struct import_data *)calloc(1, sizeof(struct import_data));
+	num_chunks = 0;
+	if (buffer != NULL && array_data != NULL && data != NULL) {
+		for (; num_chunks < HASHSET_IMPORT_SLOTS; num_chunks++) {
+			data->chunks[num_chunks].data = (int *)malloc(HASHSET_IMPORT_CHUNK_SIZE * sizeof(int));
+			if (data->chunks[num_chunks].data == NULL)
+				break;
+		}
+	}
+	if (num_chunks < HASHSET_IMPORT_SLOTS) {
+		perror("Failed to allocate memory to import");
+		success = 0;
+		goto free_end;
+	}
+
+	hashset_begin_write(set);
+	data->set = set;
+	pthread_mutex_init(&(data->lock), NULL);
+	pthread_cond_init(&(data->filled), NULL);
+	pthread_cond_init(&(data->freed), NULL);
+
+	/* Split the table among workers. Buckets of a worker that can't be created are added by the reader */
+	num_threads = hashset_number_of_bucket_threads();
+	for (i = 0; i < num_threads; i++)
+	{
+		tasks[i].from	  = HASHSET_TABLE_SIZE * i / num_threads;
+		tasks[i].to		  = HASHSET_TABLE_SIZE * (i + 1) / num_threads;
+		tasks[i].result	  = 0;
+		tasks[i].arg	  = data;
+		tasks[i].function = NULL;
+		created[i] = !pthread_create(tid + i, NULL, &hashset_import_worker, &tasks[i]);
+	}
+
+	memset(&parser, 0, sizeof(parser));
+	parser.format = format;
+	position = length = 0;
+	success = 1;
+	eof = 0;
+	while (!eof && success)
+	{
+		/* Parse next chunk */
+		count = 0;
+		while (count < HASHSET_IMPORT_CHUNK_SIZE) {
+			if (position == length) {
+				bytes_read = read(fd, buffer, HASHSET_IMPORT_READ_SIZE);
+				if (bytes_read < 0) {
+					if (errno == EINTR)
+						continue;
+					success = 0;
+					break;
+				}
+				if (bytes_read == 0) {
+					eof = 1;
+					count += hashset_import_parse_end(&parser, array_data + count);
+					break;
+				}
+				position = 0;
+				length	 = bytes_read;
+			}
+
+			count	 += hashset_import_parse(&parser, buffer + position, length - position,
+											 array_data + count, HASHSET_IMPORT_CHUNK_SIZE - count, &consumed);
+			position += consumed;
+			if (parser.error)
+				break;
+		}
+		if (parser.error) {
+			errno	= EINVAL;
+			success = 0;
+		}
+		if (count == 0)
+			continue;
+
+		/* Wait until workers are done with the slot, then hand the chunk over */
+		chunk = &(data->chunks[data->produced % HASHSET_IMPORT_SLOTS]);
+		pthread_mutex_lock(&(data->lock));
+		while (chunk->pending > 0)
+			pthread_cond_wait(&(data->freed), &(data->lock));
+		pthread_mutex_unlock(&(data->lock));
+
+		hashset_import_partition(array_data, count, chunk);
+		for (i = 0; i < num_threads; i++) {
+			if (!created[i])
+				hashset_import_add_chunk(&tasks[i], chunk);
+		}
+
+		pthread_mutex_lock(&(data->lock));
+		for (i = 0; i < num_threads; i++)
+			chunk->pending += created[i];
+		data->produced++;
+		pthread_cond_broadcast(&(data->filled));
+		pthread_mutex_unlock(&(data->lock));
+	}
+
+	pthread_mutex_lock(&(data->lock));
+	data->finished = 1;
+	pthread_cond_broadcast(&(data->filled));
+	pthread_mutex_unlock(&(data->lock));
+
+	for (i = 0; i < num_threads; i++) {
+		if (created[i] && pthread_join(tid[i], NULL)) {
+			perror("failed to join thread");
+			success = 0;
+		}
+	}
+	hashset_update_size(set);
+	hashset_end_write(set);
+
+	pthread_cond_destroy(&(data->freed));
+	pthread_cond_destroy(&(data->filled));
+	pthread_mutex_destroy(&(data->lock));
+
+free_end:
+	if (data != NULL) {
+		for (i = 0; i < num_chunks; i++)
+			free(data->chunks[i].data);
+		free(data);
+	}
+	free(array_data);
+	free(buffer);
+	return success;
+}
+
+/*
+ * Same as hashset_import_fd(...) but reads the file at path
+ * @return 1 if the whole file is imported, 0 otherwise.
+ */
+int
+hashset_import_file(struct hashset_chain *set,
+					const char *path,
+					int format)
+{
+	int fd, success, error;
+
+	if (path == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	success = hashset_import_fd(set, fd, format);
+	error	= errno;
+	close(fd);
+	errno	= error;
+
+	return success;
+}
+
+/*
+ * Compute checksum of data.
+ * This is FNV-1a applied to 64-bit words, with remaining bytes hashed one by one.
+ */
+uint64_t
+hashset_checksum(const void *data,
+				 uint64_t size)
+{
+	return hashset_checksum_update(HASHSET_CHECKSUM_SEED, data, size);
+}
+
+/*
+ * Continue checksum with data.
+ * Calling this for consecutive pieces gives the same result as hashset_checksum(...)
+ * of the whole data as long as the size of every piece but the last is a multiple of 8.
+ */
+static uint64_t
+hashset_checksum_update(uint64_t checksum,
+						const void *data,
+						uint64_t size)
+{
+	uint64_t i, word;
+	const unsigned char *bytes;
+
+	bytes = (const unsigned char *)data;
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&word, bytes + i, 8);
+		checksum = (checksum ^ word) * HASHSET_CHECKSUM_PRIME;
+	}
+	for (; i < size; i++)
+		checksum = (checksum ^ bytes[i]) * HASHSET_CHECKSUM_PRIME;
+
+	return checksum;
+}
+
+/*
+ * Fill in header and bucket table for set, except checksums.
+ * Runs are laid out right after the bucket table.
+ *
+ * @return size of the whole file in bytes
+ */
+uint64_t
+hashset_file_layout(struct hashset_chain *set,
+					struct hashset_file_header *header,
+					struct hashset_file_bucket *buckets)
+{
+	int i;
+
+	memset(header, 0, sizeof(struct hashset_file_header));
+	memset(buckets, 0, HASHSET_TABLE_SIZE * sizeof(struct hashset_file_bucket));
+	memcpy(header->magic, HASHSET_FILE_MAGIC, sizeof(header->magic));
+	header->version	   = HASHSET_FILE_VERSION;
+	header->table_size = HASHSET_TABLE_SIZE;
+
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		buckets[i].count  = set->table[i]->size;
+		buckets[i].size	  = (uint64_t)buckets[i].count * sizeof(int);
+		header->total	 += buckets[i].count;
+	}
+
+	return hashset_file_place_runs(buckets);
+}
+
+/*
+ * Compute offsets of runs from their sizes, placing them one after another
+ * at 8-byte boundaries right after the bucket table.
+ *
+ * @return size of the whole file in bytes
+ */
+uint64_t
+hashset_file_place_runs(struct hashset_file_bucket *buckets)
+{
+	int i;
+	uint64_t offset;
+
+	offset = sizeof(struct hashset_file_header) + HASHSET_TABLE_SIZE * sizeof(struct hashset_file_bucket);
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		buckets[i].offset = offset;
+		offset += (buckets[i].size + 7) & ~(uint64_t)7;
+	}
+
+	return offset;
+}
+
+/*
+ * Compute checksum of header and bucket table, taking header->checksum as 0.
+ */
+uint64_t
+hashset_file_header_checksum(const struct hashset_file_header *header,
+							 const struct hashset_file_bucket *buckets)
+{
+	uint64_t checksum;
+	struct hashset_file_header copy;
+
+	copy = *header;
+	copy.checksum = 0;
+	checksum = hashset_checksum_update(HASHSET_CHECKSUM_SEED, &copy, sizeof(copy));
+	checksum = hashset_checksum_update(checksum, buckets, copy.table_size * sizeof(struct hashset_file_bucket));
+
+	return checksum;
+}
+
+/*
+ * write(2) until all data is written
+ * @return 1 if succeeded, 0 otherwise
+ */
+int
+hashset_write_all(int fd,
+				  const void *data,
+				  size_t size)
+{
+	ssize_t written;
+	const char *bytes;
+
+	bytes = (const char *)data;
+	while (size > 0) {
+		written = write(fd, bytes, size);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		bytes += written;
+		size  -= written;
+	}
+	return 1;
+}
+
+/*
+ * Stream chain to fd in accending order and fill in the checksum of bucket.
+ * The file offset MUST be at bucket->offset, and it is left at the next 8-byte boundary.
+ *
+ * @return 1 if succeeded, 0 otherwise
+ */
+static int
+hashset_write_run(int fd,
+				  struct tree_set *chain,
+				  struct hashset_file_bucket *bucket)
+{
+	int count, buffer[HASHSET_IO_BUFFER_SIZE];
+	uint64_t checksum, padding;
+	struct treeset_iter iter;
+
+	checksum = HASHSET_CHECKSUM_SEED;
+	count = 0;
+	treeset_iter_init(&iter, chain);
+	while (treeset_iter_next(&iter, &buffer[count])) {
+		if (++count < HASHSET_IO_BUFFER_SIZE)
+			continue;
+
+		checksum = hashset_checksum_update(checksum, buffer, sizeof(buffer));
+		if (!hashset_write_all(fd, buffer, sizeof(buffer)))
+			return 0;
+		count = 0;
+	}
+
+	checksum = hashset_checksum_update(checksum, buffer, count * sizeof(int));
+	if (!hashset_write_all(fd, buffer, count * sizeof(int)))
+		return 0;
+
+	padding = ((bucket->size + 7) & ~(uint64_t)7) - bucket->size;
+	if (padding > 0 && !hashset_write_all(fd, "\0\0\0\0\0\0\0", padding))
+		return 0;
+
+	bucket->checksum = checksum;
+	return 1;
+}
+
+/*
+ * Check that the header and bucket table are sound and every run lies inside the file.
+ * Runs themselves are not read.
+ *
+ * @param map whole file in memory
+ * @param map_size size of the file
+ * @return 0 if valid, EINVAL otherwise
+ */
+int
+hashset_file_validate(const char *map,
+					  uint64_t map_size)
+{
+	int i;
+	uint64_t total, table_end;
+	const struct hashset_file_header *header;
+	const struct hashset_file_bucket *buckets, *bucket;
+
+	header	  = (const struct hashset_file_header *)map;
+	buckets	  = (const struct hashset_file_bucket *)(map + sizeof(struct hashset_file_header));
+	table_end = sizeof(struct hashset_file_header) + HASHSET_TABLE_SIZE * sizeof(struct hashset_file_bucket);
+
+	if (memcmp(header->magic, HASHSET_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version	   != HASHSET_FILE_VERSION ||
+		header->table_size != HASHSET_TABLE_SIZE   ||
+		(header->flags & ~HASHSET_FILE_PACKED)	   ||
+		map_size < table_end)
+		return EINVAL;
+
+	if (hashset_file_header_checksum(header, buckets) != header->checksum)
+		return EINVAL;
+
+	total = 0;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		bucket = &buckets[i];
+		if (bucket->offset % sizeof(int) != 0		 ||
+			bucket->offset < table_end				 ||
+			(!(header->flags & HASHSET_FILE_PACKED) && bucket->size != (uint64_t)bucket->count * sizeof(int)) ||
+			bucket->offset > map_size				 ||
+			bucket->size > map_size - bucket->offset)
+			return EINVAL;
+		total += bucket->count;
+	}
+
+	if (total != header->total || total > (uint64_t)INT32_MAX)
+		return EINVAL;
+
+	return 0;
+}
+
+/*
+ * Write packed run to fd and fill in the checksum of bucket.
+ * The file offset MUST be at bucket->offset, and it is left at the next 8-byte boundary.
+ *
+ * @return 1 if succeeded, 0 otherwise
+ */
+static int
+hashset_write_packed_run(int fd,
+						 struct treeset_packed *packed,
+						 struct hashset_file_bucket *bucket)
+{
+	uint64_t padding;
+
+	if (!hashset_write_all(fd, packed->bytes, packed->nbytes))
+		return 0;
+
+	padding = ((bucket->size + 7) & ~(uint64_t)7) - bucket->size;
+	if (padding > 0 && !hashset_write_all(fd, "\0\0\0\0\0\0\0", padding))
+		return 0;
+
+	bucket->checksum = hashset_checksum(packed->bytes, packed->nbytes);
+	return 1;
+}
+
+/*
+ * Encode chains [from, to). packed[i] stays NULL if memory allocation failed.
+ */
+static void
+hashset_pack_in_buckets(struct bucket_task *task)
+{
+	int i;
+	struct pack_data *data;
+
+	data = (struct pack_data *)task->arg;
+	for (i = task->from; i < task->to; i++)
+		data->packed[i] = treeset_pack(data->set->table[i]);
+}
+
+/*
+ * Verify the runs of buckets [from, to) and build chains from them.
+ * task->result is 0 if succeeded, EINVAL or ENOMEM otherwise.
+ */
+static void
+hashset_load_in_buckets(struct bucket_task *task)
+{
+	int i, error;
+	const struct hashset_file_bucket *bucket;
+	struct load_data *data;
+
+	data = (struct load_data *)task->arg;
+	for (i = task->from; i < task->to; i++) {
+		bucket = &(data->buckets[i]);
+
+		if (hashset_checksum(data->map + bucket->offset, bucket->size) != bucket->checksum) {
+			task->result = EINVAL;
+			return;
+		}
+
+		if (data->flags & HASHSET_FILE_PACKED)
+			error = hashset_load_packed_run(data->set->table[i], i, bucket, data->map);
+		else
+			error = hashset_load_run(data->set->table[i], i, bucket, data->map);
+		if (error) {
+			task->result = error;
+			return;
+		}
+	}
+}
+
+/*
+ * Build chain of bucket index from plain int32 run.
+ * Every element must be larger than the previous one and hash to index.
+ * @return 0 if succeeded, EINVAL or ENOMEM otherwise.
+ */
+static int
+hashset_load_run(struct tree_set *chain,
+				 int index,
+				 const struct hashset_file_bucket *bucket,
+				 const char *map)
+{
+	int j, count;
+	const int *run;
+
+	run	  = (const int *)(map + bucket->offset);
+	count = bucket->count;
+	for (j = 0; j < count; j++) {
+		if ((j > 0 && run[j-1] >= run[j]) || hashset_hash_code(run[j]) != index)
+			return EINVAL;
+	}
+
+	if (count > 0 && !treeset_add_sorted_array(chain, run, count))
+		return ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Build chain of bucket index from packed run, decoding it while building the tree.
+ * As for hashset_load_run(...), every element must hash to index.
+ * @return 0 if succeeded, EINVAL or ENOMEM otherwise.
+ */
+static int
+hashset_load_packed_run(struct tree_set *chain,
+						int index,
+						const struct hashset_file_bucket *bucket,
+						const char *map)
+{
+	int built;
+	struct packed_stream stream;
+
+	treeset_packed_iter_init(&(stream.iter), (const unsigned char *)(map + bucket->offset), bucket->size);
+	stream.index	 = index;
+	stream.misplaced = 0;
+	built = treeset_add_sorted_stream(chain, &hashset_packed_stream_next, &stream, bucket->count);
+
+	/* The run must hold exactly count elements */
+	if (stream.misplaced || stream.iter.error || stream.iter.left != 0 || stream.iter.pos != stream.iter.end) {
+		treeset_clear(chain);
+		return EINVAL;
+	}
+	if (!built)
+		return ENOMEM;
+
+	return 0;
+}
+
+/*
+ * treeset_packed_iter_next(...) in the form of next() of treeset_add_sorted_stream(...).
+ * The stream ends at an element that doesn't hash to the bucket being loaded.
+ */
+static int
+hashset_packed_stream_next(void *ctx, int *data)
+{
+	struct packed_stream *stream;
+
+	stream = (struct packed_stream *)ctx;
+	if (!treeset_packed_iter_next(&(stream->iter), data))
+		return 0;
+
+	if (hashset_hash_code(*data) != stream->index) {
+		stream->misplaced = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Parse bytes into array_data, but no more than capacity elements.
+ * A number at the end of bytes is kept in parser and completed by the following bytes.
+ * parser->error is set if bytes are malformed.
+ *
+ * @return number of elements written to array_data, and *consumed is set to bytes parsed.
+ */
+static int
+hashset_import_parse(struct import_parser *parser,
+					 const unsigned char *bytes,
+					 size_t size,
+					 int *array_data,
+					 int capacity,
+					 size_t *consumed)
+{
+	int count;
+	size_t i;
+	unsigned char c;
+
+	count = 0;
+	i = 0;
+	if (parser->format == HASHSET_IMPORT_INT32LE) {
+		while (i < size && count < capacity) {
+			/* Fast path for whole elements in bytes */
+			if (parser->num_pending == 0 && size - i >= 4) {
+				array_data[count++] = (int)((uint32_t)bytes[i]			   | (uint32_t)bytes[i+1] << 8 |
+											(uint32_t)bytes[i+2] << 16 | (uint32_t)bytes[i+3] << 24);
+				i += 4;
+				continue;
+			}
+
+			parser->pending[parser->num_pending++] = bytes[i++];
+			if (parser->num_pending == 4) {
+				array_data[count++] = (int)((uint32_t)parser->pending[0]		 | (uint32_t)parser->pending[1] << 8 |
+											(uint32_t)parser->pending[2] << 16 | (uint32_t)parser->pending[3] << 24);
+				parser->num_pending = 0;
+			}
+		}
+		*consumed = i;
+		return count;
+	}
+
+	for (; i < size; i++) {
+		c = bytes[i];
+		if (c >= '0' && c <= '9') {
+			parser->value = parser->value * 10 + (c - '0');
+			if (parser->value > (long long)INT_MAX + 1) {
+				parser->error = 1;
+				break;
+			}
+			parser->in_number = 1;
+			parser->digits++;
+		}
+		else if (c == '-' || c == '+') {
+			if (parser->in_number) {
+				parser->error = 1;
+				break;
+			}
+			parser->in_number = 1;
+			parser->negative  = (c == '-');
+		}
+		else if (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+			if (!parser->in_number)
+				continue;
+			if (count == capacity)
+				break;
+			if (!hashset_import_parse_end(parser, array_data + count))
+				break;
+			count++;
+		}
+		else {
+			parser->error = 1;
+			break;
+		}
+	}
+
+	*consumed = i;
+	return count;
+}
+
+/*
+ * Finish the number being parsed, if any, at a separator or at the end of input.
+ * @return 1 if an element is written to array_data, 0 otherwise.
+ */
+static int
+hashset_import_parse_end(struct import_parser *parser,
+						 int *array_data)
+{
+	long long value;
+
+	if (parser->format == HASHSET_IMPORT_INT32LE) {
+		/* Input ended in the middle of an element */
+		if (parser->num_pending != 0)
+			parser->error = 1;
+		return 0;
+	}
+
+	if (!parser->in_number)
+		return 0;
+
+	value = parser->negative ? -parser->value : parser->value;
+	if (parser->digits == 0 || value > INT_MAX) {
+		parser->error = 1;
+		return 0;
+	}
+
+	*array_data = (int)value;
+	parser->in_number = 0;
+	parser->negative  = 0;
+	parser->digits	  = 0;
+	parser->value	  = 0;
+	return 1;
+}
+
+/*
+ * Group count elements of array_data by bucket into chunk with counting sort
+ */
+static void
+hashset_import_partition(const int *array_data,
+						 int count,
+						 struct import_chunk *chunk)
+{
+	int i, hash_value;
+	int next[HASHSET_TABLE_SIZE];
+
+	memset(chunk->starts, 0, sizeof(chunk->starts));
+	for (i = 0; i < count; i++)
+		chunk->starts[hashset_hash_code(array_data[i]) + 1]++;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++) {
+		chunk->starts[i+1] += chunk->starts[i];
+		next[i] = chunk->starts[i];
+	}
+
+	for (i = 0; i < count; i++) {
+		hash_value = hashset_hash_code(array_data[i]);
+		chunk->data[next[hash_value]++] = array_data[i];
+	}
+}
+
+/*
+ * Add elements of chunk in buckets [from, to) to their chains
+ */
+static void
+hashset_import_add_chunk(struct bucket_task *task,
+						 struct import_chunk *chunk)
+{
+	int i;
+	struct import_data *data;
+
+	data = (struct import_data *)task->arg;
+	for (i = task->from; i < task->to; i++)
+		treeset_add_array(data->set->table[i], chunk->data + chunk->starts[i], chunk->starts[i+1] - chunk->starts[i]);
+}
+
+/*
+ * Worker of hashset_import_fd(...)
+ * Adds every chunk to the buckets of the task, in the order the chunks are produced.
+ */
+static void *
+hashset_import_worker(void *arg)
+{
+	int n;
+	struct bucket_task *task;
+	struct import_data *data;
+	struct import_chunk *chunk;
+
+	task = (struct bucket_task *)arg;
+	data = (struct import_data *)task->arg;
+	for (n = 0; ; n++)
+	{
+		pthread_mutex_lock(&(data->lock));
+		while (n >= data->produced && !data->finished)
+			pthread_cond_wait(&(data->filled), &(data->lock));
+		if (n >= data->produced) {
+			pthread_mutex_unlock(&(data->lock));
+			break;
+		}
+		pthread_mutex_unlock(&(data->lock));
+
+		chunk = &(data->chunks[n % HASHSET_IMPORT_SLOTS]);
+		hashset_import_add_chunk(task, chunk);
+
+		pthread_mutex_lock(&(data->lock));
+		if (--chunk->pending == 0)
+			pthread_cond_signal(&(data->freed));
+		pthread_mutex_unlock(&(data->lock));
+	}
+
+	return NULL;
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_IO_H
+#define HASHSET_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashset_chain.h"
+
+/*
+ * Snapshot file layout (all fields in host byte order, i.e. little endian on x86):
+ *
+ *     struct hashset_file_header
+ *     struct hashset_file_bucket [table_size]
+ *     run of bucket 0, run of bucket 1, ...
+ *
+ * A run is the elements of one chain as int32 in strictly accending order,
+ * starting at an 8-byte aligned offset. Every run and the header (together with
+ * the bucket table) has its own checksum so that buckets can be verified in parallel.
+ *
+ * Every element of run i MUST hash to i by hashset_hash_code(...), which hashset_load(...)
+ * checks. Negative elements hash to x % HASHSET_TABLE_SIZE + HASHSET_TABLE_SIZE since
+ * bulk import was added, and got a negative index out of the table before. Files written
+ * before that with negative elements are rejected with EINVAL. The format version is
+ * unchanged, as such files never loaded into the right chains anyway.
+ *
+ * If HASHSET_FILE_PACKED is set in flags, runs are delta/varint encoded
+ * as in treeset_packed.h instead of plain int32.
+ */
+#define HASHSET_FILE_MAGIC	 "HSWTCSET"
+#define HASHSET_FILE_VERSION 1
+#define HASHSET_FILE_PACKED	 0x1
+
+struct hashset_file_header {
+	char	 magic[8];			// HASHSET_FILE_MAGIC without '\0'
+	uint32_t version;			// HASHSET_FILE_VERSION
+	uint32_t table_size;		// HASHSET_TABLE_SIZE of the writer
+	uint32_t flags;				// HASHSET_FILE_PACKED or 0
+	uint32_t reserved;
+	uint64_t total;				// total number of elements
+	uint64_t checksum;			// checksum of header and bucket table, computed with this field 0
+};
+
+struct hashset_file_bucket {
+	uint64_t offset;			// offset of the run from the beginning of file
+	uint64_t size;				// size of the run in bytes
+	uint32_t count;				// number of elements in the run
+	uint32_t reserved;
+	uint64_t checksum;			// checksum of the run
+};
+
+/* Input formats of hashset_import_fd(...) */
+#define HASHSET_IMPORT_TEXT		0
+#define HASHSET_IMPORT_INT32LE	1
+
+int  hashset_save(struct hashset_chain *set, const char *path);
+int  hashset_save_packed(struct hashset_chain *set, const char *path);
+struct hashset_chain *hashset_load(const char *path);
+int  hashset_import_fd(struct hashset_chain *set, int fd, int format);
+int  hashset_import_file(struct hashset_chain *set, const char *path, int format);
+uint64_t hashset_checksum(const void *data, uint64_t size);
+uint64_t hashset_file_layout(struct hashset_chain *set, struct hashset_file_header *header, struct hashset_file_bucket *buckets);
+uint64_t hashset_file_place_runs(struct hashset_file_bucket *buckets);
+uint64_t hashset_file_header_checksum(const struct hashset_file_header *header, const struct hashset_file_bucket *buckets);
+int  hashset_file_validate(const char *map, uint64_t map_size);
+int  hashset_write_all(int fd, const void *data, size_t size);
+
+#endif
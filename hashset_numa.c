@@ -0,0 +1,172 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "hashset_chain.h"
+#include "hashset_numa.h"
+
+/* Policy of set_mempolicy(2): allocate on the given node, or elsewhere if it's full */
+#define HASHSET_NUMA_MPOL_PREFERRED 1
+
+#ifdef HASHSET_NUMA
+
+static int numa_num_nodes = 1;
+static cpu_set_t numa_cpus[HASHSET_NUMA_MAX_NODES];
+static int numa_ids[HASHSET_NUMA_MAX_NODES];		// node numbers of the system
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+static void hashset_numa_init(void);
+static int  hashset_numa_parse_list(const char *path, cpu_set_t *cpus);
+
+#endif
+
+
+/*
+ * @return number of NUMA nodes buckets are spread over, 1 without HASHSET_NUMA
+ */
+int
+hashset_numa_nodes(void)
+{
+#ifdef HASHSET_NUMA
+	if (pthread_once(&numa_once, &hashset_numa_init))
+		return 1;
+	return numa_num_nodes;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * @return node of bucket. Buckets of a node are contiguous in the table.
+ */
+int
+hashset_numa_node_of_bucket(int bucket)
+{
+	return bucket * hashset_numa_nodes() / HASHSET_TABLE_SIZE;
+}
+
+/*
+ * @return node of thread-th of num_threads threads, spread evenly over nodes
+ */
+int
+hashset_numa_node_of_thread(int thread,
+							int num_threads)
+{
+	if (num_threads <= 0)
+		return 0;
+	return thread * hashset_numa_nodes() / num_threads;
+}
+
+/*
+ * Pin the calling thread to the CPUs of node, and let its memory be allocated on node.
+ *
+ * @return 1 if the thread is bound, 0 if there's only one node or it failed
+ */
+int
+hashset_numa_bind_thread(int node)
+{
+#ifdef HASHSET_NUMA
+	unsigned long mask;
+
+	if (hashset_numa_nodes() < 2 || node < 0 || node >= numa_num_nodes)
+		return 0;
+
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &(numa_cpus[node])))
+		return 0;
+
+#ifdef SYS_set_mempolicy
+	if (numa_ids[node] >= (int)(sizeof(mask) * 8))
+		return 1;
+	mask = 1UL << numa_ids[node];
+	if (syscall(SYS_set_mempolicy, HASHSET_NUMA_MPOL_PREFERRED, &mask, sizeof(mask) * 8))
+		return 0;
+#else
+	(void)mask;
+#endif
+	return 1;
+#else
+	(void)node;
+	return 0;
+#endif
+}
+
+#ifdef HASHSET_NUMA
+
+/*
+ * Read the nodes that have CPUs and the CPUs of each node.
+ * Nodes without CPUs (memory only) are skipped.
+ */
+static void
+hashset_numa_init(void)
+{
+	int node, num_nodes;
+	char path[64];
+	cpu_set_t online, cpus;
+
+	/* The list of nodes has the same format as a list of CPUs */
+	if (!hashset_numa_parse_list("/sys/devices/system/node/online", &online))
+		return;
+
+	num_nodes = 0;
+	for (node = 0; node < CPU_SETSIZE && num_nodes < HASHSET_NUMA_MAX_NODES; node++)
+	{
+		if (!CPU_ISSET(node, &online))
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (!hashset_numa_parse_list(path, &cpus) || CPU_COUNT(&cpus) == 0)
+			continue;
+		numa_cpus[num_nodes] = cpus;
+		numa_ids[num_nodes++] = node;
+	}
+	numa_num_nodes = (num_nodes > 0) ? num_nodes : 1;
+}
+
+/*
+ * Parse a list of CPUs such as "0-7,16-23"
+ *
+ * @return 1 if parsed, 0 if the file can't be read
+ */
+static int
+hashset_numa_parse_list(const char *path,
+						cpu_set_t *cpus)
+{
+	FILE *file;
+	char line[4096], *cursor, *end;
+	long from, to, cpu;
+
+	CPU_ZERO(cpus);
+	file = fopen(path, "r");
+	if (file == NULL)
+		return 0;
+	if (fgets(line, sizeof(line), file) == NULL) {
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+
+	cursor = line;
+	while (*cursor != '\0' && *cursor != '\n') {
+		from = strtol(cursor, &end, 10);
+		if (end == cursor)
+			break;
+		to = from;
+		if (*end == '-')
+			to = strtol(end + 1, &end, 10);
+		for (cpu = from; cpu <= to && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, cpus);
+		cursor = (*end == ',') ? end + 1 : end;
+	}
+	return 1;
+}
+
+#endif
@@ -0,0 +1,33 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_NUMA_H
+#define HASHSET_NUMA_H
+
+/*
+ * Placement of buckets and threads on NUMA nodes.
+ *
+ * If the library is compiled with -DHASHSET_NUMA, the table is cut into as many
+ * contiguous ranges of buckets as there are nodes. Threads of set-with-set
+ * operations, threads working on a range of buckets (hashset_run_bucket_tasks(...))
+ * and workers of hashset_pool.h are pinned to the CPUs of one node and prefer memory
+ * of that node, so that nodes of chains are allocated (first touched) locally,
+ * and threads of set operations take the buckets of their own node first.
+ * Threads of operations with array aren't pinned, as their elements go to any bucket.
+ *
+ * Nodes are read from /sys/devices/system/node, and affinity and memory policy
+ * are set by system calls directly, so libnuma is not needed. On a machine with
+ * one node, or if any of this fails, threads are simply left where they are.
+ * Without -DHASHSET_NUMA there is always one node.
+ */
+
+/* Nodes beyond this share the buckets of the last ones */
+#define HASHSET_NUMA_MAX_NODES 8
+
+int  hashset_numa_nodes(void);
+int  hashset_numa_node_of_bucket(int bucket);
+int  hashset_numa_node_of_thread(int thread, int num_threads);
+int  hashset_numa_bind_thread(int node);
+
+#endif
@@ -0,0 +1,412 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hashset_chain.h"
+#include "hashset_numa.h"
+#include "hashset_pool.h"
+
+#define HASHSET_POOL_CACHE_LINE 64
+#define HASHSET_POOL_SPINS		64	/* rounds of looking for work before a worker sleeps */
+
+/*
+ * Deque of a worker (Chase-Lev).
+ * Only the owner touches bottom, thieves race for top with compare-and-swap.
+ * Aligned to cache lines so that workers never share one.
+ */
+struct pool_worker {
+	long top;
+	long bottom;
+	struct hashset_job *jobs[HASHSET_POOL_DEQUE_SIZE];
+	unsigned int seed;	// for choosing victims
+	int node;			// NUMA node the worker is bound to
+	pthread_t tid;
+} __attribute__((aligned(HASHSET_POOL_CACHE_LINE)));
+
+static struct pool_worker *pool_workers;
+static int pool_num_workers;
+static int pool_sleepers;						/* workers waiting for pool_work_cond */
+static struct hashset_job *pool_queue_head;		/* jobs forked from outside the pool */
+static struct hashset_job *pool_queue_tail;
+static pthread_once_t  pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  pool_done_cond = PTHREAD_COND_INITIALIZER;
+static __thread struct pool_worker *pool_self;	/* deque of the calling worker, NULL outside the pool */
+
+static void pool_start(void);
+static void *pool_worker_main(void *arg);
+static void pool_run(struct hashset_job *job);
+static int  pool_push(struct pool_worker *worker, struct hashset_job *job);
+static struct hashset_job *pool_pop(struct pool_worker *worker);
+static struct hashset_job *pool_steal(struct pool_worker *worker);
+static struct hashset_job *pool_steal_any(struct pool_worker *self);
+static struct hashset_job *pool_take_queued(void);
+static int  pool_has_work(void);
+static void pool_wake_worker(void);
+
+
+/*
+ * @return number of workers of the pool, 0 if forked jobs are run by the forking thread
+ */
+int
+hashset_pool_workers(void)
+{
+	if (pthread_once(&pool_once, &pool_start))
+		return 0;
+	return pool_num_workers;
+}
+
+/*
+ * Let job->function(job) run in parallel with the caller.
+ * Caller MUST call hashset_pool_join(job) before job goes away.
+ */
+void
+hashset_pool_fork(struct hashset_job *job)
+{
+	job->done	  = 0;
+	job->external = 0;
+	job->queued	  = 0;
+	job->next	  = NULL;
+
+	if (hashset_pool_workers() == 0) {
+		pool_run(job);
+		return;
+	}
+
+	if (pool_self != NULL) {
+		if (!pool_push(pool_self, job)) {
+			/* Deque is full, there's enough work for everybody already */
+			pool_run(job);
+			return;
+		}
+		/* Pairs with the fence of a worker going to sleep in pool_worker_main(...) */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&pool_sleepers, __ATOMIC_RELAXED) > 0)
+			pool_wake_worker();
+		return;
+	}
+
+	job->external = 1;
+	pthread_mutex_lock(&pool_lock);
+	job->queued = 1;
+	if (pool_queue_tail == NULL)
+		__atomic_store_n(&pool_queue_head, job, __ATOMIC_RELAXED);
+	else
+		pool_queue_tail->next = job;
+	pool_queue_tail = job;
+	pthread_cond_signal(&pool_work_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Wait until job forked by hashset_pool_fork(...) is done.
+ * A worker runs other jobs meanwhile: its own if job is still in its deque,
+ * or ones stolen from others. A thread outside the pool runs job by itself
+ * if no worker has taken it yet.
+ */
+void
+hashset_pool_join(struct hashset_job *job)
+{
+	struct hashset_job *other, *prev;
+	int spins;
+
+	if (__atomic_load_n(&(job->done), __ATOMIC_ACQUIRE))
+		return;
+
+	if (job->external) {
+		pthread_mutex_lock(&pool_lock);
+		if (job->queued) {
+			/* Nobody took it, so take it back from the queue */
+			prev = NULL;
+			for (other = pool_queue_head; other != job; other = other->next)
+				prev = other;
+			if (prev == NULL)
+				__atomic_store_n(&pool_queue_head, job->next, __ATOMIC_RELAXED);
+			else
+				prev->next = job->next;
+			if (pool_queue_tail == job)
+				pool_queue_tail = prev;
+			job->queued = 0;
+			pthread_mutex_unlock(&pool_lock);
+
+			job->external = 0;
+			pool_run(job);
+			return;
+		}
+		while (!job->done)
+			pthread_cond_wait(&pool_done_cond, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+
+	/* Only a worker can have pushed job, see hashset_pool_fork(...) */
+	for (spins = 0; !__atomic_load_n(&(job->done), __ATOMIC_ACQUIRE); spins++) {
+		other = NULL;
+		if (pool_self != NULL) {
+			other = pool_pop(pool_self);
+			if (other == NULL)
+				other = pool_steal_any(pool_self);
+		}
+		if (other != NULL) {
+			pool_run(other);
+			spins = 0;
+		}
+		else if (spins >= HASHSET_POOL_SPINS)
+			sched_yield();
+	}
+}
+
+/*
+ * Start NUM_THREADS workers, unless NUM_THREADS is 1
+ */
+static void
+pool_start(void)
+{
+	int i, error;
+	void *memory;
+	pthread_attr_t attr;
+
+	if (NUM_THREADS < 2)
+		return;
+
+	if (posix_memalign(&memory, HASHSET_POOL_CACHE_LINE, NUM_THREADS * sizeof(struct pool_worker))) {
+		perror("Failed to allocate memory to workers");
+		return;
+	}
+	pool_workers = (struct pool_worker *)memory;
+
+	for (i = 0; i < NUM_THREADS; i++)
+	{
+		pool_workers[i].top	   = 0;
+		pool_workers[i].bottom = 0;
+		pool_workers[i].seed   = i + 1;
+		pool_workers[i].node   = hashset_numa_node_of_thread(i, NUM_THREADS);
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < NUM_THREADS; i++)
+	{
+		error = pthread_create(&(pool_workers[i].tid), &attr, &pool_worker_main, &(pool_workers[i]));
+		if (error) {
+			perror("Failed to create worker");
+			break;
+		}
+		/* Workers only look at others below pool_num_workers */
+		__atomic_store_n(&pool_num_workers, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void *
+pool_worker_main(void *arg)
+{
+	struct hashset_job *job;
+	int spins;
+
+	pool_self = (struct pool_worker *)arg;
+	hashset_numa_bind_thread(pool_self->node);
+
+	for (spins = 0; ; spins++) {
+		job = pool_pop(pool_self);
+		if (job == NULL)
+			job = pool_steal_any(pool_self);
+		if (job == NULL && __atomic_load_n(&pool_queue_head, __ATOMIC_RELAXED) != NULL)
+			job = pool_take_queued();
+
+		if (job != NULL) {
+			pool_run(job);
+			spins = 0;
+			continue;
+		}
+		if (spins < HASHSET_POOL_SPINS) {
+			sched_yield();
+			continue;
+		}
+
+		/* Nothing to do, sleep until a fork */
+		pthread_mutex_lock(&pool_lock);
+		__atomic_add_fetch(&pool_sleepers, 1, __ATOMIC_SEQ_CST);
+		if (!pool_has_work())
+			pthread_cond_wait(&pool_work_cond, &pool_lock);
+		__atomic_sub_fetch(&pool_sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool_lock);
+		spins = 0;
+	}
+
+	return NULL;
+}
+
+static void
+pool_run(struct hashset_job *job)
+{
+	job->function(job);
+
+	if (job->external) {
+		pthread_mutex_lock(&pool_lock);
+		__atomic_store_n(&(job->done), 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&pool_done_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+	else
+		__atomic_store_n(&(job->done), 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Push job at the bottom of the deque of the calling worker
+ * @return 1 if pushed, 0 if the deque is full
+ */
+static int
+pool_push(struct pool_worker *worker,
+		  struct hashset_job *job)
+{
+	long top, bottom;
+
+	bottom = __atomic_load_n(&(worker->bottom), __ATOMIC_RELAXED);
+	top	   = __atomic_load_n(&(worker->top), __ATOMIC_ACQUIRE);
+	if (bottom - top >= HASHSET_POOL_DEQUE_SIZE)
+		return 0;
+
+	__atomic_store_n(&(worker->jobs[bottom % HASHSET_POOL_DEQUE_SIZE]), job, __ATOMIC_RELAXED);
+	__atomic_store_n(&(worker->bottom), bottom + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Pop the newest job of the deque of the calling worker
+ * @return job, NULL if the deque is empty or a thief took the last one
+ */
+static struct hashset_job *
+pool_pop(struct pool_worker *worker)
+{
+	long top, bottom;
+	struct hashset_job *job;
+
+	bottom = __atomic_load_n(&(worker->bottom), __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&(worker->bottom), bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&(worker->top), __ATOMIC_RELAXED);
+
+	if (top > bottom) {
+		/* Empty */
+		__atomic_store_n(&(worker->bottom), bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	job = __atomic_load_n(&(worker->jobs[bottom % HASHSET_POOL_DEQUE_SIZE]), __ATOMIC_RELAXED);
+	if (top == bottom) {
+		/* Last job, race with thieves for it */
+		if (!__atomic_compare_exchange_n(&(worker->top), &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			job = NULL;
+		__atomic_store_n(&(worker->bottom), bottom + 1, __ATOMIC_RELAXED);
+	}
+	return job;
+}
+
+/*
+ * Steal the oldest job of the deque of worker
+ * @return job, NULL if the deque is empty or another thread won the race
+ */
+static struct hashset_job *
+pool_steal(struct pool_worker *worker)
+{
+	long top, bottom;
+	struct hashset_job *job;
+
+	top = __atomic_load_n(&(worker->top), __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&(worker->bottom), __ATOMIC_ACQUIRE);
+	if (top >= bottom)
+		return NULL;
+
+	job = __atomic_load_n(&(worker->jobs[top % HASHSET_POOL_DEQUE_SIZE]), __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&(worker->top), &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return job;
+}
+
+/*
+ * Try the deques of all other workers once, starting from a random one.
+ * Workers on the same NUMA node are tried first, so that nodes of a tree
+ * built or freed by a job mostly stay in local memory.
+ */
+static struct hashset_job *
+pool_steal_any(struct pool_worker *self)
+{
+	int i, num_workers, victim, local;
+	struct hashset_job *job;
+
+	num_workers = __atomic_load_n(&pool_num_workers, __ATOMIC_ACQUIRE);
+	if (num_workers < 2)
+		return NULL;
+	victim = rand_r(&(self->seed)) % num_workers;
+	for (local = (hashset_numa_nodes() > 1); local >= 0; local--)
+	{
+		for (i = 0; i < num_workers; i++, victim = (victim + 1) % num_workers)
+		{
+			if (&(pool_workers[victim]) == self)
+				continue;
+			if (local && pool_workers[victim].node != self->node)
+				continue;
+			job = pool_steal(&(pool_workers[victim]));
+			if (job != NULL)
+				return job;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the oldest job forked from outside the pool
+ */
+static struct hashset_job *
+pool_take_queued(void)
+{
+	struct hashset_job *job;
+
+	pthread_mutex_lock(&pool_lock);
+	job = pool_queue_head;
+	if (job != NULL) {
+		__atomic_store_n(&pool_queue_head, job->next, __ATOMIC_RELAXED);
+		if (pool_queue_head == NULL)
+			pool_queue_tail = NULL;
+		job->queued = 0;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return job;
+}
+
+/*
+ * @return 1 if any job is waiting, called with pool_lock held
+ */
+static int
+pool_has_work(void)
+{
+	int i, num_workers;
+
+	if (pool_queue_head != NULL)
+		return 1;
+
+	num_workers = __atomic_load_n(&pool_num_workers, __ATOMIC_ACQUIRE);
+	for (i = 0; i < num_workers; i++)
+	{
+		if (__atomic_load_n(&(pool_workers[i].top), __ATOMIC_SEQ_CST) <
+			__atomic_load_n(&(pool_workers[i].bottom), __ATOMIC_SEQ_CST))
+			return 1;
+	}
+	return 0;
+}
+
+static void
+pool_wake_worker(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	pthread_cond_signal(&pool_work_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
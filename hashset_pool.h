@@ -0,0 +1,44 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_POOL_H
+#define HASHSET_POOL_H
+
+/*
+ * Work-stealing pool for fork/join parallelism inside a chain,
+ * e.g. building or freeing the two subtrees of a large tree at the same time.
+ *
+ * NUM_THREADS workers are started on the first fork and live until the process exits.
+ * Each worker has its own deque: it pushes and pops forked jobs at the bottom
+ * while idle workers steal the oldest (and so largest) jobs from the top.
+ * A thread outside the pool hands its forks over to the workers through a shared queue.
+ * With NUM_THREADS 1, forked jobs are run right away by the forking thread.
+ *
+ * Usage (job MUST be the first member so that function can get its arguments back):
+ *     struct my_job { struct hashset_job job; ... };
+ *
+ *     left.job.function = &my_function;
+ *     hashset_pool_fork(&(left.job));
+ *     ... do the other half ...
+ *     hashset_pool_join(&(left.job));
+ */
+
+/* Jobs a worker can hold before running further forks by itself */
+#define HASHSET_POOL_DEQUE_SIZE 256
+
+struct hashset_job {
+	void (*function)(struct hashset_job *job);
+
+	/* Set by the pool */
+	int done;					// 1 once function returned
+	int external;				// 1 if forked by a thread outside the pool
+	int queued;					// 1 while an external job waits in the shared queue
+	struct hashset_job *next;	// next job in the shared queue
+};
+
+int  hashset_pool_workers(void);
+void hashset_pool_fork(struct hashset_job *job);
+void hashset_pool_join(struct hashset_job *job);
+
+#endif
@@ -0,0 +1,110 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hashset_stats.h"
+#include "treeset.h"
+
+static int  hashset_optimal_height(int size);
+
+
+/*
+ * Fill stats with the sizes and heights of all chains of set.
+ *
+ * Nothing is locked and no memory is allocated: each chain is read by
+ * treeset_shape(...), so that this can be called from a monitoring thread
+ * while other threads modify set. In that case each chain is consistent
+ * on its own, but the chains aren't read at the same instant.
+ *
+ * Time complexity: O(HASHSET_TABLE_SIZE)
+ * @return 1 if stats is filled, 0 if set or stats is NULL
+ */
+int
+hashset_get_stats(struct hashset_chain *set,
+				  struct hashset_stats *stats)
+{
+	int i;
+	double mean, variance, diff;
+
+	if (set == NULL || stats == NULL)
+		return 0;
+
+	memset(stats, 0, sizeof(struct hashset_stats));
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+	{
+		treeset_shape(set->table[i], &(stats->chain_sizes[i]), &(stats->chain_heights[i]));
+		stats->size += stats->chain_sizes[i];
+	}
+
+	stats->min_chain_size = stats->chain_sizes[0];
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+	{
+		if (stats->chain_sizes[i] == 0)
+			stats->empty_chains++;
+		if (stats->chain_sizes[i] < stats->min_chain_size)
+			stats->min_chain_size = stats->chain_sizes[i];
+		if (stats->chain_sizes[i] > stats->max_chain_size)
+			stats->max_chain_size = stats->chain_sizes[i];
+		if (stats->chain_heights[i] > stats->max_height)
+			stats->max_height = stats->chain_heights[i];
+	}
+
+	mean = (double)stats->size / HASHSET_TABLE_SIZE;
+	variance = 0.0;
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+	{
+		diff = stats->chain_sizes[i] - mean;
+		variance += diff * diff;
+	}
+	stats->mean_chain_size	 = mean;
+	stats->stddev_chain_size = sqrt(variance / HASHSET_TABLE_SIZE);
+	stats->skew = (stats->size > 0) ? stats->max_chain_size / mean : 0.0;
+
+	stats->memory = sizeof(struct hashset_chain)
+				  + HASHSET_TABLE_SIZE * sizeof(struct tree_set)
+				  + (size_t)stats->size * sizeof(struct avlnode);
+	return 1;
+}
+
+/*
+ * Print stats in a human readable form, one chain per line
+ * together with the lowest height possible for its size.
+ */
+void
+hashset_print_stats(FILE *stream,
+					const struct hashset_stats *stats)
+{
+	int i;
+
+	fprintf(stream, "elements        %d\n", stats->size);
+	fprintf(stream, "memory          %zu bytes\n", stats->memory);
+	fprintf(stream, "chains          %d (%d empty)\n", HASHSET_TABLE_SIZE, stats->empty_chains);
+	fprintf(stream, "chain size      min %d, max %d, mean %.2f, stddev %.2f\n",
+			stats->min_chain_size, stats->max_chain_size,
+			stats->mean_chain_size, stats->stddev_chain_size);
+	fprintf(stream, "skew            %.3f\n", stats->skew);
+	fprintf(stream, "max height      %d\n", stats->max_height);
+	fprintf(stream, "\nchain\tsize\theight\toptimal\n");
+	for (i = 0; i < HASHSET_TABLE_SIZE; i++)
+	{
+		fprintf(stream, "%d\t%d\t%d\t%d\n", i, stats->chain_sizes[i], stats->chain_heights[i],
+				hashset_optimal_height(stats->chain_sizes[i]));
+	}
+}
+
+/*
+ * @return height of a perfectly balanced tree of size elements
+ */
+static int
+hashset_optimal_height(int size)
+{
+	int height;
+
+	for (height = 0; size > 0; height++)
+		size /= 2;
+	return height;
+}
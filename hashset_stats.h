@@ -0,0 +1,35 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_STATS_H
+#define HASHSET_STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "hashset_chain.h"
+
+/*
+ * Shape of a hashset, filled by hashset_get_stats(...).
+ * It shows whether hashset_hash_code(...) puts elements into a few chains,
+ * which makes operations on those chains (and the threads working on them) slow.
+ */
+struct hashset_stats {
+	int size;								// total number of elements
+	int chain_sizes[HASHSET_TABLE_SIZE];	// number of elements of each chain
+	int chain_heights[HASHSET_TABLE_SIZE];	// height of the AVL tree of each chain, 0 if empty
+	int empty_chains;						// number of chains without elements
+	int min_chain_size;
+	int max_chain_size;
+	int max_height;							// height of the highest tree
+	double mean_chain_size;
+	double stddev_chain_size;
+	double skew;							// max_chain_size / mean_chain_size, 1.0 if even, 0.0 if set is empty
+	size_t memory;							// bytes of set, its chains and nodes (nodes shared with snapshots included)
+};
+
+int  hashset_get_stats(struct hashset_chain *set, struct hashset_stats *stats);
+void hashset_print_stats(FILE *stream, const struct hashset_stats *stats);
+
+#endif
@@ -0,0 +1,224 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashset_chain.h"
+#include "hashset_trace.h"
+
+/* One phase of one thread, written as a complete event ("ph":"X") */
+struct trace_event {
+	const char *name;
+	const char *category;
+	unsigned long long begin, end;	// ns of CLOCK_MONOTONIC
+	int tid;						// small id of the thread, see hashset_trace_record(...)
+	int from, to;					// range of table or array index the phase worked on
+};
+
+static struct trace_event *trace_events;
+static char *trace_path;
+static int trace_on;			// 1 between hashset_trace_start(...) and hashset_trace_stop()
+static int trace_count;			// events reserved so far, may exceed HASHSET_TRACE_MAX_EVENTS
+static int trace_recording;		// threads in hashset_trace_record(...)
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int  hashset_trace_write(FILE *stream, int count);
+
+#ifdef HASHSET_TRACE
+
+static int trace_next_tid;
+static __thread int trace_tid;	// 0 until the thread records its first event
+
+/*
+ * @return monotonic time in ns
+ */
+unsigned long long
+hashset_trace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * @return name of enum SET_OPERATION, used as category of events
+ */
+const char *
+hashset_trace_operation(int operation)
+{
+	switch (operation) {
+		case ADD:	 return "add";
+		case REMOVE: return "remove";
+		case FIND:	 return "find";
+		case RETAIN: return "retain";
+		default:	 return "unknown";
+	}
+}
+
+/*
+ * Record a phase of the calling thread from begin until now.
+ * Nothing is recorded unless tracing is started.
+ * No lock is taken, each event takes its own slot of the buffer.
+ */
+void
+hashset_trace_record(const char *name,
+					 const char *category,
+					 unsigned long long begin,
+					 int from,
+					 int to)
+{
+	int index;
+	struct trace_event *event;
+
+	/* Announce the recording before checking trace_on, see hashset_trace_stop() */
+	__atomic_add_fetch(&trace_recording, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&trace_on, __ATOMIC_SEQ_CST)) {
+		index = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+		if (index < HASHSET_TRACE_MAX_EVENTS) {
+			if (trace_tid == 0)
+				trace_tid = __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+
+			event = &(trace_events[index]);
+			event->name		= name;
+			event->category = category;
+			event->begin	= begin;
+			event->end		= hashset_trace_now();
+			event->tid		= trace_tid;
+			event->from		= from;
+			event->to		= to;
+		}
+	}
+	__atomic_sub_fetch(&trace_recording, 1, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+/*
+ * Start recording phases. They're written to path by hashset_trace_stop().
+ *
+ * @return 1 if recording started, 0 if it's already running,
+ *		   memory allocation failed or the library is compiled without HASHSET_TRACE
+ */
+int
+hashset_trace_start(const char *path)
+{
+#ifdef HASHSET_TRACE
+	pthread_mutex_lock(&trace_lock);
+	if (trace_events != NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return 0;
+	}
+
+	trace_events = (struct trace_event *)malloc(HASHSET_TRACE_MAX_EVENTS * sizeof(struct trace_event));
+	trace_path	 = strdup(path);
+	if (trace_events == NULL || trace_path == NULL) {
+		perror("Failed to allocate memory for trace");
+		free(trace_events);
+		free(trace_path);
+		trace_events = NULL;
+		trace_path	 = NULL;
+		pthread_mutex_unlock(&trace_lock);
+		return 0;
+	}
+
+	__atomic_store_n(&trace_count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_on, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&trace_lock);
+
+	return 1;
+#else
+	(void)path;
+	return 0;
+#endif
+}
+
+/*
+ * Stop recording and write the recorded phases to the path given to hashset_trace_start(...)
+ *
+ * @return 1 if the trace is written, otherwise 0
+ */
+int
+hashset_trace_stop(void)
+{
+	int count, success;
+	FILE *stream;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_events == NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return 0;
+	}
+
+	/* Wait for threads that saw trace_on before it was cleared */
+	__atomic_store_n(&trace_on, 0, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&trace_recording, __ATOMIC_SEQ_CST) > 0)
+		sched_yield();
+
+	count = __atomic_load_n(&trace_count, __ATOMIC_RELAXED);
+	if (count > HASHSET_TRACE_MAX_EVENTS) {
+		fprintf(stderr, "%d trace events dropped\n", count - HASHSET_TRACE_MAX_EVENTS);
+		count = HASHSET_TRACE_MAX_EVENTS;
+	}
+
+	success = 0;
+	stream	= fopen(trace_path, "w");
+	if (stream == NULL)
+		perror("Failed to open trace file");
+	else {
+		success = hashset_trace_write(stream, count);
+		success &= (fclose(stream) == 0);
+		if (!success)
+			perror("Failed to write trace file");
+	}
+
+	free(trace_events);
+	free(trace_path);
+	trace_events = NULL;
+	trace_path	 = NULL;
+	pthread_mutex_unlock(&trace_lock);
+
+	return success;
+}
+
+/*
+ * Write events as Chrome trace event JSON.
+ * Timestamps are in us, counted from the earliest event.
+ *
+ * @return 1 if written, 0 on error
+ */
+static int
+hashset_trace_write(FILE *stream,
+					int count)
+{
+	int i;
+	unsigned long long origin;
+	struct trace_event *event;
+
+	origin = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (i == 0 || trace_events[i].begin < origin)
+			origin = trace_events[i].begin;
+	}
+
+	fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (i = 0; i < count; i++)
+	{
+		event = &(trace_events[i]);
+		fprintf(stream, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"from\":%d,\"to\":%d}}",
+				(i > 0) ? "," : "", event->name, event->category, event->tid,
+				(event->begin - origin) / 1000.0, (event->end - event->begin) / 1000.0,
+				event->from, event->to);
+	}
+	fprintf(stream, "\n]}\n");
+
+	return !ferror(stream);
+}
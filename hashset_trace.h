@@ -0,0 +1,48 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_TRACE_H
+#define HASHSET_TRACE_H
+
+/*
+ * Timeline of the phases of set operations run by multiple threads
+ * (allocation, thread creation, the task of each thread, each chain, join),
+ * written as Chrome trace event JSON which chrome://tracing or Perfetto can open.
+ * It shows which ranges of table or array took long and which threads straggled.
+ *
+ * Phases are only recorded if the library is compiled with -DHASHSET_TRACE,
+ * and only between hashset_trace_start(...) and hashset_trace_stop().
+ * Without the flag the macros below expand to nothing.
+ *
+ * Usage:
+ *     hashset_trace_start("add_set.json");
+ *     hashset_add_set(setA, setB);
+ *     hashset_trace_stop();
+ */
+
+/* Events recorded at most between start and stop, the rest are dropped */
+#define HASHSET_TRACE_MAX_EVENTS (1 << 20)
+
+#ifdef HASHSET_TRACE
+
+#define HASHSET_TRACE_BEGIN(begin) \
+	((begin) = hashset_trace_now())
+#define HASHSET_TRACE_END(name, category, begin, from, to) \
+	hashset_trace_record((name), (category), (begin), (from), (to))
+
+unsigned long long hashset_trace_now(void);
+const char *hashset_trace_operation(int operation);
+void hashset_trace_record(const char *name, const char *category, unsigned long long begin, int from, int to);
+
+#else
+
+#define HASHSET_TRACE_BEGIN(begin)							((void)0)
+#define HASHSET_TRACE_END(name, category, begin, from, to)	((void)0)
+
+#endif
+
+int  hashset_trace_start(const char *path);
+int  hashset_trace_stop(void);
+
+#endif
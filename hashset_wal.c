@@ -0,0 +1,913 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashset_wal.h"
+#include "hashset_frozen.h"
+#include "hashset_internal.h"
+#include "hashset_io.h"
+#include "treeset.h"
+
+static char *hashset_wal_path(const char *dir, const char *name, uint64_t seq);
+static int  hashset_wal_parse_name(const char *name, const char *prefix, uint64_t *seq);
+static int  hashset_wal_sync_dir(const char *dir);
+static int  hashset_wal_create_segment(const char *dir, uint64_t seq);
+static int  hashset_wal_log(struct hashset_wal *wal, enum HASHSET_WAL_OPERATION operation, int *array_data, int array_size);
+static int  hashset_wal_flush_locked(struct hashset_wal *wal);
+static void *hashset_wal_checkpoint_thread(void *arg);
+static int  hashset_wal_write_checkpoint(struct hashset_wal *wal, struct hashset_frozen *frozen, uint64_t seq);
+static void hashset_wal_remove_old_files(const char *dir, uint64_t seq);
+static int  hashset_wal_recover(struct hashset_wal *wal);
+static void hashset_wal_replay_in_buckets(struct bucket_task *task);
+
+/* Arguments of the thread of hashset_wal_checkpoint(...) */
+struct checkpoint_data {
+	struct hashset_wal	 *wal;
+	struct hashset_chain *snapshot;
+	uint64_t seq;
+};
+
+/* Records of one batch to replay */
+struct replay_batch {
+	const struct hashset_wal_record *records;
+	uint32_t count;
+};
+
+/* Arguments shared by threads of hashset_wal_recover(...) */
+struct replay_data {
+	struct hashset_chain *set;
+	struct replay_batch *batches;
+	int num_batches;
+};
+
+/* Log segment mapped by hashset_wal_recover(...) */
+struct replay_segment {
+	uint64_t seq;
+	char	*map;
+	size_t	 size;
+};
+
+/*
+ * Open the write-ahead log in dir, creating dir if it doesn't exist.
+ * The set is recovered from the latest checkpoint and the segments after it,
+ * which are replayed by multiple threads, each of which owns a range of buckets.
+ * Then a new segment is started for the records to come.
+ *
+ * @return pointer to a new wal whose set is wal->set, NULL if failed.
+ *		   errno is EINVAL if the log is broken.
+ */
+struct hashset_wal *
+hashset_wal_open(const char *dir)
+{
+	struct hashset_wal *wal;
+
+	if (dir == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return NULL;
+
+	wal = (struct hashset_wal *)calloc(1, sizeof(struct hashset_wal));
+	if (wal == NULL) {
+		perror("Failed to allocate memory to wal");
+		return NULL;
+	}
+
+	wal->fd	 = -1;
+	wal->dir = strdup(dir);
+	wal->buffer		  = (struct hashset_wal_buffer *)calloc(1, sizeof(struct hashset_wal_buffer));
+	wal->flush_buffer = (struct hashset_wal_buffer *)calloc(1, sizeof(struct hashset_wal_buffer));
+	if (wal->dir == NULL || wal->buffer == NULL || wal->flush_buffer == NULL) {
+		perror("Failed to allocate memory to wal");
+		goto free_end;
+	}
+	wal->checkpoint_interval = HASHSET_WAL_CHECKPOINT_INTERVAL;
+
+	if (!hashset_wal_recover(wal))
+		goto free_end;
+
+	wal->fd = hashset_wal_create_segment(dir, wal->seq);
+	if (wal->fd < 0)
+		goto free_end;
+
+	pthread_mutex_init(&(wal->lock), NULL);
+	pthread_cond_init(&(wal->flushed), NULL);
+	pthread_cond_init(&(wal->checkpointed), NULL);
+	return wal;
+
+free_end:
+	if (wal->set != NULL)
+		hashset_free_set(wal->set);
+	free(wal->flush_buffer);
+	free(wal->buffer);
+	free(wal->dir);
+	free(wal);
+	return NULL;
+}
+
+/*
+ * Commit pending records, wait for a running checkpoint and close wal.
+ * wal->set is NOT freed, so read it before and free it with hashset_free_set(...)
+ *
+ * @return 1 if every record was made durable, 0 otherwise
+ */
+int
+hashset_wal_close(struct hashset_wal *wal)
+{
+	int success;
+
+	if (wal == NULL)
+		return 0;
+
+	success = hashset_wal_commit(wal);
+
+	pthread_mutex_lock(&(wal->lock));
+	while (wal->checkpointing)
+		pthread_cond_wait(&(wal->checkpointed), &(wal->lock));
+	pthread_mutex_unlock(&(wal->lock));
+	if (wal->checkpoint_thread_created)
+		pthread_join(wal->checkpoint_thread, NULL);
+
+	close(wal->fd);
+	pthread_cond_destroy(&(wal->checkpointed));
+	pthread_cond_destroy(&(wal->flushed));
+	pthread_mutex_destroy(&(wal->lock));
+	free(wal->flush_buffer);
+	free(wal->buffer);
+	free(wal->dir);
+	free(wal);
+
+	return success;
+}
+
+/*
+ * Add data into wal->set and log it.
+ * The record is durable only after hashset_wal_commit(...) returns.
+ *
+ * @return 1 if the data is added into set, 0 otherwise.
+ */
+int
+hashset_wal_add(struct hashset_wal *wal,
+				int data)
+{
+	return hashset_wal_log(wal, HASHSET_WAL_ADD, &data, 1);
+}
+
+/*
+ * Remove data from wal->set and log it.
+ * The record is durable only after hashset_wal_commit(...) returns.
+ *
+ * @return 1 if the data is removed from set, 0 otherwise.
+ */
+int
+hashset_wal_remove(struct hashset_wal *wal,
+				   int data)
+{
+	return hashset_wal_log(wal, HASHSET_WAL_REMOVE, &data, 1);
+}
+
+/*
+ * Add array into wal->set and log it, taking the lock of wal only once.
+ * @return 1 if the set is modified due to the operation, 0 otherwise.
+ */
+int
+hashset_wal_add_array(struct hashset_wal *wal,
+					  int *array_data,
+					  int  array_size)
+{
+	return hashset_wal_log(wal, HASHSET_WAL_ADD, array_data, array_size);
+}
+
+/*
+ * Remove array from wal->set and log it, taking the lock of wal only once.
+ * @return 1 if the set is modified due to the operation, 0 otherwise.
+ */
+int
+hashset_wal_remove_array(struct hashset_wal *wal,
+						 int *array_data,
+						 int  array_size)
+{
+	return hashset_wal_log(wal, HASHSET_WAL_REMOVE, array_data, array_size);
+}
+
+/*
+ * Find data in wal->set, safe against threads logging at the same time
+ * @return 1 if data is found, 0 otherwise
+ */
+int
+hashset_wal_find(struct hashset_wal *wal,
+				 int data)
+{
+	int found;
+
+	if (wal == NULL)
+		return 0;
+
+	pthread_mutex_lock(&(wal->lock));
+	found = treeset_find(wal->set->table[hashset_hash_code(data)], data);
+	pthread_mutex_unlock(&(wal->lock));
+
+	return found;
+}
+
+/*
+ * Make every record logged so far durable.
+ * Threads committing at the same time share one write(2) and fdatasync(2):
+ * one of them writes all records buffered so far while the others wait.
+ * A checkpoint is started in background once the current segment has
+ * wal->checkpoint_interval records.
+ *
+ * @return 1 if succeeded, 0 otherwise
+ */
+int
+hashset_wal_commit(struct hashset_wal *wal)
+{
+	int success, start_checkpoint;
+	uint64_t target_lsn;
+
+	if (wal == NULL)
+		return 0;
+
+	pthread_mutex_lock(&(wal->lock));
+	target_lsn = wal->next_lsn;
+	while (wal->durable_lsn < target_lsn && !wal->failed) {
+		if (wal->flushing)
+			pthread_cond_wait(&(wal->flushed), &(wal->lock));
+		else
+			hashset_wal_flush_locked(wal);
+	}
+	success = (wal->durable_lsn >= target_lsn);
+
+	start_checkpoint = success					&&
+					   wal->checkpoint_interval > 0 &&
+					   wal->segment_records >= wal->checkpoint_interval &&
+					   !wal->checkpointing;
+	pthread_mutex_unlock(&(wal->lock));
+
+	if (start_checkpoint)
+		hashset_wal_checkpoint(wal);
+
+	return success;
+}
+
+/*
+ * Start a checkpoint.
+ * A consistent copy of the set is taken by hashset_snapshot(...) in O(table size) and a new
+ * segment is started, then the copy is frozen and written to checkpoint.<seq> in background. Older segments and checkpoints
+ * are removed once it's durable. Waits for the previous checkpoint if it's still running.
+ *
+ * @return 1 if the checkpoint is started, 0 otherwise
+ */
+int
+hashset_wal_checkpoint(struct hashset_wal *wal)
+{
+	int fd, created;
+	struct hashset_chain *snapshot;
+	struct checkpoint_data *data;
+
+	if (wal == NULL)
+		return 0;
+
+	/*
+	 * Wait for the previous checkpoint, and make records of the current segment durable
+	 * before moving to the next one. Both are checked again after every wait, as
+	 * another thread may start a checkpoint while the lock is released.
+	 */
+	pthread_mutex_lock(&(wal->lock));
+	while (wal->checkpointing ||
+		   ((wal->flushing || wal->buffer->header.count > 0) && !wal->failed)) {
+		if (wal->checkpointing)
+			pthread_cond_wait(&(wal->checkpointed), &(wal->lock));
+		else if (wal->flushing)
+			pthread_cond_wait(&(wal->flushed), &(wal->lock));
+		else
+			hashset_wal_flush_locked(wal);
+	}
+	if (wal->failed)
+		goto unlock_end;
+
+	data = (struct checkpoint_data *)malloc(sizeof(struct checkpoint_data));
+	if (data == NULL) {
+		perror("Failed to allocate memory to checkpoint");
+		goto unlock_end;
+	}
+	/* Loggers modify the set only with wal->lock held, so no writer is in the way */
+	snapshot = hashset_snapshot(wal->set);
+	if (snapshot == NULL) {
+		free(data);
+		goto unlock_end;
+	}
+	fd = hashset_wal_create_segment(wal->dir, wal->seq + 1);
+	if (fd < 0) {
+		hashset_free_set(snapshot);
+		free(data);
+		goto unlock_end;
+	}
+
+	close(wal->fd);
+	wal->fd = fd;
+	wal->seq++;
+	wal->segment_records = 0;
+
+	data->wal	 = wal;
+	data->snapshot = snapshot;
+	data->seq	   = wal->seq;
+
+	/* The previous checkpoint thread has finished, as checkpointing is 0 */
+	if (wal->checkpoint_thread_created)
+		pthread_join(wal->checkpoint_thread, NULL);
+	wal->checkpointing = 1;
+	created = !pthread_create(&(wal->checkpoint_thread), NULL, &hashset_wal_checkpoint_thread, data);
+	wal->checkpoint_thread_created = created;
+	pthread_mutex_unlock(&(wal->lock));
+
+	if (!created)
+		hashset_wal_checkpoint_thread(data);
+
+	return 1;
+
+unlock_end:
+	pthread_mutex_unlock(&(wal->lock));
+	return 0;
+}
+
+/*
+ * Set the number of records in a segment that triggers a checkpoint. 0 disables it.
+ */
+void
+hashset_wal_set_checkpoint_interval(struct hashset_wal *wal,
+									uint64_t records)
+{
+	pthread_mutex_lock(&(wal->lock));
+	wal->checkpoint_interval = records;
+	pthread_mutex_unlock(&(wal->lock));
+}
+
+/*
+ * @return "<dir>/<name>.<seq>", which MUST be freed by the caller, NULL if memory allocation failed
+ */
+static char *
+hashset_wal_path(const char *dir,
+				 const char *name,
+				 uint64_t seq)
+{
+	char *path;
+
+	path = (char *)malloc(strlen(dir) + strlen(name) + 32);
+	if (path == NULL) {
+		perror("Failed to allocate memory to path");
+		return NULL;
+	}
+	sprintf(path, "%s/%s.%llu", dir, name, (unsigned long long)seq);
+
+	return path;
+}
+
+/*
+ * Parse file name "<prefix>.<seq>"
+ * @return 1 if name is of the form, 0 otherwise
+ */
+static int
+hashset_wal_parse_name(const char *name,
+					   const char *prefix,
+					   uint64_t *seq)
+{
+	size_t length;
+	const char *digits;
+
+	length = strlen(prefix);
+	if (strncmp(name, prefix, length) != 0 || name[length] != '.')
+		return 0;
+
+	digits = name + length + 1;
+	if (*digits == '\0')
+		return 0;
+
+	*seq = 0;
+	for (; *digits != '\0'; digits++) {
+		if (*digits < '0' || *digits > '9')
+			return 0;
+		*seq = *seq * 10 + (*digits - '0');
+	}
+	return 1;
+}
+
+/*
+ * fsync(2) dir so that files created or renamed in it survive a crash
+ * @return 1 if succeeded, 0 otherwise
+ */
+static int
+hashset_wal_sync_dir(const char *dir)
+{
+	int fd, success;
+
+	fd = open(dir, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	success = (fsync(fd) == 0);
+	close(fd);
+
+	return success;
+}
+
+/*
+ * Create segment wal.<seq> in dir and make it durable with its header
+ * @return file descriptor of the segment, -1 if failed
+ */
+static int
+hashset_wal_create_segment(const char *dir,
+						   uint64_t seq)
+{
+	int fd;
+	char *path;
+	struct hashset_wal_segment_header header;
+
+	path = hashset_wal_path(dir, "wal", seq);
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	free(path);
+	if (fd < 0) {
+		perror("Failed to open wal segment");
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HASHSET_WAL_MAGIC, sizeof(header.magic));
+	header.version = HASHSET_WAL_VERSION;
+	header.seq	   = seq;
+	if (!hashset_write_all(fd, &header, sizeof(header)) ||
+		fdatasync(fd) < 0 ||
+		!hashset_wal_sync_dir(dir)) {
+		perror("Failed to write wal segment");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Apply operation with array to wal->set and buffer a record for each element that modified set.
+ * If the buffer is full, it's written without waiting for a commit.
+ *
+ * @return 1 if the set is modified due to the operation, 0 otherwise.
+ */
+static int
+hashset_wal_log(struct hashset_wal *wal,
+				enum HASHSET_WAL_OPERATION operation,
+				int *array_data,
+				int  array_size)
+{
+	int i, modified, writing, data;
+	struct tree_set *chain;
+	struct hashset_wal_record *record;
+
+	if (wal == NULL || array_data == NULL || array_size < 0)
+		return 0;
+
+	/*
+	 * The writer gate of the set is entered only while wal->lock is held without waits,
+	 * and left before waiting for or doing a flush, which releases wal->lock.
+	 * Otherwise a snapshot waiting for this thread to leave the gate would block
+	 * the next logger in hashset_begin_write(...) with wal->lock held,
+	 * and so the flush this thread waits for.
+	 */
+	modified = 0;
+	writing	 = 0;
+	pthread_mutex_lock(&(wal->lock));
+	for (i = 0; i < array_size && !wal->failed; i++)
+	{
+		while (wal->buffer->header.count == HASHSET_WAL_BUFFER_SIZE && !wal->failed) {
+			if (writing) {
+				hashset_end_write(wal->set);
+				writing = 0;
+			}
+			if (wal->flushing)
+				pthread_cond_wait(&(wal->flushed), &(wal->lock));
+			else
+				hashset_wal_flush_locked(wal);
+		}
+		if (wal->failed)
+			break;
+
+		if (!writing) {
+			hashset_begin_write(wal->set);
+			writing = 1;
+		}
+
+		data  = array_data[i];
+		chain = wal->set->table[hashset_hash_code(data)];
+		if (operation == HASHSET_WAL_ADD) {
+			if (!treeset_add(chain, data))
+				continue;
+			wal->set->size++;
+		}
+		else {
+			if (!treeset_remove(chain, data))
+				continue;
+			wal->set->size--;
+		}
+
+		record = &(wal->buffer->records[wal->buffer->header.count++]);
+		record->data	  = data;
+		record->operation = operation;
+		wal->next_lsn++;
+		modified = 1;
+	}
+	if (writing)
+		hashset_end_write(wal->set);
+	pthread_mutex_unlock(&(wal->lock));
+
+	return modified;
+}
+
+/*
+ * Write the buffered records as one batch and fdatasync(2) it.
+ * MUST be called with wal->lock held and no other thread flushing.
+ * The lock is released during I/O so that other threads can keep logging into the other buffer.
+ *
+ * @return 1 if succeeded, 0 otherwise
+ */
+static int
+hashset_wal_flush_locked(struct hashset_wal *wal)
+{
+	int fd, success;
+	uint64_t target_lsn;
+	struct hashset_wal_buffer *batch;
+
+	batch = wal->buffer;
+	wal->buffer		  = wal->flush_buffer;
+	wal->flush_buffer = batch;
+	wal->buffer->header.count = 0;
+	wal->flushing = 1;
+	target_lsn	  = wal->next_lsn;
+	fd			  = wal->fd;
+	pthread_mutex_unlock(&(wal->lock));
+
+	batch->header.reserved = 0;
+	batch->header.checksum = hashset_checksum(batch->records, batch->header.count * sizeof(struct hashset_wal_record));
+	success = hashset_write_all(fd, batch, sizeof(batch->header) + batch->header.count * sizeof(struct hashset_wal_record)) &&
+			  fdatasync(fd) == 0;
+	if (!success)
+		perror("Failed to write wal segment");
+
+	pthread_mutex_lock(&(wal->lock));
+	wal->flushing = 0;
+	if (success) {
+		wal->durable_lsn	  = target_lsn;
+		wal->segment_records += batch->header.count;
+	}
+	else {
+		wal->failed = 1;
+	}
+	pthread_cond_broadcast(&(wal->flushed));
+
+	return success;
+}
+
+/*
+ * Thread of hashset_wal_checkpoint(...)
+ */
+static void *
+hashset_wal_checkpoint_thread(void *arg)
+{
+	struct checkpoint_data *data;
+	struct hashset_wal *wal;
+	struct hashset_frozen *frozen;
+
+	data = (struct checkpoint_data *)arg;
+	wal	 = data->wal;
+
+	frozen = hashset_freeze(data->snapshot);
+	hashset_free_set(data->snapshot);
+	if (frozen != NULL) {
+		if (hashset_wal_write_checkpoint(wal, frozen, data->seq))
+			hashset_wal_remove_old_files(wal->dir, data->seq);
+		hashset_frozen_free(frozen);
+	}
+	free(data);
+
+	pthread_mutex_lock(&(wal->lock));
+	wal->checkpointing = 0;
+	pthread_cond_broadcast(&(wal->checkpointed));
+	pthread_mutex_unlock(&(wal->lock));
+
+	return NULL;
+}
+
+/*
+ * Write frozen to checkpoint.<seq> durably
+ * @return 1 if succeeded, 0 otherwise
+ */
+static int
+hashset_wal_write_checkpoint(struct hashset_wal *wal,
+							 struct hashset_frozen *frozen,
+							 uint64_t seq)
+{
+	int success;
+	char *path;
+
+	path = hashset_wal_path(wal->dir, "checkpoint", seq);
+	if (path == NULL)
+		return 0;
+
+	success = hashset_frozen_save(frozen, path) && hashset_wal_sync_dir(wal->dir);
+	free(path);
+
+	return success;
+}
+
+/*
+ * Remove segments and checkpoints older than seq, which are covered by checkpoint.<seq>
+ */
+static void
+hashset_wal_remove_old_files(const char *dir,
+							 uint64_t seq)
+{
+	uint64_t file_seq;
+	char *path;
+	DIR *dp;
+	struct dirent *entry;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return;
+
+	while ((entry = readdir(dp)) != NULL) {
+		if (!hashset_wal_parse_name(entry->d_name, "wal", &file_seq) &&
+			!hashset_wal_parse_name(entry->d_name, "checkpoint", &file_seq))
+			continue;
+		if (file_seq >= seq)
+			continue;
+
+		path = (char *)malloc(strlen(dir) + strlen(entry->d_name) + 2);
+		if (path == NULL)
+			break;
+		sprintf(path, "%s/%s", dir, entry->d_name);
+		unlink(path);
+		free(path);
+	}
+	closedir(dp);
+}
+
+/*
+ * Load the latest checkpoint into wal->set and replay the segments after it.
+ * A torn batch at the end of the last segment is cut off, and a last segment
+ * with a torn header is removed so that its seq is used again by the segment to start.
+ * wal->seq is set to the seq of the segment to start.
+ *
+ * @return 1 if succeeded, 0 otherwise
+ */
+static int
+hashset_wal_recover(struct hashset_wal *wal)
+{
+	int i, fd, error, success, num_segments, max_segments, num_batches, max_batches, has_checkpoint, torn;
+	uint64_t seq, checkpoint_seq, offset;
+	char *path;
+	void *grown;
+	DIR *dp;
+	struct dirent *entry;
+	struct stat st;
+	struct replay_segment *segments;
+	struct replay_batch *batches;
+	struct replay_data data;
+	struct bucket_task tasks[HASHSET_TABLE_SIZE];
+	struct hashset_wal_segment_header *header;
+	struct hashset_wal_batch_header *batch;
+
+	dp = opendir(wal->dir);
+	if (dp == NULL)
+		return 0;
+
+	/* Find the latest checkpoint and the segments */
+	success	 = 0;
+	error	 = 0;
+	segments = NULL;
+	batches	 = NULL;
+	num_segments = max_segments = 0;
+	num_batches	 = max_batches	= 0;
+	has_checkpoint = 0;
+	checkpoint_seq = 0;
+	torn = 0;
+	while ((entry = readdir(dp)) != NULL) {
+		if (hashset_wal_parse_name(entry->d_name, "checkpoint", &seq)) {
+			if (!has_checkpoint || seq > checkpoint_seq)
+				checkpoint_seq = seq;
+			has_checkpoint = 1;
+		}
+		else if (hashset_wal_parse_name(entry->d_name, "wal", &seq)) {
+			if (num_segments == max_segments) {
+				max_segments = max_segments ? max_segments * 2 : 16;
+				grown = realloc(segments, max_segments * sizeof(struct replay_segment));
+				if (grown == NULL) {
+					perror("Failed to allocate memory to recover");
+					closedir(dp);
+					goto unmap_end;
+				}
+				segments = (struct replay_segment *)grown;
+			}
+			segments[num_segments].seq	= seq;
+			segments[num_segments].map	= NULL;
+			segments[num_segments].size = 0;
+			num_segments++;
+		}
+	}
+	closedir(dp);
+
+	if (has_checkpoint) {
+		path = hashset_wal_path(wal->dir, "checkpoint", checkpoint_seq);
+		if (path == NULL)
+			goto unmap_end;
+		wal->set = hashset_load(path);
+		free(path);
+	}
+	else {
+		wal->set = hashset_create_set();
+	}
+	if (wal->set == NULL)
+		goto unmap_end;
+
+	/* Sort segments by seq and drop the ones covered by the checkpoint */
+	for (i = 1; i < num_segments; i++) {
+		struct replay_segment key = segments[i];
+		int j = i - 1;
+		while (j >= 0 && segments[j].seq > key.seq) {
+			segments[j+1] = segments[j];
+			j--;
+		}
+		segments[j+1] = key;
+	}
+	while (num_segments > 0 && has_checkpoint && segments[0].seq < checkpoint_seq) {
+		memmove(segments, segments + 1, (num_segments - 1) * sizeof(struct replay_segment));
+		num_segments--;
+	}
+
+	/* Map segments and collect their batches */
+	for (i = 0; i < num_segments; i++)
+	{
+		if ((i == 0 && has_checkpoint && segments[i].seq != checkpoint_seq) ||
+			(i > 0 && segments[i].seq != segments[i-1].seq + 1)) {
+			error = EINVAL;		// a segment is missing
+			goto unmap_end;
+		}
+
+		path = hashset_wal_path(wal->dir, "wal", segments[i].seq);
+		if (path == NULL)
+			goto unmap_end;
+		fd = open(path, O_RDWR);
+		free(path);
+		if (fd < 0)
+			goto unmap_end;
+		if (fstat(fd, &st) < 0) {
+			close(fd);
+			goto unmap_end;
+		}
+
+		if (st.st_size > 0) {
+			segments[i].map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (segments[i].map == MAP_FAILED) {
+				segments[i].map = NULL;
+				close(fd);
+				goto unmap_end;
+			}
+			segments[i].size = st.st_size;
+		}
+
+		/* Header might be torn only if the segment was being created at the crash */
+		header = (struct hashset_wal_segment_header *)segments[i].map;
+		if (segments[i].size < sizeof(*header) ||
+			memcmp(header->magic, HASHSET_WAL_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != HASHSET_WAL_VERSION ||
+			header->seq		!= segments[i].seq) {
+			close(fd);
+			if (i != num_segments - 1) {
+				error = EINVAL;
+				goto unmap_end;
+			}
+
+			/*
+			 * Nothing was logged to it. Left in dir, it would be followed by the segment
+			 * to start and break the next recovery, so remove it durably and reuse its seq.
+			 */
+			path = hashset_wal_path(wal->dir, "wal", segments[i].seq);
+			if (path == NULL)
+				goto unmap_end;
+			if (unlink(path) < 0 || !hashset_wal_sync_dir(wal->dir)) {
+				perror("Failed to remove torn wal segment");
+				free(path);
+				goto unmap_end;
+			}
+			free(path);
+			torn = 1;
+			break;
+		}
+
+		offset = sizeof(*header);
+		while (offset < segments[i].size) {
+			batch = (struct hashset_wal_batch_header *)(segments[i].map + offset);
+			if (segments[i].size - offset < sizeof(*batch) ||
+				(segments[i].size - offset - sizeof(*batch)) / sizeof(struct hashset_wal_record) < batch->count)
+				break;
+
+			if (hashset_checksum(batch + 1, batch->count * sizeof(struct hashset_wal_record)) != batch->checksum)
+				break;
+
+			if (num_batches == max_batches) {
+				max_batches = max_batches ? max_batches * 2 : 64;
+				grown = realloc(batches, max_batches * sizeof(struct replay_batch));
+				if (grown == NULL) {
+					perror("Failed to allocate memory to recover");
+					close(fd);
+					goto unmap_end;
+				}
+				batches = (struct replay_batch *)grown;
+			}
+			batches[num_batches].records = (const struct hashset_wal_record *)(batch + 1);
+			batches[num_batches].count	 = batch->count;
+			num_batches++;
+
+			offset += sizeof(*batch) + batch->count * sizeof(struct hashset_wal_record);
+		}
+
+		/* Only the last segment can end with a torn batch, which is never committed */
+		if (offset < segments[i].size) {
+			if (i != num_segments - 1 || ftruncate(fd, offset) < 0) {
+				close(fd);
+				error = EINVAL;
+				goto unmap_end;
+			}
+			fdatasync(fd);
+		}
+		close(fd);
+	}
+
+	/* Records of a bucket are replayed in order by the thread owning the bucket */
+	data.set		 = wal->set;
+	data.batches	 = batches;
+	data.num_batches = num_batches;
+	hashset_run_bucket_tasks(tasks, hashset_number_of_bucket_threads(), &hashset_wal_replay_in_buckets, &data);
+	hashset_update_size(wal->set);
+
+	wal->seq = checkpoint_seq;
+	if (num_segments > 0 && segments[num_segments-1].seq > wal->seq)
+		wal->seq = segments[num_segments-1].seq;
+	if (!torn)
+		wal->seq++;
+	success = 1;
+
+unmap_end:
+	for (i = 0; i < num_segments; i++) {
+		if (segments[i].map != NULL)
+			munmap(segments[i].map, segments[i].size);
+	}
+	free(segments);
+	free(batches);
+
+	if (!success && wal->set != NULL) {
+		hashset_free_set(wal->set);
+		wal->set = NULL;
+	}
+	if (error)
+		errno = error;
+	return success;
+}
+
+/*
+ * Replay records of buckets [from, to) in the order they were logged
+ */
+static void
+hashset_wal_replay_in_buckets(struct bucket_task *task)
+{
+	int i, hash_value;
+	uint32_t j;
+	const struct hashset_wal_record *record;
+	struct replay_data *data;
+
+	data = (struct replay_data *)task->arg;
+	for (i = 0; i < data->num_batches; i++) {
+		for (j = 0; j < data->batches[i].count; j++) {
+			record	   = &(data->batches[i].records[j]);
+			hash_value = hashset_hash_code(record->data);
+			if (hash_value < task->from || hash_value >= task->to)
+				continue;
+
+			if (record->operation == HASHSET_WAL_ADD)
+				treeset_add(data->set->table[hash_value], record->data);
+			else if (record->operation == HASHSET_WAL_REMOVE)
+				treeset_remove(data->set->table[hash_value], record->data);
+		}
+	}
+}
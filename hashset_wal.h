@@ -0,0 +1,98 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef HASHSET_WAL_H
+#define HASHSET_WAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "hashset_chain.h"
+
+/*
+ * Write-ahead log of a set, kept in a directory:
+ *
+ *     wal.<seq>           log segments, appended in order of seq
+ *     checkpoint.<seq>    snapshot (see hashset_io.h) of the set before the records of wal.<seq>
+ *
+ * A segment is a struct hashset_wal_segment_header followed by batches.
+ * A batch is a struct hashset_wal_batch_header followed by count records, and is written
+ * by one write(2) and made durable by one fdatasync(2) for all threads waiting in
+ * hashset_wal_commit(...) (group commit).
+ * A torn batch at the end of the last segment is dropped on recovery.
+ */
+#define HASHSET_WAL_MAGIC	"HSWTCWAL"
+#define HASHSET_WAL_VERSION 1
+
+/* Number of records buffered before they're written without waiting for a commit */
+#define HASHSET_WAL_BUFFER_SIZE 4096
+
+/* Default number of records in a segment that triggers a checkpoint in hashset_wal_commit(...) */
+#define HASHSET_WAL_CHECKPOINT_INTERVAL (1 << 20)
+
+enum HASHSET_WAL_OPERATION {
+	HASHSET_WAL_ADD = 1,
+	HASHSET_WAL_REMOVE
+};
+
+struct hashset_wal_segment_header {
+	char	 magic[8];			// HASHSET_WAL_MAGIC without '\0'
+	uint32_t version;			// HASHSET_WAL_VERSION
+	uint32_t reserved;
+	uint64_t seq;				// seq of the file name
+};
+
+struct hashset_wal_batch_header {
+	uint32_t count;				// number of records
+	uint32_t reserved;
+	uint64_t checksum;			// checksum of records
+};
+
+struct hashset_wal_record {
+	int32_t  data;
+	uint32_t operation;			// enum HASHSET_WAL_OPERATION
+};
+
+/*
+ * Records of a batch, with the batch header in front of them so that
+ * the whole batch is written at once
+ */
+struct hashset_wal_buffer {
+	struct hashset_wal_batch_header header;
+	struct hashset_wal_record records[HASHSET_WAL_BUFFER_SIZE];
+};
+
+struct hashset_wal {
+	struct hashset_chain *set;	// set recovered by hashset_wal_open(...)
+	char	*dir;
+	int		 fd;				// current segment
+	uint64_t seq;				// seq of the current segment
+	uint64_t segment_records;	// records written to the current segment
+	uint64_t checkpoint_interval;
+	uint64_t next_lsn;			// number of records logged so far
+	uint64_t durable_lsn;		// number of records made durable so far
+	int		 flushing;			// 1 while a thread writes a batch
+	int		 checkpointing;		// 1 while a checkpoint is written in background
+	int		 checkpoint_thread_created;
+	int		 failed;			// 1 once writing a batch failed, after which nothing is logged
+	struct hashset_wal_buffer *buffer;		// records being logged
+	struct hashset_wal_buffer *flush_buffer;	// records being written by the flushing thread
+	pthread_t		checkpoint_thread;
+	pthread_mutex_t lock;
+	pthread_cond_t	flushed;
+	pthread_cond_t	checkpointed;
+};
+
+struct hashset_wal *hashset_wal_open(const char *dir);
+int  hashset_wal_close(struct hashset_wal *wal);
+int  hashset_wal_add(struct hashset_wal *wal, int data);
+int  hashset_wal_remove(struct hashset_wal *wal, int data);
+int  hashset_wal_add_array(struct hashset_wal *wal, int *array_data, int array_size);
+int  hashset_wal_remove_array(struct hashset_wal *wal, int *array_data, int array_size);
+int  hashset_wal_find(struct hashset_wal *wal, int data);
+int  hashset_wal_commit(struct hashset_wal *wal);
+int  hashset_wal_checkpoint(struct hashset_wal *wal);
+void hashset_wal_set_checkpoint_interval(struct hashset_wal *wal, uint64_t records);
+
+#endif
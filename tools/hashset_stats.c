@@ -0,0 +1,43 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hashset_chain.h"
+#include "../hashset_io.h"
+#include "../hashset_stats.h"
+
+/*
+ * Print statistics of sets saved by hashset_save(...) or hashset_save_packed(...)
+ *
+ * Usage: hashset_stats FILE...
+ */
+int main(int argc, char const *argv[])
+{
+	struct hashset_chain *hset;
+	struct hashset_stats stats;
+	int i, failed;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+		return 2;
+	}
+
+	failed = 0;
+	for (i = 1; i < argc; ++i)
+	{
+		hset = hashset_load(argv[i]);
+		if (hset == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			failed = 1;
+			continue;
+		}
+
+		hashset_get_stats(hset, &stats);
+		if (argc > 2)
+			fprintf(stdout, "%s%s:\n", (i > 1) ? "\n" : "", argv[i]);
+		hashset_print_stats(stdout, &stats);
+		hashset_free_set(hset);
+	}
+	return failed;
+}
@@ -4,13 +4,22 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "treeset.h"
+#include "hashset_instrument.h"
+#include "hashset_pool.h"
 
 
 static struct avlnode *treeset_create_avlnode(int data);
 static void treeset_free_avlnode(struct avlnode *node);
 static void treeset_free_tree(struct avlnode *root);
+static void treeset_destroy_tree(struct avlnode *root);
+static struct avlnode *treeset_drop_shared(struct avlnode *root);
+static struct avlnode *treeset_own_avlnode(struct avlnode *node);
+static int  treeset_own_for_update(struct avlnode **root, int data, int present, struct operation_result *result);
 static struct avlnode *treeset_rotate_right(struct avlnode *root);
 static struct avlnode *treeset_rotate_left(struct avlnode *root);
 static struct avlnode *treeset_double_rotate_left_right(struct avlnode *root);
@@ -27,6 +36,171 @@ static struct avlnode *treeset_insert_data(struct avlnode *root, int data, struc
 static int  treeset_find_data(struct avlnode *root, int data);
 static int  treeset_binary_search_array(int *array, int data, int from, int to);
 static void treeset_merge_sort_array(int *array, int  array_size, int *buff);
+static void treeset_iter_push_left_spine(struct treeset_iter *iter, struct avlnode *node);
+static struct avlnode *treeset_iter_next_node(struct treeset_iter *iter);
+static struct avlnode *treeset_build_from_list(struct avlnode **head, int size);
+static struct avlnode *treeset_build_from_sorted_array(const int *array_data, int array_size, int *failed);
+static struct avlnode *treeset_build_from_stream(int (*next)(void *ctx, int *data), void *ctx, int size, int *failed);
+static int  treeset_merge_sorted_array(struct tree_set *set, const int *array_data, int array_size);
+static int  treeset_filter(struct tree_set *set, int (*keep)(int data, void *ctx), void *ctx);
+static int  treeset_keep_if_found_in_iter(int data, void *ctx);
+static int  treeset_keep_by_predicate(int data, void *ctx);
+static void treeset_build_in_job(struct hashset_job *job);
+static void treeset_destroy_in_job(struct hashset_job *job);
+static int  treeset_height(struct avlnode *node);
+static struct avlnode *treeset_join(struct avlnode *left, struct avlnode *node, struct avlnode *right);
+static struct avlnode *treeset_join_two(struct avlnode *left, struct avlnode *right);
+static struct avlnode *treeset_split_last(struct avlnode *root, struct avlnode **last);
+static struct avlnode *treeset_split(struct avlnode *root, int data, struct avlnode **left, struct avlnode **right);
+static int  treeset_lower_bound(const int *array_data, int array_size, int data);
+static void treeset_iter_seek(struct treeset_iter *iter, struct tree_set *set, int data);
+static struct avlnode *treeset_merge_subtree(struct avlnode *root, const int *array_data, int array_size, int *added);
+static struct avlnode *treeset_union_sorted_array(struct avlnode *root, const int *array_data, int array_size, int *added);
+static void treeset_union_in_job(struct hashset_job *job);
+static struct avlnode *treeset_retain_subtree(struct avlnode *root, struct tree_set *setB, int *removed);
+static void treeset_retain_in_job(struct hashset_job *job);
+static int  treeset_count_nodes(struct avlnode *root);
+static void treeset_copy_in_job(struct hashset_job *job);
+
+/*
+ * Context for treeset_keep_if_found_in_iter(...).
+ * It holds the cursor over the other set and the last element read from it.
+ */
+struct treeset_merge_cursor {
+	struct treeset_iter iter;
+	int has_data;
+	int data;
+};
+
+/*
+ * Context for treeset_keep_by_predicate(...).
+ * Data is kept iff the result of predicate matches keep_if.
+ */
+struct treeset_predicate_filter {
+	int (*predicate)(int data, void *ctx);
+	void *ctx;
+	int   keep_if;
+};
+
+/*
+ * Large trees are built and freed by the work-stealing pool of hashset_pool.h:
+ * one subtree is forked as a job while the caller works on the other.
+ */
+#define TREESET_PARALLEL_SIZE	16384	/* elements of the smallest tree built in parallel */
+#define TREESET_PARALLEL_HEIGHT 15		/* height of the lowest tree freed in parallel */
+
+/* Job building a subtree by treeset_build_from_sorted_array(...) */
+struct treeset_build_job {
+	struct hashset_job job;
+	const int *array_data;
+	int  array_size;
+	int *failed;
+	struct avlnode *root;	// result
+};
+
+/* Job freeing a subtree by treeset_destroy_tree(...) */
+struct treeset_destroy_job {
+	struct hashset_job job;
+	struct avlnode *root;
+};
+
+/*
+ * Merges of two sorted sequences (a tree with a sorted array or another tree)
+ * are split by key range: the larger side is cut at its middle element, the other
+ * side is partitioned around it, and the two halves are merged by different threads.
+ * The results are put back together by treeset_join(...).
+ */
+#define TREESET_PARALLEL_DEPTH	6		/* levels cut by treeset_to_array(...), i.e. up to 64 subtrees */
+
+/* Job merging a sorted array into a subtree by treeset_union_sorted_array(...) */
+struct treeset_union_job {
+	struct hashset_job job;
+	struct avlnode *root;
+	const int *array_data;
+	int  array_size;
+	int  added;				// number of elements added, result
+};
+
+/* Job keeping the elements of a subtree found in setB by treeset_retain_subtree(...) */
+struct treeset_retain_job {
+	struct hashset_job job;
+	struct avlnode *root;
+	struct tree_set *setB;
+	int  removed;			// number of elements removed, result
+};
+
+/* Job counting or copying a subtree for treeset_to_array(...) */
+struct treeset_copy_job {
+	struct hashset_job job;
+	struct avlnode *root;	// subtree, or a single node if whole is 0
+	int  whole;
+	int *array_data;		// NULL to count only
+	int  array_size;
+	int  count;				// number of elements of the subtree, result of counting
+};
+
+static int  treeset_collect_pieces(struct avlnode *root, int depth, struct treeset_copy_job *pieces, int count);
+
+/*
+ * Epoch based reclamation of nodes for treeset_find_optimistic(...).
+ * A reader announces the global epoch while it walks a tree, and a node unlinked
+ * by a writer during epoch E is freed once the epoch reaches E+2, which needs
+ * every reader announcing E to be gone. While no optimistic reader is walking
+ * a tree and nothing is left in limbo, nodes are freed immediately as before.
+ */
+#define TREESET_RECLAIM_EPOCHS	 3
+#define TREESET_RECLAIM_BATCH	 128	/* nodes retired between attempts to advance the epoch */
+#define TREESET_OPTIMISTIC_SPINS 1024	/* retries before a reader yields to the writer */
+#define TREESET_CACHE_LINE		 64
+
+/*
+ * Links followed by optimistic readers are written with release stores,
+ * so that a reader reaching a node through a new link sees the node initialized.
+ */
+#define TREESET_PUBLISH(link, node) __atomic_store_n(&(link), (node), __ATOMIC_RELEASE)
+
+/* Per-thread record of a reader, aligned to a cache line so that readers never share one */
+struct treeset_reader {
+	unsigned long state;			/* (epoch << 1) | 1 while walking a tree, 0 otherwise */
+	int in_use;						/* 1 while owned by a living thread */
+	struct treeset_reader *next;	/* all records ever created */
+};
+
+struct treeset_retired {
+	struct avlnode *node;
+	int whole;						/* 1 to release the tree of node as treeset_free_tree(...), 0 to free node alone */
+};
+
+struct treeset_limbo {
+	struct treeset_retired *nodes;
+	int count, capacity;
+};
+
+static unsigned long treeset_epoch;
+static int treeset_active_readers;			/* readers walking a tree right now */
+static int treeset_retired_pending;			/* nodes waiting in limbo lists */
+static int treeset_unregistered_readers;	/* readers without a record, who block the epoch */
+static int treeset_retired_since_advance;
+static struct treeset_reader *treeset_readers;
+static struct treeset_limbo treeset_limbos[TREESET_RECLAIM_EPOCHS];
+static pthread_mutex_t treeset_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t treeset_reader_once	= PTHREAD_ONCE_INIT;
+static pthread_key_t  treeset_reader_key;
+static int treeset_reader_key_failed;
+
+static void treeset_begin_update(struct tree_set *set);
+static void treeset_end_update(struct tree_set *set);
+static int  treeset_is_shared(struct tree_set *set);
+static void treeset_leave_sharers(struct tree_set *set);
+static void treeset_init_reader_key(void);
+static void treeset_release_reader(void *reader);
+static struct treeset_reader *treeset_enter_reader(void);
+static void treeset_exit_reader(struct treeset_reader *reader);
+static int  treeset_deferring_free(void);
+static void treeset_retire(struct avlnode *node, int whole);
+static int  treeset_advance_epoch(struct treeset_limbo *expired);
+static void treeset_free_retired(struct treeset_limbo *limbo);
+static void treeset_synchronize(void);
 
 
 struct tree_set*
@@ -39,8 +213,11 @@ treeset_create_set()
 	}
 
 	/* Initialize size & tree */
-	set->size = 0;
-	set->tree = NULL;
+	set->size	 = 0;
+	set->sharers = NULL;
+	set->version = 0;
+	set->height  = 0;
+	set->tree	 = NULL;
 
 	return set;
 };
@@ -64,10 +241,110 @@ treeset_free_set(struct tree_set *set)
 	treeset_free_tree(tree);
 	set->size = 0;
 
+	/* Nodes retired above can be freed right away unless readers are still walking them */
+	treeset_reclaim();
+
 end:
+	treeset_leave_sharers(set);
 	free(set);
 }
 
+/*
+ * Free all nodes and make set empty so that it can be reused
+ */
+void
+treeset_clear(struct tree_set *set)
+{
+	if (set == NULL)
+		return;
+
+	treeset_begin_update(set);
+	treeset_free_tree(set->tree);
+	set->tree	= NULL;
+	set->size	= 0;
+	treeset_leave_sharers(set);
+	treeset_end_update(set);
+}
+
+/*
+ * Take a snapshot of set in O(1).
+ * The snapshot shares all nodes with set, and a node is copied only when
+ * either of them modifies it. Thus the snapshot never sees later modifications
+ * of set and vice versa, and both can be modified or freed independently,
+ * even by different threads.
+ * set MUST NOT be modified by other threads during the call.
+ *
+ * @return pointer to a new set, NULL if memory allocation failed
+ */
+struct tree_set *
+treeset_snapshot(struct tree_set *set)
+{
+	struct tree_set *snapshot;
+
+	if (set == NULL)
+		return NULL;
+
+	snapshot = treeset_create_set();
+	if (snapshot == NULL)
+		return NULL;
+
+	if (set->tree != NULL) {
+		if (set->sharers == NULL) {
+			set->sharers = (int *)malloc(sizeof(int));
+			if (set->sharers == NULL) {
+				free(snapshot);
+				return NULL;
+			}
+			*(set->sharers) = 1;
+		}
+		__atomic_add_fetch(set->sharers, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(set->tree->refcount), 1, __ATOMIC_RELAXED);
+		snapshot->sharers = set->sharers;
+	}
+	snapshot->tree	 = set->tree;
+	snapshot->size	 = set->size;
+	snapshot->height = set->height;
+
+	return snapshot;
+}
+
+/*
+ * Check if nodes of set may be shared with a snapshot (or the set it was taken from).
+ * Once all the others are freed, cleared or rebuilt, set is alone again and
+ * takes the paths that modify nodes in place.
+ *
+ * @return 1 if shared, 0 otherwise
+ */
+static int
+treeset_is_shared(struct tree_set *set)
+{
+	if (set->sharers == NULL)
+		return 0;
+
+	/* Pairs with the decrement in treeset_leave_sharers(...), after which the others dropped their nodes */
+	if (__atomic_load_n(set->sharers, __ATOMIC_ACQUIRE) > 1)
+		return 1;
+
+	/* Nobody else can join as only a snapshot of set would */
+	free(set->sharers);
+	set->sharers = NULL;
+	return 0;
+}
+
+/*
+ * Stop sharing nodes with other sets, once set dropped or replaced all its nodes
+ */
+static void
+treeset_leave_sharers(struct tree_set *set)
+{
+	if (set->sharers == NULL)
+		return;
+
+	if (__atomic_sub_fetch(set->sharers, 1, __ATOMIC_ACQ_REL) == 0)
+		free(set->sharers);
+	set->sharers = NULL;
+}
+
 /*
  * Compute the height(rank) of tree.
  * Node itself is considered as height 1.
@@ -107,9 +384,12 @@ treeset_add(struct tree_set *set, int data)
 		goto end;
 	}
 
+	result.checked = 0;
+	treeset_begin_update(set);
 	root 	  = set->tree;
 	new_root  = treeset_insert_data(root, data, &result);
-	set->tree = new_root;
+	TREESET_PUBLISH(set->tree, new_root);
+	treeset_end_update(set);
 
 	if (result.modified)
 		treeset_increment_size_by(set, 1);
@@ -125,16 +405,19 @@ int
 treeset_add_set(struct tree_set *setA,
 				struct tree_set *setB)
 {
-	int sizeB, *arrayB, modified;
+	int data, modified;
+	struct treeset_iter iter;
 
-	if (setB == NULL) return 0;
+	if (setA == NULL || setB == NULL) return 0;
 
-	sizeB = setB->size;
-	arrayB = (int *)calloc(sizeB, sizeof(int));
-	treeset_to_array(setB, arrayB, sizeB);
-	modified = treeset_add_array(setA, arrayB, sizeB);
+	/* Nothing to add to itself */
+	if (setA == setB) return 0;
+
+	modified = 0;
+	treeset_iter_init(&iter, setB);
+	while (treeset_iter_next(&iter, &data))
+		modified |= treeset_add(setA, data);
 
-	free(arrayB);
 	return modified;
 }
 
@@ -170,6 +453,103 @@ treeset_add_array(
 	return modified;
 }
 
+/*
+ * Add array that is sorted in strictly accending order to set.
+ * If set is empty, a balanced tree is built directly from the array in O(N)
+ * instead of inserting elements one by one.
+ * If the array is big compared to set, it's merged with the nodes of set
+ * and the tree is rebuilt in O(N + M), see treeset_merge_sorted_array(...).
+ *
+ * @return 1 if the set is modified due to the operation, 0 otherwise.
+ *
+ * !!!Careful!!!
+ * The function DOES NOT check the order of array_data.
+ * Tree is broken if array_data has duplicates or is not sorted.
+ */
+int
+treeset_add_sorted_array(
+	struct tree_set *set,
+	const int *array_data,
+	int  array_size)
+{
+	int failed;
+	struct avlnode *root;
+
+	/* Don't proceed if inputs are _abviously_ invalid */
+	if (set == NULL 	   ||
+		array_data == NULL ||
+		array_size <= 0 )
+		return 0;
+
+	if (set->tree != NULL) {
+		/* Inserting one by one costs O(M lg(N)), whereas merging costs O(N + M) */
+		if (!treeset_is_shared(set) && (long long)array_size * set->tree->height >= set->size)
+			return treeset_merge_sorted_array(set, array_data, array_size);
+		return treeset_add_array(set, (int *)array_data, array_size);
+	}
+
+	failed = 0;
+	root = treeset_build_from_sorted_array(array_data, array_size, &failed);
+	if (failed) {
+		treeset_free_tree(root);
+		return 0;
+	}
+
+	treeset_begin_update(set);
+	TREESET_PUBLISH(set->tree, root);
+	set->size = array_size;
+	treeset_end_update(set);
+	return 1;
+}
+
+/*
+ * Add count elements read from next(ctx, &data) to set.
+ * next MUST give elements in strictly accending order and return 0 when there's no more.
+ * If set is empty, a balanced tree is built in O(N) while reading, without any buffer,
+ * so that sorted elements decoded on the fly (e.g. from a file) can be added directly.
+ *
+ * @return 1 if all count elements were read and added, 0 otherwise.
+ *		   If set was empty and it fails, set is left empty.
+ */
+int
+treeset_add_sorted_stream(
+	struct tree_set *set,
+	int (*next)(void *ctx, int *data),
+	void *ctx,
+	int  count)
+{
+	int i, data, failed;
+	struct avlnode *root;
+
+	/* Don't proceed if inputs are _abviously_ invalid */
+	if (set == NULL   ||
+		next == NULL  ||
+		count < 0)
+		return 0;
+
+	if (set->tree != NULL) {
+		for (i = 0; i < count; i++) {
+			if (!next(ctx, &data))
+				return 0;
+			treeset_add(set, data);
+		}
+		return 1;
+	}
+
+	failed = 0;
+	root = treeset_build_from_stream(next, ctx, count, &failed);
+	if (failed) {
+		treeset_free_tree(root);
+		return 0;
+	}
+
+	treeset_begin_update(set);
+	TREESET_PUBLISH(set->tree, root);
+	set->size = count;
+	treeset_end_update(set);
+	return 1;
+}
+
 /*
  * Remove an element data from set
  *
@@ -186,9 +566,12 @@ treeset_remove(struct tree_set *set, int data)
 		goto end;
 	}
 
+	result.checked = 0;
+	treeset_begin_update(set);
 	root 	  = set->tree;
 	new_root  = treeset_erase_data(root, data, &result);
-	set->tree = new_root;
+	TREESET_PUBLISH(set->tree, new_root);
+	treeset_end_update(set);
 
 	if (result.modified)
 		treeset_decrement_size_by(set, 1);
@@ -206,16 +589,21 @@ int
 treeset_remove_set(struct tree_set *setA,
 				   struct tree_set *setB)
 {
-	int sizeB, *arrayB;
+	int data;
+	struct treeset_iter iter;
+
+	if (setA == NULL || setB == NULL) return 0;
 
-	if (setB == NULL) return 0;
+	/* Removing set from itself: we can't walk a tree while erasing its nodes */
+	if (setA == setB) {
+		treeset_clear(setA);
+		return 1;
+	}
 
-	sizeB = setB->size;
-	arrayB = (int *)calloc(sizeB, sizeof(int));
-	treeset_to_array(setB, arrayB, sizeB);
-	treeset_remove_array(setA, arrayB, sizeB);
+	treeset_iter_init(&iter, setB);
+	while (treeset_iter_next(&iter, &data))
+		treeset_remove(setA, data);
 
-	free(arrayB);
 	return 1;
 }
 
@@ -261,17 +649,35 @@ int
 treeset_retain_set(struct tree_set *setA,
 				   struct tree_set *setB)
 {
-	int sizeB, *arrayB, result;
-
-	if (setB == NULL) return 0;
+	int removed;
+	struct treeset_merge_cursor cursor;
+
+	if (setA == NULL || setB == NULL) return 0;
+
+	/* Intersection with itself changes nothing */
+	if (setA == setB) return 1;
+
+	/* Large trees are split by key range over threads of the pool */
+	if (setA->tree != NULL && setA->tree->height >= TREESET_PARALLEL_HEIGHT &&
+		hashset_pool_workers() > 0 && !treeset_is_shared(setA)) {
+		removed = 0;
+		treeset_begin_update(setA);
+		TREESET_PUBLISH(setA->tree, treeset_retain_subtree(setA->tree, setB, &removed));
+		setA->size -= removed;
+		treeset_end_update(setA);
+		return 1;
+	}
 
-	sizeB = setB->size;
-	arrayB = (int *)calloc(sizeB, sizeof(int)); // allocation check will done in tree_set_array(...)
-	treeset_to_array(setB, arrayB, sizeB);
-	result = treeset_retain_array(setA, arrayB, sizeB);
+	/*
+	 * Both sets are walked in order at the same time, so each element of setA
+	 * is checked against setB without searching setB's tree.
+	 * Time complexity: O(N + M)
+	 */
+	treeset_iter_init(&(cursor.iter), setB);
+	cursor.has_data = treeset_iter_next(&(cursor.iter), &(cursor.data));
+	treeset_filter(setA, &treeset_keep_if_found_in_iter, &cursor);
 
-	free(arrayB);
-	return result;
+	return 1;
 }
 
 /*
@@ -342,6 +748,55 @@ treeset_retain_array(
 	return 1;
 }
 
+/*
+ * Remove all elements for which predicate(data, ctx) returns non-zero.
+ * predicate is called once per element in accending order and the remaining
+ * nodes are rebuilt into a balanced tree in the same pass.
+ *
+ * Time complexity: O(N)
+ * @return number of removed elements
+ */
+int
+treeset_remove_if(struct tree_set *set,
+				  int (*predicate)(int data, void *ctx),
+				  void *ctx)
+{
+	struct treeset_predicate_filter filter;
+
+	if (set == NULL || predicate == NULL)
+		return 0;
+
+	filter.predicate = predicate;
+	filter.ctx		 = ctx;
+	filter.keep_if	 = 0;
+
+	return treeset_filter(set, &treeset_keep_by_predicate, &filter);
+}
+
+/*
+ * Keep only elements for which predicate(data, ctx) returns non-zero.
+ * See treeset_remove_if(...) as well.
+ *
+ * Time complexity: O(N)
+ * @return number of removed elements
+ */
+int
+treeset_retain_if(struct tree_set *set,
+				  int (*predicate)(int data, void *ctx),
+				  void *ctx)
+{
+	struct treeset_predicate_filter filter;
+
+	if (set == NULL || predicate == NULL)
+		return 0;
+
+	filter.predicate = predicate;
+	filter.ctx		 = ctx;
+	filter.keep_if	 = 1;
+
+	return treeset_filter(set, &treeset_keep_by_predicate, &filter);
+}
+
 /*
  * Time complexity: O( lg(N) )
  * Space complexity: O( lg(N) )
@@ -378,14 +833,102 @@ treeset_to_array(
 	int  array_size)
 {
 	struct avlnode *tree;
-	int count;
+	struct treeset_copy_job *pieces;
+	int i, count, num_pieces, offset;
 
 	if (set == NULL)
 		return;
 
-	tree = set->tree;
-	count = 0;
-	treeset_to_array_rec(tree, array_data, array_size, count);
+	tree   = set->tree;
+	pieces = NULL;
+	if (tree != NULL && tree->height >= TREESET_PARALLEL_HEIGHT && hashset_pool_workers() > 0 && array_data != NULL)
+		pieces = (struct treeset_copy_job *)malloc((2 << TREESET_PARALLEL_DEPTH) * sizeof(struct treeset_copy_job));
+
+	if (pieces == NULL) {
+		count = 0;
+		treeset_to_array_rec(tree, array_data, array_size, count);
+		return;
+	}
+
+	/*
+	 * Cut the tree by key range into subtrees and the nodes between them,
+	 * count elements of every subtree, then copy each piece to where it starts in array_data.
+	 */
+	num_pieces = treeset_collect_pieces(tree, TREESET_PARALLEL_DEPTH, pieces, 0);
+	for (i = 0; i < num_pieces; i++) {
+		pieces[i].job.function = &treeset_copy_in_job;
+		pieces[i].array_data   = NULL;
+		hashset_pool_fork(&(pieces[i].job));
+	}
+	for (i = num_pieces - 1; i >= 0; i--)
+		hashset_pool_join(&(pieces[i].job));
+
+	offset = 0;
+	for (i = 0; i < num_pieces && offset < array_size; i++) {
+		pieces[i].array_data = array_data + offset;
+		pieces[i].array_size = array_size - offset;
+		offset += pieces[i].count;
+		hashset_pool_fork(&(pieces[i].job));
+	}
+	for (i = i - 1; i >= 0; i--)
+		hashset_pool_join(&(pieces[i].job));
+
+	free(pieces);
+}
+
+/*
+ * Cut the tree of root by key range into subtrees depth levels below root, or lower than
+ * TREESET_PARALLEL_HEIGHT, and the single nodes above them, stored in accending order.
+ *
+ * @return number of pieces stored so far
+ */
+static int
+treeset_collect_pieces(struct avlnode *root,
+					   int  depth,
+					   struct treeset_copy_job *pieces,
+					   int  count)
+{
+	if (root == NULL)
+		return count;
+
+	if (depth == 0 || root->height < TREESET_PARALLEL_HEIGHT) {
+		pieces[count].root	= root;
+		pieces[count].whole = 1;
+		return count + 1;
+	}
+
+	count = treeset_collect_pieces(root->lch, depth - 1, pieces, count);
+	pieces[count].root	= root;
+	pieces[count].whole = 0;
+	return treeset_collect_pieces(root->rch, depth - 1, pieces, count + 1);
+}
+
+/*
+ * @return number of nodes of the subtree of root
+ */
+static int
+treeset_count_nodes(struct avlnode *root)
+{
+	if (root == NULL)
+		return 0;
+	return treeset_count_nodes(root->lch) + 1 + treeset_count_nodes(root->rch);
+}
+
+/*
+ * Count the elements of a piece of treeset_to_array(...), or copy them once array_data is set
+ */
+static void
+treeset_copy_in_job(struct hashset_job *job)
+{
+	struct treeset_copy_job *piece;
+
+	piece = (struct treeset_copy_job *)job;
+	if (piece->array_data == NULL)
+		piece->count = piece->whole ? treeset_count_nodes(piece->root) : 1;
+	else if (piece->whole)
+		treeset_to_array_rec(piece->root, piece->array_data, piece->array_size, 0);
+	else
+		piece->array_data[0] = piece->root->data;
 }
 
 /*
@@ -424,7 +967,704 @@ treeset_to_array_rec(
 
 	next_size = treeset_to_array_rec(node->rch, array_data, array_size, current_size+1);
 
-	return next_size;
+	return next_size;
+}
+
+/*
+ * Set up iter to walk set in accending order
+ */
+void
+treeset_iter_init(struct treeset_iter *iter, struct tree_set *set)
+{
+	iter->top = 0;
+	if (set == NULL)
+		return;
+
+	treeset_iter_push_left_spine(iter, set->tree);
+}
+
+/*
+ * Set up iter to walk set in accending order from the smallest element not less than data
+ */
+static void
+treeset_iter_seek(struct treeset_iter *iter, struct tree_set *set, int data)
+{
+	struct avlnode *node;
+
+	iter->top = 0;
+	node = set->tree;
+	while (node != NULL) {
+		if (node->data >= data) {
+			iter->stack[iter->top++] = node;
+			node = node->lch;
+		}
+		else
+			node = node->rch;
+	}
+}
+
+/*
+ * Read the next element of the set in accending order
+ *
+ * @param iter
+ * @param data where the element is stored
+ * @return 1 if an element is read, 0 if there's no more element
+ */
+int
+treeset_iter_next(struct treeset_iter *iter, int *data)
+{
+	struct avlnode *node;
+
+	node = treeset_iter_next_node(iter);
+	if (node == NULL)
+		return 0;
+
+	*data = node->data;
+	return 1;
+}
+
+static void
+treeset_iter_push_left_spine(struct treeset_iter *iter, struct avlnode *node)
+{
+	while (node != NULL) {
+		iter->stack[iter->top++] = node;
+		node = node->lch;
+	}
+}
+
+/*
+ * Pop the next node in order.
+ *
+ * [NOTE]
+ * The iterator never looks at the returned node again,
+ * so caller may relink or free it before calling this function again.
+ */
+static struct avlnode *
+treeset_iter_next_node(struct treeset_iter *iter)
+{
+	struct avlnode *node;
+
+	if (iter->top == 0)
+		return NULL;
+
+	node = iter->stack[--iter->top];
+	treeset_iter_push_left_spine(iter, node->rch);
+
+	return node;
+}
+
+/*
+ * Build a balanced tree from nodes that are linked in accending order through rch.
+ * On return, *head points to the node following the last one used.
+ *
+ * Time complexity: O(N)
+ * Space complexity: O( lg(N) )
+ */
+static struct avlnode *
+treeset_build_from_list(struct avlnode **head, int size)
+{
+	struct avlnode *left, *root;
+
+	if (size <= 0)
+		return NULL;
+
+	left  = treeset_build_from_list(head, size / 2);
+	root  = *head;
+	*head = root->rch;
+
+	TREESET_PUBLISH(root->lch, left);
+	TREESET_PUBLISH(root->rch, treeset_build_from_list(head, size - size / 2 - 1));
+	treeset_update_height(root);
+
+	return root;
+}
+
+/*
+ * Merge array sorted in strictly accending order into set whose nodes are not shared,
+ * see treeset_union_sorted_array(...).
+ *
+ * Time complexity: O(N + M)
+ * @return 1 if the set is modified due to the operation, 0 otherwise.
+ */
+static int
+treeset_merge_sorted_array(struct tree_set *set,
+						   const int *array_data,
+						   int  array_size)
+{
+	int added;
+
+	added = 0;
+	treeset_begin_update(set);
+	TREESET_PUBLISH(set->tree, treeset_union_sorted_array(set->tree, array_data, array_size, &added));
+	set->size += added;
+	treeset_end_update(set);
+
+	return added > 0;
+}
+
+/*
+ * Merge array sorted in strictly accending order into the subtree of root.
+ * Nodes of the subtree and new nodes for elements not in it are linked in accending order
+ * through rch, and then the subtree is rebuilt from the list as in treeset_filter(...).
+ * If a node can't be allocated, the rest of array is not added.
+ *
+ * Time complexity: O(N + M)
+ * Space complexity: O( lg(N) )
+ * @return root of the merged subtree
+ */
+static struct avlnode *
+treeset_merge_subtree(struct avlnode *root,
+					  const int *array_data,
+					  int  array_size,
+					  int *added)
+{
+	int i, count;
+	struct treeset_iter iter;
+	struct avlnode *node, *next, *head, *tail;
+
+	i = count = 0;
+	head = tail = NULL;
+
+	iter.top = 0;
+	treeset_iter_push_left_spine(&iter, root);
+	next = treeset_iter_next_node(&iter);
+	while (next != NULL || i < array_size) {
+		if (next != NULL && (i == array_size || next->data <= array_data[i])) {
+			if (i < array_size && next->data == array_data[i])
+				i++;
+			node = next;
+			next = treeset_iter_next_node(&iter);
+		}
+		else {
+			node = treeset_create_avlnode(array_data[i]);
+			if (node == NULL) {
+				perror("Failed to allocate memory to merge array into set");
+				i = array_size;
+				continue;
+			}
+			i++;
+			(*added)++;
+		}
+
+		/* Append node to the list */
+		TREESET_PUBLISH(node->rch, NULL);
+		if (tail == NULL)
+			head = node;
+		else
+			TREESET_PUBLISH(tail->rch, node);
+		tail = node;
+		count++;
+	}
+
+	return treeset_build_from_list(&head, count);
+}
+
+/*
+ * Merge array sorted in strictly accending order into the subtree of root, whose nodes are not shared.
+ * Small merges are done by treeset_merge_subtree(...). Larger ones are split by key range:
+ * the larger side is cut at its middle element, i.e. root or the middle of array,
+ * the other side is partitioned around it, and the two halves are merged
+ * by different threads of the pool before being joined again.
+ *
+ * Time complexity: O(N + M)
+ * @return root of the merged subtree
+ */
+static struct avlnode *
+treeset_union_sorted_array(struct avlnode *root,
+						   const int *array_data,
+						   int  array_size,
+						   int *added)
+{
+	int mid, skip, failed;
+	long long subtree_size;
+	struct avlnode *node, *left, *right;
+	struct treeset_union_job job;
+
+	if (array_size <= 0)
+		return root;
+
+	if (root == NULL) {
+		failed = 0;
+		node = treeset_build_from_sorted_array(array_data, array_size, &failed);
+		if (failed) {
+			perror("Failed to allocate memory to merge array into set");
+			treeset_free_tree(node);
+			return NULL;
+		}
+		*added += array_size;
+		return node;
+	}
+
+	/* Rough number of nodes under root, only to pick the larger side */
+	subtree_size = 1LL << (root->height - 1);
+	if (subtree_size + array_size < TREESET_PARALLEL_SIZE || hashset_pool_workers() == 0)
+		return treeset_merge_subtree(root, array_data, array_size, added);
+
+	if (subtree_size >= array_size) {
+		/* Cut at root, and partition array around it */
+		node  = root;
+		left  = root->lch;
+		right = root->rch;
+		mid   = treeset_lower_bound(array_data, array_size, root->data);
+		skip  = (mid < array_size && array_data[mid] == root->data);
+	}
+	else {
+		/* Cut array at its middle element, and partition the subtree around it */
+		mid  = array_size / 2;
+		skip = 1;
+		node = treeset_split(root, array_data[mid], &left, &right);
+		if (node == NULL) {
+			node = treeset_create_avlnode(array_data[mid]);
+			if (node == NULL)
+				perror("Failed to allocate memory to merge array into set");
+			else
+				(*added)++;
+		}
+	}
+
+	job.job.function = &treeset_union_in_job;
+	job.root		 = left;
+	job.array_data	 = array_data;
+	job.array_size	 = mid;
+	job.added		 = 0;
+	hashset_pool_fork(&(job.job));
+	right = treeset_union_sorted_array(right, array_data + mid + skip, array_size - mid - skip, added);
+	hashset_pool_join(&(job.job));
+	*added += job.added;
+
+	if (node == NULL)
+		return treeset_join_two(job.root, right);
+	return treeset_join(job.root, node, right);
+}
+
+static void
+treeset_union_in_job(struct hashset_job *job)
+{
+	struct treeset_union_job *merge;
+
+	merge = (struct treeset_union_job *)job;
+	merge->root = treeset_union_sorted_array(merge->root, merge->array_data, merge->array_size, &(merge->added));
+}
+
+/*
+ * Keep the elements of the subtree of root, whose nodes are not shared, that are found in setB,
+ * and free the others. Large subtrees are split by key range at root, and both sides
+ * are done by different threads of the pool before being joined again.
+ * Small ones are merged with setB walked from their smallest element on, as treeset_retain_set(...) does.
+ *
+ * Time complexity: O(N + M)
+ * @return root of the rebuilt subtree
+ */
+static struct avlnode *
+treeset_retain_subtree(struct avlnode *root,
+					   struct tree_set *setB,
+					   int *removed)
+{
+	int kept;
+	struct avlnode *node, *head, *tail, *right;
+	struct treeset_iter iter;
+	struct treeset_merge_cursor cursor;
+	struct treeset_retain_job job;
+
+	if (root == NULL)
+		return NULL;
+
+	if (root->height < TREESET_PARALLEL_HEIGHT) {
+		for (node = root; node->lch != NULL; node = node->lch)
+			;
+		treeset_iter_seek(&(cursor.iter), setB, node->data);
+		cursor.has_data = treeset_iter_next(&(cursor.iter), &(cursor.data));
+
+		kept = 0;
+		head = tail = NULL;
+		iter.top = 0;
+		treeset_iter_push_left_spine(&iter, root);
+		while ((node = treeset_iter_next_node(&iter)) != NULL) {
+			if (treeset_keep_if_found_in_iter(node->data, &cursor)) {
+				/* Append node to the list of kept nodes */
+				TREESET_PUBLISH(node->rch, NULL);
+				if (tail == NULL)
+					head = node;
+				else
+					TREESET_PUBLISH(tail->rch, node);
+				tail = node;
+				kept++;
+			}
+			else {
+				treeset_free_avlnode(node);
+				(*removed)++;
+			}
+		}
+		return treeset_build_from_list(&head, kept);
+	}
+
+	job.job.function = &treeset_retain_in_job;
+	job.root		 = root->lch;
+	job.setB		 = setB;
+	job.removed		 = 0;
+	hashset_pool_fork(&(job.job));
+	right = treeset_retain_subtree(root->rch, setB, removed);
+	hashset_pool_join(&(job.job));
+	*removed += job.removed;
+
+	if (treeset_find(setB, root->data))
+		return treeset_join(job.root, root, right);
+
+	treeset_free_avlnode(root);
+	(*removed)++;
+	return treeset_join_two(job.root, right);
+}
+
+static void
+treeset_retain_in_job(struct hashset_job *job)
+{
+	struct treeset_retain_job *retain;
+
+	retain = (struct treeset_retain_job *)job;
+	retain->root = treeset_retain_subtree(retain->root, retain->setB, &(retain->removed));
+}
+
+/*
+ * @return height of the subtree of node, 0 if node is NULL
+ */
+static int
+treeset_height(struct avlnode *node)
+{
+	return (node == NULL) ? 0 : node->height;
+}
+
+/*
+ * Join left, node and right into a balanced tree, where every element of left
+ * is smaller than node's and every element of right is larger. Nodes MUST NOT be shared.
+ * node is hung down the side of the higher tree until heights meet,
+ * and the tree is rebalanced on the way back.
+ *
+ * Time complexity: O( |height of left - height of right| )
+ */
+static struct avlnode *
+treeset_join(struct avlnode *left,
+			 struct avlnode *node,
+			 struct avlnode *right)
+{
+	if (treeset_height(left) > treeset_height(right) + 1) {
+		TREESET_PUBLISH(left->rch, treeset_join(left->rch, node, right));
+		treeset_update_height(left);
+		return treeset_balance(left);
+	}
+	if (treeset_height(right) > treeset_height(left) + 1) {
+		TREESET_PUBLISH(right->lch, treeset_join(left, node, right->lch));
+		treeset_update_height(right);
+		return treeset_balance(right);
+	}
+
+	TREESET_PUBLISH(node->lch, left);
+	TREESET_PUBLISH(node->rch, right);
+	treeset_update_height(node);
+	return node;
+}
+
+/*
+ * Join left and right as treeset_join(...) without a node between them
+ */
+static struct avlnode *
+treeset_join_two(struct avlnode *left,
+				 struct avlnode *right)
+{
+	struct avlnode *last;
+
+	if (left == NULL)
+		return right;
+
+	left = treeset_split_last(left, &last);
+	return treeset_join(left, last, right);
+}
+
+/*
+ * Take the largest node out of the tree of root into *last
+ *
+ * @return root of the rest of the tree
+ */
+static struct avlnode *
+treeset_split_last(struct avlnode *root,
+				   struct avlnode **last)
+{
+	struct avlnode *rest;
+
+	if (root->rch == NULL) {
+		*last = root;
+		return root->lch;
+	}
+
+	rest = treeset_split_last(root->rch, last);
+	return treeset_join(root->lch, root, rest);
+}
+
+/*
+ * Split the tree of root, whose nodes are not shared, into *left of elements smaller than data
+ * and *right of elements larger than data.
+ *
+ * Time complexity: O( lg(N) )
+ * @return node of data if found (not linked to either tree), NULL otherwise
+ */
+static struct avlnode *
+treeset_split(struct avlnode *root,
+			  int data,
+			  struct avlnode **left,
+			  struct avlnode **right)
+{
+	struct avlnode *found, *lch, *rch;
+
+	if (root == NULL) {
+		*left = *right = NULL;
+		return NULL;
+	}
+
+	lch = root->lch;
+	rch = root->rch;
+	if (root->data == data) {
+		*left  = lch;
+		*right = rch;
+		return root;
+	}
+
+	if (root->data > data) {
+		found  = treeset_split(lch, data, left, right);
+		*right = treeset_join(*right, root, rch);
+	}
+	else {
+		found = treeset_split(rch, data, left, right);
+		*left = treeset_join(lch, root, *left);
+	}
+	return found;
+}
+
+/*
+ * @return index of the first element in sorted array that is not less than data
+ */
+static int
+treeset_lower_bound(const int *array_data,
+					int  array_size,
+					int  data)
+{
+	int from, to, mid;
+
+	from = 0;
+	to	 = array_size;
+	while (from < to) {
+		mid = from + (to - from) / 2;
+		if (array_data[mid] < data)
+			from = mid + 1;
+		else
+			to = mid;
+	}
+	return from;
+}
+
+/*
+ * Build a balanced tree taking the middle element as root.
+ * If a node can't be allocated, *failed is set and
+ * the partially built tree is returned so that caller can free it.
+ * The left half of a large array is built by another thread of the pool.
+ *
+ * Time complexity: O(N)
+ * Space complexity: O( lg(N) )
+ */
+static struct avlnode *
+treeset_build_from_sorted_array(
+	const int *array_data,
+	int  array_size,
+	int *failed)
+{
+	int mid;
+	struct avlnode *root;
+	struct treeset_build_job left;
+
+	if (array_size <= 0 || __atomic_load_n(failed, __ATOMIC_RELAXED))
+		return NULL;
+
+	mid  = array_size / 2;
+	root = treeset_create_avlnode(array_data[mid]);
+	if (root == NULL) {
+		__atomic_store_n(failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	if (array_size >= TREESET_PARALLEL_SIZE && hashset_pool_workers() > 0) {
+		left.job.function = &treeset_build_in_job;
+		left.array_data	  = array_data;
+		left.array_size	  = mid;
+		left.failed		  = failed;
+		left.root		  = NULL;
+		hashset_pool_fork(&(left.job));
+		root->rch = treeset_build_from_sorted_array(array_data + mid + 1, array_size - mid - 1, failed);
+		hashset_pool_join(&(left.job));
+		root->lch = left.root;
+	}
+	else {
+		root->lch = treeset_build_from_sorted_array(array_data, mid, failed);
+		root->rch = treeset_build_from_sorted_array(array_data + mid + 1, array_size - mid - 1, failed);
+	}
+	treeset_update_height(root);
+
+	return root;
+}
+
+static void
+treeset_build_in_job(struct hashset_job *job)
+{
+	struct treeset_build_job *build;
+
+	build = (struct treeset_build_job *)job;
+	build->root = treeset_build_from_sorted_array(build->array_data, build->array_size, build->failed);
+}
+
+/*
+ * Build a balanced tree of size nodes, creating nodes in order
+ * so that elements can be consumed from the stream one by one.
+ * If a node can't be allocated or the stream ends, *failed is set and
+ * the partially built tree is returned so that caller can free it.
+ *
+ * Time complexity: O(N)
+ * Space complexity: O( lg(N) )
+ */
+static struct avlnode *
+treeset_build_from_stream(
+	int (*next)(void *ctx, int *data),
+	void *ctx,
+	int  size,
+	int *failed)
+{
+	int data;
+	struct avlnode *left, *root;
+
+	if (size <= 0 || *failed)
+		return NULL;
+
+	left = treeset_build_from_stream(next, ctx, size / 2, failed);
+	if (*failed || !next(ctx, &data)) {
+		*failed = 1;
+		return left;
+	}
+
+	root = treeset_create_avlnode(data);
+	if (root == NULL) {
+		*failed = 1;
+		return left;
+	}
+
+	root->lch = left;
+	root->rch = treeset_build_from_stream(next, ctx, size - size / 2 - 1, failed);
+	treeset_update_height(root);
+
+	return root;
+}
+
+/*
+ * Keep the elements for which keep(data, ctx) returns non-zero and free the others.
+ * keep(...) is called once per element in accending order.
+ * Kept nodes are reused and rebuilt into a balanced tree.
+ * If nodes may be shared with a snapshot, kept elements are copied into new nodes instead.
+ *
+ * Time complexity: O(N)
+ * @return number of removed elements
+ */
+static int
+treeset_filter(struct tree_set *set,
+			   int (*keep)(int data, void *ctx),
+			   void *ctx)
+{
+	int kept, removed, failed, data;
+	int *kept_data;
+	struct treeset_iter iter;
+	struct avlnode *node, *head, *tail;
+
+	kept = removed = 0;
+	head = tail = NULL;
+
+	if (set->tree == NULL)
+		return 0;
+
+	if (treeset_is_shared(set)) {
+		kept_data = (int *)malloc(set->size * sizeof(int));
+		if (kept_data == NULL) {
+			perror("Failed to allocate memory to filter set");
+			return 0;
+		}
+
+		treeset_iter_init(&iter, set);
+		while (treeset_iter_next(&iter, &data)) {
+			if (keep(data, ctx))
+				kept_data[kept++] = data;
+			else
+				removed++;
+		}
+
+		failed = 0;
+		node = treeset_build_from_sorted_array(kept_data, kept, &failed);
+		free(kept_data);
+		if (failed) {
+			treeset_free_tree(node);
+			return 0;
+		}
+
+		treeset_begin_update(set);
+		treeset_free_tree(set->tree);
+		TREESET_PUBLISH(set->tree, node);
+		set->size	= kept;
+		treeset_leave_sharers(set);
+		treeset_end_update(set);
+		return removed;
+	}
+
+	treeset_begin_update(set);
+	treeset_iter_init(&iter, set);
+	while ((node = treeset_iter_next_node(&iter)) != NULL) {
+		if (keep(node->data, ctx)) {
+			/* Append node to the list of kept nodes */
+			TREESET_PUBLISH(node->rch, NULL);
+			if (tail == NULL)
+				head = node;
+			else
+				TREESET_PUBLISH(tail->rch, node);
+			tail = node;
+			kept++;
+		}
+		else {
+			treeset_free_avlnode(node);
+			removed++;
+		}
+	}
+
+	TREESET_PUBLISH(set->tree, treeset_build_from_list(&head, kept));
+	set->size = kept;
+	treeset_end_update(set);
+
+	return removed;
+}
+
+/*
+ * Predicate for treeset_filter(...) that keeps data iff it is read from the cursor.
+ * As data is given in accending order, the cursor only moves forward.
+ */
+static int
+treeset_keep_if_found_in_iter(int data, void *ctx)
+{
+	struct treeset_merge_cursor *cursor;
+
+	cursor = (struct treeset_merge_cursor *)ctx;
+	while (cursor->has_data && cursor->data < data)
+		cursor->has_data = treeset_iter_next(&(cursor->iter), &(cursor->data));
+
+	return cursor->has_data && cursor->data == data;
+}
+
+static int
+treeset_keep_by_predicate(int data, void *ctx)
+{
+	struct treeset_predicate_filter *filter;
+
+	filter = (struct treeset_predicate_filter *)ctx;
+	return (filter->predicate(data, filter->ctx) != 0) == filter->keep_if;
 }
 
 static void
@@ -448,10 +1688,12 @@ treeset_create_avlnode(int data)
 	if (node == NULL) {
 		return NULL;
 	}
+	HASHSET_INSTRUMENT_COUNT(nodes_allocated);
 
 	/* Initial set up */
 	node->data = data;
 	node->height = 1;
+	node->refcount = 1;
 	node->lch = NULL;
 	node->rch = NULL;
 
@@ -469,6 +1711,12 @@ treeset_free_avlnode(struct avlnode *node)
 		return;
 	}
 
+	/* Optimistic readers may still be looking at node, so it must stay as it is */
+	if (treeset_deferring_free()) {
+		treeset_retire(node, 0);
+		return;
+	}
+
 	/*clean node information*/
 	node->data = 0;
 	node->height = 1;
@@ -476,29 +1724,179 @@ treeset_free_avlnode(struct avlnode *node)
 	node->rch = NULL;
 
 	free(node);
+	HASHSET_INSTRUMENT_COUNT(nodes_freed);
+}
+
+/*
+ * Free all nodes of a tree starting from root,
+ * or hand them over to treeset_retire(...) if optimistic readers may be walking them.
+ */
+static void
+treeset_free_tree(struct avlnode *root)
+{
+	if (root == NULL)
+		return;
+
+	if (treeset_deferring_free()) {
+		root = treeset_drop_shared(root);
+		if (root != NULL)
+			treeset_retire(root, 1);
+	}
+	else
+		treeset_destroy_tree(root);
+}
+
+/*
+ * Drop references to nodes of a retired tree that are shared with other sets,
+ * and unlink them from the tree, so that only nodes of its own are left to be freed.
+ * The other sets own these nodes again as soon as this returns, not once the
+ * tree is reclaimed, see treeset_is_shared(...).
+ *
+ * @return root, NULL if root itself was shared
+ */
+static struct avlnode *
+treeset_drop_shared(struct avlnode *root)
+{
+	if (root == NULL)
+		return NULL;
+
+	if (__atomic_load_n(&(root->refcount), __ATOMIC_ACQUIRE) != 1 &&
+		__atomic_sub_fetch(&(root->refcount), 1, __ATOMIC_ACQ_REL) != 0)
+		return NULL;
+
+	TREESET_PUBLISH(root->lch, treeset_drop_shared(root->lch));
+	TREESET_PUBLISH(root->rch, treeset_drop_shared(root->rch));
+	return root;
 }
 
 /*
  * Free all nodes of a tree starting from root
  * in a depth-fast-search manner.
+ * Nodes are not cleaned up as in treeset_free_avlnode(...)
+ * since the whole tree is thrown away and nobody looks at them again.
+ * A node shared with a snapshot only loses a reference, and is freed
+ * together with its subtree by whichever releases it last.
+ *
+ * The left subtree of a high tree is freed by another thread of the pool.
  *
  * Time complexity: O(N)
  * Space compexity: O(lg(N))
  * where N is the number of all nodes
  */
 static void
-treeset_free_tree(struct avlnode *root)
+treeset_destroy_tree(struct avlnode *root)
 {
-	if (root == NULL) {
-		return;
+	struct avlnode *rch;
+	struct treeset_destroy_job left;
+
+	/* Loop on right child so that only left subtrees need recursion */
+	while (root != NULL) {
+		if (__atomic_load_n(&(root->refcount), __ATOMIC_ACQUIRE) != 1 &&
+			__atomic_sub_fetch(&(root->refcount), 1, __ATOMIC_ACQ_REL) != 0)
+			return;
+
+		if (root->lch != NULL && root->height >= TREESET_PARALLEL_HEIGHT && hashset_pool_workers() > 0) {
+			left.job.function = &treeset_destroy_in_job;
+			left.root		  = root->lch;
+			hashset_pool_fork(&(left.job));
+
+			rch = root->rch;
+			free(root);
+			HASHSET_INSTRUMENT_COUNT(nodes_freed);
+			treeset_destroy_tree(rch);
+
+			hashset_pool_join(&(left.job));
+			return;
+		}
+
+		if (root->lch != NULL)
+			treeset_destroy_tree(root->lch);
+
+		rch = root->rch;
+		free(root);
+		HASHSET_INSTRUMENT_COUNT(nodes_freed);
+		root = rch;
 	}
+}
 
-	if (root->lch != NULL)
-		treeset_free_tree(root->lch);
-	if (root->rch != NULL)
-		treeset_free_tree(root->rch);
+static void
+treeset_destroy_in_job(struct hashset_job *job)
+{
+	treeset_destroy_tree(((struct treeset_destroy_job *)job)->root);
+}
 
-	treeset_free_avlnode(root);
+/*
+ * Make node modifiable by copying it if it's shared with a snapshot.
+ * The copy takes over the reference to node held by the caller,
+ * so caller MUST replace its pointer to node with the returned one.
+ * node itself MUST be reachable only through nodes that are not shared.
+ *
+ * @return node itself or its copy, NULL if memory allocation failed
+ */
+static struct avlnode *
+treeset_own_avlnode(struct avlnode *node)
+{
+	struct avlnode *copy;
+
+	if (node == NULL || __atomic_load_n(&(node->refcount), __ATOMIC_ACQUIRE) == 1)
+		return node;
+
+	copy = (struct avlnode *)malloc(sizeof(struct avlnode));
+	if (copy == NULL)
+		return NULL;
+	HASHSET_INSTRUMENT_COUNT(nodes_allocated);
+
+	/* Fields are copied one by one as refcount may be changed by others meanwhile */
+	copy->data = node->data;
+	copy->height = node->height;
+	copy->refcount = 1;
+	copy->lch = node->lch;
+	copy->rch = node->rch;
+	if (copy->lch != NULL)
+		__atomic_add_fetch(&(copy->lch->refcount), 1, __ATOMIC_RELAXED);
+	if (copy->rch != NULL)
+		__atomic_add_fetch(&(copy->rch->refcount), 1, __ATOMIC_RELAXED);
+
+	treeset_free_tree(node);
+	return copy;
+}
+
+/*
+ * Make *root modifiable before inserting/erasing data under it.
+ * If *root is shared, it's copied only after making sure that data is
+ * (present == 0) not in the tree for insertion or (present == 1) in the tree for erasure,
+ * so that adding an existing element or removing a missing one never copies nodes.
+ *
+ * @return 1 if *root can be modified, 0 if there's nothing to do or memory allocation failed
+ */
+static int
+treeset_own_for_update(struct avlnode **root,
+					   int data,
+					   int present,
+					   struct operation_result *result)
+{
+	struct avlnode *copy;
+
+	if (__atomic_load_n(&((*root)->refcount), __ATOMIC_ACQUIRE) == 1)
+		return 1;
+
+	/* Nodes below a shared node are shared too, so searching once is enough */
+	if (!result->checked) {
+		if (treeset_find_data(*root, data) != present) {
+			result->modified = 0;
+			return 0;
+		}
+		result->checked = 1;
+	}
+
+	copy = treeset_own_avlnode(*root);
+	if (copy == NULL) {
+		result->modified = 0;
+		return 0;
+	}
+
+	*root = copy;
+	return 1;
 }
 
 /*
@@ -508,18 +1906,25 @@ treeset_free_tree(struct avlnode *root)
 static struct avlnode *
 treeset_rotate_right(struct avlnode *root)
 {
-	struct avlnode *new_root;
+	struct avlnode *owned, *new_root;
 
-	if (root == NULL)
-		return NULL;
+	if (root == NULL || root->lch == NULL)
+		return root;
+
+	/* Both nodes are relinked, so they're copied if shared */
+	owned = treeset_own_avlnode(root);
+	if (owned == NULL)
+		return root;
+	root = owned;
 
-	new_root = root->lch;
+	new_root = treeset_own_avlnode(root->lch);
 	if (new_root == NULL)
 		return root;
 
 	// Right Rotation
-	root->lch = new_root->rch;
-	new_root->rch = root;
+	HASHSET_INSTRUMENT_COUNT(rotations);
+	TREESET_PUBLISH(root->lch, new_root->rch);
+	TREESET_PUBLISH(new_root->rch, root);
 
 	// Re-calculate heights of root->rch and root
 	treeset_update_height(new_root->rch);
@@ -535,18 +1940,25 @@ treeset_rotate_right(struct avlnode *root)
 static struct avlnode *
 treeset_rotate_left(struct avlnode *root)
 {
-	struct avlnode *new_root;
+	struct avlnode *owned, *new_root;
 
-	if (root == NULL)
-		return NULL;
+	if (root == NULL || root->rch == NULL)
+		return root;
+
+	/* Both nodes are relinked, so they're copied if shared */
+	owned = treeset_own_avlnode(root);
+	if (owned == NULL)
+		return root;
+	root = owned;
 
-	new_root = root->rch;
+	new_root = treeset_own_avlnode(root->rch);
 	if (new_root == NULL)
 		return root;
 
 	// Left Rotation
-	root->rch = new_root->lch;
-	new_root->lch = root;
+	HASHSET_INSTRUMENT_COUNT(rotations);
+	TREESET_PUBLISH(root->rch, new_root->lch);
+	TREESET_PUBLISH(new_root->lch, root);
 
 	// Re-calculate heights of root.lch and root
 	treeset_update_height(new_root->lch);
@@ -568,7 +1980,7 @@ treeset_double_rotate_left_right(struct avlnode *root)
 	// Rotate left child and set as new left;
 	lch = root->lch;
 	if (lch != NULL)
-		root->lch = treeset_rotate_left(lch);
+		TREESET_PUBLISH(root->lch, treeset_rotate_left(lch));
 
 	// Rotate root into right direction
 	new_root = treeset_rotate_right(root);
@@ -588,7 +2000,7 @@ treeset_double_rotate_right_left(struct avlnode *root)
 	// Rotate right child and set as new right; 
 	rch = root->rch;
 	if (rch != NULL)
-		root->rch = treeset_rotate_right(rch);
+		TREESET_PUBLISH(root->rch, treeset_rotate_right(rch));
 
 	// Rotate root into left direction
 	new_root = treeset_rotate_left(root);
@@ -627,9 +2039,9 @@ treeset_balance(struct avlnode *root)
 			glch_height = (root->rch->lch == NULL) ? 0 : root->rch->lch->height;
 			balance_degree = grch_height - glch_height;
 			
-			if (balance_degree == 1)
+			if (balance_degree >= 0) // 0 happens after deleting from left subtree
 				return treeset_rotate_left(root);
-			else if (balance_degree == -1)
+			else
 				return treeset_double_rotate_right_left(root);
 		}
 	}
@@ -649,9 +2061,9 @@ treeset_balance(struct avlnode *root)
 			glch_height = (root->lch->lch == NULL) ? 0 : root->lch->lch->height;
 			balance_degree = grch_height - glch_height;
 
-			if (balance_degree == -1) // additional node exists in self.lch.lch subtree
+			if (balance_degree <= 0) // additional node exists in self.lch.lch subtree
 				return treeset_rotate_right(root);
-			else if (balance_degree == 1)
+			else
 				return treeset_double_rotate_left_right(root);
 		}
 	}
@@ -693,18 +2105,17 @@ int
 treeset_find_set(struct tree_set *setA,
 				 struct tree_set *setB)
 {
-	int sizeB, *arrayB, found_all;
-
-	if (setB == NULL) return 0;
+	int data;
+	struct treeset_iter iter;
 
-	sizeB = setB->size;
-	arrayB = (int *)calloc(sizeB, sizeof(int));
+	if (setA == NULL || setB == NULL) return 0;
 
-	treeset_to_array(setB, arrayB, sizeB);
-	found_all = treeset_find_array(setA, arrayB, sizeB);
-
-	free(arrayB);
-	return found_all;
+	treeset_iter_init(&iter, setB);
+	while (treeset_iter_next(&iter, &data)) {
+		if (!treeset_find(setA, data))
+			return 0;
+	}
+	return 1;
 }
 
 /*
@@ -850,20 +2261,23 @@ treeset_insert_data(
 		 *    fprint(stderr, ...);
 		 * 
 		modified |=  */
-		result->modified = 1; // A new elem is inserted
+		result->modified = (new_root != NULL); // A new elem is inserted
 	 	goto end;
 	}
-	else if (root->data > data) {
-		root->lch = treeset_insert_data(root->lch, data, result);
-	}
-	else if (root->data < data) {
-		root->rch = treeset_insert_data(root->rch, data, result);
-	}
-	else { // if (root->data == data)
+	else if (root->data == data) {
 		result->modified = 0; // Nothing is inserted as we already have the same data in set
 		return root;
 	}
 
+	/* Copy root on the path if it's shared with a snapshot */
+	if (!treeset_own_for_update(&root, data, 0, result))
+		return root;
+
+	if (root->data > data)
+		TREESET_PUBLISH(root->lch, treeset_insert_data(root->lch, data, result));
+	else
+		TREESET_PUBLISH(root->rch, treeset_insert_data(root->rch, data, result));
+
 	// Balance tree(root) by rotating once or twice after re-compute its height
 	root->height = treeset_count_height(root);
 	new_root = treeset_balance(root);
@@ -894,21 +2308,28 @@ treeset_erase_data(
 	int data,
 	struct operation_result *result)
 {
-	struct avlnode *lch, *rch, *head, *right_most;
+	struct avlnode *lch, *rch, *head, *right_most, *next;
 
 	/* data to be deleted not found */
 	if (root == NULL) {
 		result->modified = 0;
 		return NULL;
 	}
+
+	/* Copy root on the path if it's shared with a snapshot */
+	if (!treeset_own_for_update(&root, data, 1, result))
+		return root;
 	
+	/* Re-balance on the way back so that the tree height stays O( lg(N) ) */
 	if (root->data > data) {
-		root->lch = treeset_erase_data(root->lch, data, result);
-		return root;
+		TREESET_PUBLISH(root->lch, treeset_erase_data(root->lch, data, result));
+		treeset_update_height(root);
+		return treeset_balance(root);
 	}
 	else if (root->data < data) {
-		root->rch = treeset_erase_data(root->rch, data, result);
-		return root;
+		TREESET_PUBLISH(root->rch, treeset_erase_data(root->rch, data, result));
+		treeset_update_height(root);
+		return treeset_balance(root);
 	}
 	/* 
 	 * found data to be deleted.
@@ -923,13 +2344,22 @@ treeset_erase_data(
 
 			return rch;
 		}
-		else if (root->lch->rch == NULL) {
+
+		/* Nodes of the left subtree are relinked below, so they're copied if shared */
+		lch = treeset_own_avlnode(root->lch);
+		if (lch == NULL) {
+			result->modified = 0;
+			return root;
+		}
+		TREESET_PUBLISH(root->lch, lch);
+
+		if (lch->rch == NULL) {
 			// left child does not have its right child
-			lch = root->lch;
-			lch->rch = root->rch;
+			TREESET_PUBLISH(lch->rch, root->rch);
 			treeset_free_avlnode(root);
 
-			return lch;	
+			treeset_update_height(lch);
+			return treeset_balance(lch);
 		}
 		else {
 			/* Find the right-most node that is the new root &
@@ -941,18 +2371,29 @@ treeset_erase_data(
 			 *       /
 			 *     lch
 			 */
-			head = root->lch;
-			while (head->rch->rch != NULL)
-				head = head->rch;
-			right_most = head->rch;
-			head->rch = head->rch->lch;
+			head = lch;
+			while (head->rch->rch != NULL) {
+				next = treeset_own_avlnode(head->rch);
+				if (next == NULL) {
+					result->modified = 0;
+					return root;
+				}
+				TREESET_PUBLISH(head->rch, next);
+				head = next;
+			}
+			right_most = treeset_own_avlnode(head->rch);
+			if (right_most == NULL) {
+				result->modified = 0;
+				return root;
+			}
+			TREESET_PUBLISH(head->rch, right_most->lch);
 
 			/* Balance the subtree of right child repeatedly. */
-			root->lch = treeset_balance_right_subtree(root->lch);
-			right_most->rch = root->rch;
-			right_most->lch = root->lch;
+			TREESET_PUBLISH(root->lch, treeset_balance_right_subtree(root->lch));
+			TREESET_PUBLISH(right_most->rch, root->rch);
+			TREESET_PUBLISH(right_most->lch, root->lch);
 
-			free(root);
+			treeset_free_avlnode(root);
 
 			/* Balance tree */
 			treeset_update_height(right_most);
@@ -969,12 +2410,15 @@ treeset_erase_data(
 static struct avlnode *
 treeset_balance_right_subtree(struct avlnode *root)
 {
-	/* Stop recursion */
-	if (root == NULL)
-		return NULL;
+	/*
+	 * Stop recursion.
+	 * A shared subtree wasn't touched by the erasure, so it's already balanced.
+	 */
+	if (root == NULL || __atomic_load_n(&(root->refcount), __ATOMIC_ACQUIRE) != 1)
+		return root;
 	/* Continue recursion on right child */
 	else if (root->rch != NULL)
-		root->rch = treeset_balance_right_subtree(root->rch);
+		TREESET_PUBLISH(root->rch, treeset_balance_right_subtree(root->rch));
 
 	/*
 	 * Balance tree:
@@ -986,3 +2430,403 @@ treeset_balance_right_subtree(struct avlnode *root)
 
 	return root;
 }
+
+/*
+ * Mark set as being modified for treeset_find_optimistic(...).
+ * set->version stays odd until treeset_end_update(...).
+ */
+static void
+treeset_begin_update(struct tree_set *set)
+{
+	__atomic_store_n(&(set->version), set->version + 1, __ATOMIC_RELAXED);
+	/* Make the odd version visible before any modification of the tree */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+treeset_end_update(struct tree_set *set)
+{
+	/* Height of the tree as it's left, for treeset_shape(...) */
+	__atomic_store_n(&(set->height), (set->tree == NULL) ? 0 : set->tree->height, __ATOMIC_RELAXED);
+	__atomic_store_n(&(set->version), set->version + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Same as treeset_find(...), but safe to call while another thread modifies set.
+ * The tree is walked without any lock, and the walk is retried if set->version
+ * shows that set was modified in the meantime (seqlock).
+ * Nodes unlinked by writers aren't freed while optimistic readers may still
+ * see them (see treeset_retire(...)), so the walk never reads freed memory.
+ * The only memory written is the record of the calling thread.
+ *
+ * Writers of set MUST still be serialized among themselves.
+ *
+ * Time complexity: O( lg(N) ) unless set keeps being modified
+ * @return 1 if set contains data, otherwise 0.
+ */
+int
+treeset_find_optimistic(struct tree_set *set, int data)
+{
+	int found, depth, node_data, spins;
+	unsigned int version;
+	struct avlnode *node;
+	struct treeset_reader *reader;
+
+	if (set == NULL)
+		return 0;
+
+	reader = treeset_enter_reader();
+
+	for (spins = 0; ; spins++) {
+		version = __atomic_load_n(&(set->version), __ATOMIC_ACQUIRE);
+		if (version & 1) {
+			/* Wait for the writer to finish */
+			if (spins >= TREESET_OPTIMISTIC_SPINS) {
+				sched_yield();
+				spins = 0;
+			}
+			continue;
+		}
+
+		/*
+		 * A walk racing with a writer may see a broken tree,
+		 * so it gives up at the maximum height of a tree.
+		 */
+		found = 0;
+		/* Links are followed with acquire loads to pair with TREESET_PUBLISH(...) */
+		node  = __atomic_load_n(&(set->tree), __ATOMIC_ACQUIRE);
+		for (depth = 0; node != NULL && depth < TREESET_ITER_STACK_SIZE; depth++) {
+			node_data = __atomic_load_n(&(node->data), __ATOMIC_RELAXED);
+			if (node_data == data) {
+				found = 1;
+				break;
+			}
+			if (node_data < data)
+				node = __atomic_load_n(&(node->rch), __ATOMIC_ACQUIRE);
+			else
+				node = __atomic_load_n(&(node->lch), __ATOMIC_ACQUIRE);
+		}
+
+		/* Validate what was read against the version */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(set->version), __ATOMIC_RELAXED) == version &&
+			(found || node == NULL))
+			break;
+	}
+
+	treeset_exit_reader(reader);
+	return found;
+}
+
+/*
+ * Read the number of elements and the height of set at once.
+ * Like treeset_find_optimistic(...), this is safe to call while
+ * another thread modifies set, and no lock is taken.
+ * The size may lag behind by the add/remove in progress.
+ *
+ * Time complexity: O(1) unless set keeps being modified
+ */
+void
+treeset_shape(struct tree_set *set, int *size, int *height)
+{
+	int spins, set_size, tree_height;
+	unsigned int version;
+
+	*size = *height = 0;
+	if (set == NULL)
+		return;
+
+	/* No node is read, so there's no need to enter as a reader */
+	for (spins = 0; ; spins++) {
+		version = __atomic_load_n(&(set->version), __ATOMIC_ACQUIRE);
+		if (version & 1) {
+			if (spins >= TREESET_OPTIMISTIC_SPINS) {
+				sched_yield();
+				spins = 0;
+			}
+			continue;
+		}
+
+		set_size	= __atomic_load_n(&(set->size), __ATOMIC_RELAXED);
+		tree_height = __atomic_load_n(&(set->height), __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(set->version), __ATOMIC_RELAXED) == version)
+			break;
+	}
+
+	*size	= set_size;
+	*height = tree_height;
+}
+
+/*
+ * Free nodes retired by writers that no optimistic reader can see any more.
+ * Nodes are reclaimed as writers go, so this is only needed to release
+ * the last ones, e.g. after all readers have finished.
+ */
+void
+treeset_reclaim(void)
+{
+	int i;
+	struct treeset_limbo expired[TREESET_RECLAIM_EPOCHS];
+
+	if (!__atomic_load_n(&treeset_retired_pending, __ATOMIC_RELAXED))
+		return;
+
+	/* Every retired node is freed after advancing the epoch this many times */
+	memset(expired, 0, sizeof(expired));
+	pthread_mutex_lock(&treeset_reclaim_lock);
+	for (i = 0; i < TREESET_RECLAIM_EPOCHS; i++)
+		if (!treeset_advance_epoch(&(expired[i])))
+			break;
+	pthread_mutex_unlock(&treeset_reclaim_lock);
+
+	for (i = 0; i < TREESET_RECLAIM_EPOCHS; i++)
+		treeset_free_retired(&(expired[i]));
+}
+
+static void
+treeset_init_reader_key(void)
+{
+	if (pthread_key_create(&treeset_reader_key, &treeset_release_reader))
+		treeset_reader_key_failed = 1;
+}
+
+/*
+ * Called when a reader thread exits so that its record can be reused
+ */
+static void
+treeset_release_reader(void *reader)
+{
+	struct treeset_reader *record;
+
+	record = (struct treeset_reader *)reader;
+	__atomic_store_n(&(record->state), 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&(record->in_use), 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Announce that the calling thread starts walking a tree in the current epoch.
+ * A thread registers its record on the first call.
+ * If it can't, it is counted in treeset_unregistered_readers instead,
+ * which keeps the epoch from advancing until it leaves.
+ *
+ * @return record of the calling thread, NULL if it has none
+ */
+static struct treeset_reader *
+treeset_enter_reader(void)
+{
+	void *memory;
+	unsigned long epoch;
+	struct treeset_reader *reader;
+
+	reader = NULL;
+	if (pthread_once(&treeset_reader_once, &treeset_init_reader_key) == 0 &&
+		!treeset_reader_key_failed)
+		reader = (struct treeset_reader *)pthread_getspecific(treeset_reader_key);
+
+	if (reader == NULL && !treeset_reader_key_failed) {
+		pthread_mutex_lock(&treeset_reclaim_lock);
+
+		/* Reuse a record left by a thread that has exited */
+		for (reader = treeset_readers; reader != NULL; reader = reader->next)
+			if (!__atomic_load_n(&(reader->in_use), __ATOMIC_ACQUIRE))
+				break;
+
+		if (reader == NULL) {
+			if (posix_memalign(&memory, TREESET_CACHE_LINE, sizeof(struct treeset_reader)) == 0) {
+				reader = (struct treeset_reader *)memory;
+				reader->state = 0;
+				reader->next  = treeset_readers;
+				treeset_readers = reader;
+			}
+			else
+				perror("Failed to allocate memory to register reader");
+		}
+
+		if (reader != NULL) {
+			__atomic_store_n(&(reader->in_use), 1, __ATOMIC_RELAXED);
+			if (pthread_setspecific(treeset_reader_key, reader)) {
+				__atomic_store_n(&(reader->in_use), 0, __ATOMIC_RELAXED);
+				reader = NULL;
+			}
+		}
+		pthread_mutex_unlock(&treeset_reclaim_lock);
+	}
+
+	__atomic_add_fetch(&treeset_active_readers, 1, __ATOMIC_SEQ_CST);
+	if (reader == NULL)
+		__atomic_add_fetch(&treeset_unregistered_readers, 1, __ATOMIC_SEQ_CST);
+	else {
+		epoch = __atomic_load_n(&treeset_epoch, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&(reader->state), (epoch << 1) | 1, __ATOMIC_RELAXED);
+	}
+
+	/*
+	 * Pairs with the fence in treeset_deferring_free(...) and treeset_advance_epoch(...):
+	 * either writers see this reader, or this reader sees their unlinks.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return reader;
+}
+
+static void
+treeset_exit_reader(struct treeset_reader *reader)
+{
+	if (reader == NULL)
+		__atomic_sub_fetch(&treeset_unregistered_readers, 1, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&(reader->state), 0, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&treeset_active_readers, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Nodes are retired while readers are walking trees. Once they're gone,
+ * nodes are still retired until the limbo lists are drained by treeset_retire(...),
+ * so that nothing is left there.
+ *
+ * @return 1 if unlinked nodes have to be retired instead of freed
+ */
+static int
+treeset_deferring_free(void)
+{
+	/* Order the unlink of nodes before looking for readers */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Pairs with treeset_exit_reader(...), so that readers gone are done with the nodes */
+	return __atomic_load_n(&treeset_active_readers, __ATOMIC_ACQUIRE) > 0 ||
+		   __atomic_load_n(&treeset_retired_pending, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * Put node, which is no longer reachable from its set, in the limbo list
+ * of the current epoch so that it's freed after readers are done with it.
+ * If the list can't grow, wait for readers here and free node right away.
+ */
+static void
+treeset_retire(struct avlnode *node, int whole)
+{
+	int i, capacity;
+	struct treeset_limbo *limbo, expired[TREESET_RECLAIM_EPOCHS];
+	struct treeset_retired *nodes;
+
+	memset(expired, 0, sizeof(expired));
+	pthread_mutex_lock(&treeset_reclaim_lock);
+
+	limbo = &(treeset_limbos[treeset_epoch % TREESET_RECLAIM_EPOCHS]);
+	if (limbo->count == limbo->capacity) {
+		capacity = (limbo->capacity == 0) ? TREESET_RECLAIM_BATCH : limbo->capacity * 2;
+		nodes = (struct treeset_retired *)realloc(limbo->nodes, capacity * sizeof(struct treeset_retired));
+		if (nodes == NULL) {
+			pthread_mutex_unlock(&treeset_reclaim_lock);
+			perror("Failed to allocate memory to retire node");
+			treeset_synchronize();
+			if (whole)
+				treeset_destroy_tree(node);
+			else {
+				free(node);
+				HASHSET_INSTRUMENT_COUNT(nodes_freed);
+			}
+			return;
+		}
+		limbo->nodes	= nodes;
+		limbo->capacity = capacity;
+	}
+
+	limbo->nodes[limbo->count].node  = node;
+	limbo->nodes[limbo->count].whole = whole;
+	limbo->count++;
+	__atomic_store_n(&treeset_retired_pending, treeset_retired_pending + 1, __ATOMIC_RELAXED);
+
+	/* Without readers every limbo list expires at once, and nodes are freed immediately again */
+	if (__atomic_load_n(&treeset_active_readers, __ATOMIC_ACQUIRE) == 0) {
+		for (i = 0; i < TREESET_RECLAIM_EPOCHS; i++)
+			if (!treeset_advance_epoch(&(expired[i])))
+				break;
+	}
+	else if (++treeset_retired_since_advance >= TREESET_RECLAIM_BATCH)
+		treeset_advance_epoch(&(expired[0]));
+
+	pthread_mutex_unlock(&treeset_reclaim_lock);
+	for (i = 0; i < TREESET_RECLAIM_EPOCHS; i++)
+		treeset_free_retired(&(expired[i]));
+}
+
+/*
+ * Move to the next epoch if every reader walking a tree has seen the current one.
+ * Nodes retired two epochs ago are taken out to expired, to be freed
+ * by the caller after releasing treeset_reclaim_lock.
+ * treeset_reclaim_lock MUST be held.
+ *
+ * @return 1 if the epoch advanced, 0 otherwise
+ */
+static int
+treeset_advance_epoch(struct treeset_limbo *expired)
+{
+	unsigned long epoch, state;
+	struct treeset_reader *reader;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&treeset_unregistered_readers, __ATOMIC_ACQUIRE) > 0)
+		return 0;
+
+	epoch = treeset_epoch;
+	for (reader = treeset_readers; reader != NULL; reader = reader->next) {
+		state = __atomic_load_n(&(reader->state), __ATOMIC_ACQUIRE);
+		if ((state & 1) && (state >> 1) != epoch)
+			return 0;
+	}
+
+	__atomic_store_n(&treeset_epoch, epoch + 1, __ATOMIC_RELEASE);
+	treeset_retired_since_advance = 0;
+
+	/* Slot of epoch - 1, which becomes the slot of epoch + 2 */
+	*expired = treeset_limbos[(epoch + 2) % TREESET_RECLAIM_EPOCHS];
+	__atomic_store_n(&treeset_retired_pending, treeset_retired_pending - expired->count, __ATOMIC_RELAXED);
+	memset(&(treeset_limbos[(epoch + 2) % TREESET_RECLAIM_EPOCHS]), 0, sizeof(struct treeset_limbo));
+	return 1;
+}
+
+static void
+treeset_free_retired(struct treeset_limbo *limbo)
+{
+	int i;
+
+	for (i = 0; i < limbo->count; i++) {
+		if (limbo->nodes[i].whole)
+			treeset_destroy_tree(limbo->nodes[i].node);
+		else {
+			free(limbo->nodes[i].node);
+			HASHSET_INSTRUMENT_COUNT(nodes_freed);
+		}
+	}
+	free(limbo->nodes);
+}
+
+/*
+ * Wait until every reader that might see nodes unlinked so far is done
+ */
+static void
+treeset_synchronize(void)
+{
+	unsigned long target;
+	struct treeset_limbo expired;
+
+	pthread_mutex_lock(&treeset_reclaim_lock);
+	target = treeset_epoch + 2;
+	pthread_mutex_unlock(&treeset_reclaim_lock);
+
+	for (;;) {
+		memset(&expired, 0, sizeof(expired));
+		pthread_mutex_lock(&treeset_reclaim_lock);
+		if (treeset_epoch >= target) {
+			pthread_mutex_unlock(&treeset_reclaim_lock);
+			return;
+		}
+		treeset_advance_epoch(&expired);
+		pthread_mutex_unlock(&treeset_reclaim_lock);
+
+		treeset_free_retired(&expired);
+		sched_yield();
+	}
+}
@@ -7,12 +7,22 @@
 
 struct tree_set {
 	int size; /* total number of elements in set */
+	int *sharers; /* number of sets sharing nodes with this one, itself included, NULL if none. See treeset_snapshot(...) */
+	unsigned int version; /* odd while tree is being modified, see treeset_find_optimistic(...) */
+	int height; /* height of tree, updated with version for treeset_shape(...) */
 	struct avlnode *tree;
 };
 
+/*
+ * Nodes are shared between a set and its snapshots (persistent AVL tree).
+ * refcount is the number of parents and sets pointing to the node.
+ * A node is modified in place only if it's reachable through nodes of refcount 1,
+ * otherwise it's copied first (path copying).
+ */
 struct avlnode {
 	int data;
 	int height;
+	int refcount;
 	struct avlnode *lch; /*left child*/
 	struct avlnode *rch; /*right child*/
 };
@@ -30,21 +40,56 @@ struct avlnode {
  */
 struct operation_result {
 	int modified;
+	int checked; /* 1 once data is searched for under a shared node, so that it isn't searched again */
+};
+
+/*
+ * Depth of the stack used to walk a tree in order.
+ * An AVL tree of height h has at least fib(h+2)-1 nodes, so 48 levels
+ * cover any tree whose size fits in an int.
+ */
+#define TREESET_ITER_STACK_SIZE 48
+
+/*
+ * In-order cursor over a tree set. It lives on the caller's stack and
+ * never allocates memory. The set MUST NOT be modified while iterating.
+ *
+ * Usage:
+ *     struct treeset_iter iter;
+ *     int data;
+ *     treeset_iter_init(&iter, set);
+ *     while (treeset_iter_next(&iter, &data))
+ *         ...
+ */
+struct treeset_iter {
+	int top; /* number of nodes on stack */
+	struct avlnode *stack[TREESET_ITER_STACK_SIZE];
 };
 
 struct tree_set* treeset_create_set();
 void treeset_free_set(struct tree_set *set);
+void treeset_clear(struct tree_set *set);
+struct tree_set *treeset_snapshot(struct tree_set *set);
 int  treeset_add(struct tree_set *set, int data);
 int  treeset_add_set(struct tree_set *setA, struct tree_set *setB);
 int  treeset_add_array(struct tree_set *setA, int *array_data, int array_size);
+int  treeset_add_sorted_array(struct tree_set *set, const int *array_data, int array_size);
+int  treeset_add_sorted_stream(struct tree_set *set, int (*next)(void *ctx, int *data), void *ctx, int count);
 int  treeset_remove(struct tree_set *set, int data);
 int  treeset_remove_set(struct tree_set *setA, struct tree_set *setB);
 int  treeset_remove_array(struct tree_set *set, int *array_data, int array_size);
 int  treeset_find(struct tree_set *set, int data);
+int  treeset_find_optimistic(struct tree_set *set, int data);
+void treeset_shape(struct tree_set *set, int *size, int *height);
+void treeset_reclaim(void);
 int  treeset_find_set(struct tree_set *set, struct tree_set *setB);
 int  treeset_find_array(struct tree_set *set, int *array_data, int array_size);
 int  treeset_retain_set(struct tree_set *set, struct tree_set *setB);
 int  treeset_retain_array(struct tree_set *set, int *array_data, int array_size);
 void treeset_to_array(struct tree_set *set, int *array_data, int  array_size);
+int  treeset_remove_if(struct tree_set *set, int (*predicate)(int data, void *ctx), void *ctx);
+int  treeset_retain_if(struct tree_set *set, int (*predicate)(int data, void *ctx), void *ctx);
+void treeset_iter_init(struct treeset_iter *iter, struct tree_set *set);
+int  treeset_iter_next(struct treeset_iter *iter, int *data);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,514 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "treeset_packed.h"
+
+/* Maximum bytes of a varint of 32 bits */
+#define TREESET_VARINT_MAX_SIZE 5
+
+static int  treeset_packed_reserve(struct treeset_packed *packed, size_t *capacity, size_t size);
+static unsigned char *treeset_write_varint(unsigned char *pos, uint32_t value);
+static int  treeset_read_varint(const unsigned char **pos, const unsigned char *end, uint32_t *value);
+static int  treeset_packed_read_block_header(const unsigned char **pos, const unsigned char *end, uint32_t *count, uint32_t *gap_size, int *first);
+static int  treeset_packed_stream_next(void *ctx, int *data);
+static int  treeset_keep_if_found_in_packed(int data, void *ctx);
+
+/* Context for treeset_keep_if_found_in_packed(...) */
+struct treeset_packed_cursor {
+	struct treeset_packed_iter iter;
+	int has_data;
+	int data;
+};
+
+/*
+ * Encode set in packed form. set is not modified.
+ *
+ * @return pointer to a new packed set, NULL if memory allocation failed
+ */
+struct treeset_packed *
+treeset_pack(struct tree_set *set)
+{
+	int i, data, prev, count;
+	size_t capacity;
+	unsigned char gaps[TREESET_PACKED_BLOCK_SIZE * TREESET_VARINT_MAX_SIZE], *gap_end, *pos;
+	struct treeset_packed *packed;
+	struct treeset_iter iter;
+
+	if (set == NULL)
+		return NULL;
+
+	packed = (struct treeset_packed *)calloc(1, sizeof(struct treeset_packed));
+	if (packed == NULL)
+		goto fail;
+
+	packed->size	   = set->size;
+	packed->num_blocks = (set->size + TREESET_PACKED_BLOCK_SIZE - 1) / TREESET_PACKED_BLOCK_SIZE;
+	packed->blocks = (struct treeset_packed_block *)malloc((packed->num_blocks + 1) * sizeof(struct treeset_packed_block));
+	if (packed->blocks == NULL)
+		goto fail;
+
+	/* Dense sets need about 1 byte per element, grow if not */
+	capacity = 0;
+	if (!treeset_packed_reserve(packed, &capacity, set->size + 16))
+		goto fail;
+
+	treeset_iter_init(&iter, set);
+	for (i = 0; i < packed->num_blocks; i++) {
+		/* Encode gaps first as their size goes into the block header */
+		treeset_iter_next(&iter, &data);
+		packed->blocks[i].first	 = data;
+		packed->blocks[i].offset = packed->nbytes;
+
+		count	= 1;
+		prev	= data;
+		gap_end = gaps;
+		while (count < TREESET_PACKED_BLOCK_SIZE && treeset_iter_next(&iter, &data)) {
+			gap_end = treeset_write_varint(gap_end, (uint32_t)data - (uint32_t)prev - 1);
+			prev = data;
+			count++;
+		}
+
+		if (!treeset_packed_reserve(packed, &capacity, packed->nbytes + 3 * TREESET_VARINT_MAX_SIZE + (gap_end - gaps)))
+			goto fail;
+
+		pos = packed->bytes + packed->nbytes;
+		pos = treeset_write_varint(pos, count);
+		pos = treeset_write_varint(pos, gap_end - gaps);
+		pos = treeset_write_varint(pos, ((uint32_t)packed->blocks[i].first << 1) ^ (uint32_t)(packed->blocks[i].first >> 31));
+		memcpy(pos, gaps, gap_end - gaps);
+		packed->nbytes = (pos + (gap_end - gaps)) - packed->bytes;
+	}
+
+	return packed;
+
+fail:
+	perror("Failed to allocate memory to packed set");
+	treeset_packed_free(packed);
+	return NULL;
+}
+
+/*
+ * Create packed set from bytes encoded by treeset_pack(...), e.g. read from a file.
+ * bytes are copied and block headers are checked while building the block index.
+ *
+ * @param bytes
+ * @param nbytes size of bytes
+ * @param size number of elements encoded in bytes
+ * @return pointer to a new packed set, NULL if bytes are broken or memory allocation failed
+ */
+struct treeset_packed *
+treeset_packed_from_bytes(const unsigned char *bytes,
+						  size_t nbytes,
+						  int size)
+{
+	int i, first, total;
+	uint32_t count, gap_size;
+	const unsigned char *pos, *end;
+	struct treeset_packed *packed;
+
+	if (bytes == NULL || size < 0)
+		return NULL;
+
+	packed = (struct treeset_packed *)calloc(1, sizeof(struct treeset_packed));
+	if (packed == NULL)
+		return NULL;
+
+	packed->size	   = size;
+	packed->nbytes	   = nbytes;
+	packed->num_blocks = (size + TREESET_PACKED_BLOCK_SIZE - 1) / TREESET_PACKED_BLOCK_SIZE;
+	packed->blocks = (struct treeset_packed_block *)malloc((packed->num_blocks + 1) * sizeof(struct treeset_packed_block));
+	packed->bytes  = (unsigned char *)malloc(nbytes + 1);
+	if (packed->blocks == NULL || packed->bytes == NULL)
+		goto fail;
+	memcpy(packed->bytes, bytes, nbytes);
+
+	/* Walk block headers only, skipping gaps */
+	total = 0;
+	pos = packed->bytes;
+	end = packed->bytes + nbytes;
+	for (i = 0; i < packed->num_blocks; i++) {
+		packed->blocks[i].offset = pos - packed->bytes;
+		if (!treeset_packed_read_block_header(&pos, end, &count, &gap_size, &first) ||
+			(size_t)(end - pos) < gap_size ||
+			count > (uint32_t)(size - total) ||
+			(i > 0 && first <= packed->blocks[i-1].first))
+			goto fail;
+
+		packed->blocks[i].first = first;
+		pos	  += gap_size;
+		total += count;
+	}
+	if (total != size || pos != end)
+		goto fail;
+
+	return packed;
+
+fail:
+	treeset_packed_free(packed);
+	return NULL;
+}
+
+void
+treeset_packed_free(struct treeset_packed *packed)
+{
+	if (packed == NULL)
+		return;
+
+	free(packed->bytes);
+	free(packed->blocks);
+	free(packed);
+}
+
+/*
+ * Check if packed set contains data.
+ * The block is found by binary search on the block index, then decoded until data.
+ *
+ * Time complexity: O( lg(N) + TREESET_PACKED_BLOCK_SIZE )
+ * @return 1 if packed set contains data, otherwise 0.
+ */
+int
+treeset_packed_find(struct treeset_packed *packed,
+					int data)
+{
+	int from, to, mid, d;
+	size_t block_end;
+	struct treeset_packed_iter iter;
+
+	if (packed == NULL || packed->num_blocks == 0)
+		return 0;
+
+	/* Find the last block whose first element <= data */
+	from = 0;
+	to	 = packed->num_blocks;
+	while (to - from > 1) {
+		mid = from + (to - from) / 2;
+		if (packed->blocks[mid].first <= data)
+			from = mid;
+		else
+			to = mid;
+	}
+	if (packed->blocks[from].first > data)
+		return 0;
+
+	block_end = (from + 1 < packed->num_blocks) ? packed->blocks[from + 1].offset : packed->nbytes;
+	treeset_packed_iter_init(&iter, packed->bytes + packed->blocks[from].offset, block_end - packed->blocks[from].offset);
+	while (treeset_packed_iter_next(&iter, &d)) {
+		if (d >= data)
+			return d == data;
+	}
+	return 0;
+}
+
+/*
+ * Decode packed set into a new tree set, which is built balanced in O(N)
+ *
+ * @return pointer to a new set, NULL if memory allocation failed or bytes are broken
+ */
+struct tree_set *
+treeset_unpack(struct treeset_packed *packed)
+{
+	struct tree_set *set;
+	struct treeset_packed_iter iter;
+
+	if (packed == NULL)
+		return NULL;
+
+	set = treeset_create_set();
+	if (set == NULL)
+		return NULL;
+
+	treeset_packed_iter_init(&iter, packed->bytes, packed->nbytes);
+	if (!treeset_add_sorted_stream(set, &treeset_packed_stream_next, &iter, packed->size) || iter.error) {
+		treeset_free_set(set);
+		return NULL;
+	}
+
+	return set;
+}
+
+/*
+ * Set up iter to decode bytes, which are a sequence of blocks
+ */
+void
+treeset_packed_iter_init(struct treeset_packed_iter *iter,
+						 const unsigned char *bytes,
+						 size_t nbytes)
+{
+	iter->pos	  = bytes;
+	iter->end	  = bytes + nbytes;
+	iter->left	  = 0;
+	iter->started = 0;
+	iter->data	  = 0;
+	iter->error	  = 0;
+}
+
+/*
+ * Decode the next element
+ *
+ * @param iter
+ * @param data where the element is stored
+ * @return 1 if an element is read, 0 if there's no more element or bytes are broken
+ */
+int
+treeset_packed_iter_next(struct treeset_packed_iter *iter,
+						 int *data)
+{
+	uint32_t count, gap_size, gap;
+	int first;
+	long long next;
+
+	if (iter->error)
+		return 0;
+
+	if (iter->left == 0) {
+		/* Start the next block */
+		if (iter->pos >= iter->end)
+			return 0;
+		if (!treeset_packed_read_block_header(&(iter->pos), iter->end, &count, &gap_size, &first) ||
+			(iter->started && first <= iter->data))
+			goto broken;
+
+		iter->left = count;
+		next = first;
+	}
+	else {
+		/* Fast path for gaps smaller than 128 */
+		if (iter->pos < iter->end && *(iter->pos) < 0x80)
+			gap = *(iter->pos)++;
+		else if (!treeset_read_varint(&(iter->pos), iter->end, &gap))
+			goto broken;
+
+		next = (long long)iter->data + gap + 1;
+		if (next > INT32_MAX)
+			goto broken;
+	}
+
+	iter->left--;
+	iter->started = 1;
+	iter->data	  = (int)next;
+	*data		  = (int)next;
+	return 1;
+
+broken:
+	iter->error = 1;
+	return 0;
+}
+
+/*
+ * Add all elements in packed set to set.
+ * If set is empty, it is built directly from the decoded stream in O(N).
+ *
+ * @return 1 if the set is modified due to the operation, 0 otherwise.
+ */
+int
+treeset_add_packed(struct tree_set *set,
+				   struct treeset_packed *packed)
+{
+	int data, modified;
+	struct treeset_packed_iter iter;
+
+	if (set == NULL || packed == NULL)
+		return 0;
+
+	treeset_packed_iter_init(&iter, packed->bytes, packed->nbytes);
+	if (set->tree == NULL)
+		return treeset_add_sorted_stream(set, &treeset_packed_stream_next, &iter, packed->size) && packed->size > 0;
+
+	modified = 0;
+	while (treeset_packed_iter_next(&iter, &data))
+		modified |= treeset_add(set, data);
+
+	return modified;
+}
+
+/*
+ * Remove all elements in packed set from set
+ *
+ * @return 1 if operation succeeded 0 otherwise
+ */
+int
+treeset_remove_packed(struct tree_set *set,
+					  struct treeset_packed *packed)
+{
+	int data;
+	struct treeset_packed_iter iter;
+
+	if (set == NULL || packed == NULL)
+		return 0;
+
+	treeset_packed_iter_init(&iter, packed->bytes, packed->nbytes);
+	while (treeset_packed_iter_next(&iter, &data))
+		treeset_remove(set, data);
+
+	return !iter.error;
+}
+
+/*
+ * Check if all elements in packed set exist in set
+ *
+ * @return 1 if true 0 otherwise
+ */
+int
+treeset_find_packed(struct tree_set *set,
+					struct treeset_packed *packed)
+{
+	int data;
+	struct treeset_packed_iter iter;
+
+	if (set == NULL || packed == NULL)
+		return 0;
+
+	treeset_packed_iter_init(&iter, packed->bytes, packed->nbytes);
+	while (treeset_packed_iter_next(&iter, &data)) {
+		if (!treeset_find(set, data))
+			return 0;
+	}
+	return !iter.error;
+}
+
+/*
+ * Intersection operation for set and packed set.
+ * Both are walked in order at the same time, so the packed set is decoded only once.
+ *
+ * Time complexity: O(N + M)
+ * @return 1 if operation succeeded 0 otherwise
+ */
+int
+treeset_retain_packed(struct tree_set *set,
+					  struct treeset_packed *packed)
+{
+	struct treeset_packed_cursor cursor;
+
+	if (set == NULL || packed == NULL)
+		return 0;
+
+	treeset_packed_iter_init(&(cursor.iter), packed->bytes, packed->nbytes);
+	cursor.has_data = treeset_packed_iter_next(&(cursor.iter), &(cursor.data));
+	treeset_retain_if(set, &treeset_keep_if_found_in_packed, &cursor);
+
+	return !cursor.iter.error;
+}
+
+/*
+ * Make sure packed->bytes can hold size bytes, doubling its capacity
+ * @return 1 if succeeded, 0 otherwise
+ */
+static int
+treeset_packed_reserve(struct treeset_packed *packed,
+					   size_t *capacity,
+					   size_t size)
+{
+	size_t new_capacity;
+	unsigned char *bytes;
+
+	if (size <= *capacity)
+		return 1;
+
+	new_capacity = (*capacity < 64) ? 64 : *capacity;
+	while (new_capacity < size)
+		new_capacity *= 2;
+
+	bytes = (unsigned char *)realloc(packed->bytes, new_capacity);
+	if (bytes == NULL)
+		return 0;
+
+	packed->bytes = bytes;
+	*capacity = new_capacity;
+	return 1;
+}
+
+/*
+ * Write value as LEB128 varint
+ * @return position right after the varint
+ */
+static unsigned char *
+treeset_write_varint(unsigned char *pos,
+					 uint32_t value)
+{
+	while (value >= 0x80) {
+		*pos++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*pos++ = (unsigned char)value;
+
+	return pos;
+}
+
+/*
+ * Read LEB128 varint of at most 32 bits and move *pos forward
+ * @return 1 if succeeded, 0 if the varint runs over end or is too long
+ */
+static int
+treeset_read_varint(const unsigned char **pos,
+					const unsigned char *end,
+					uint32_t *value)
+{
+	int i;
+	uint32_t result;
+	const unsigned char *p;
+
+	p = *pos;
+	result = 0;
+	for (i = 0; i < TREESET_VARINT_MAX_SIZE && p < end; i++) {
+		result |= (uint32_t)(*p & 0x7f) << (7 * i);
+		if ((*p++ & 0x80) == 0) {
+			*pos   = p;
+			*value = result;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read count, size of gaps, and first element of a block
+ * @return 1 if succeeded, 0 if the header is broken
+ */
+static int
+treeset_packed_read_block_header(const unsigned char **pos,
+								 const unsigned char *end,
+								 uint32_t *count,
+								 uint32_t *gap_size,
+								 int *first)
+{
+	uint32_t zigzag;
+
+	if (!treeset_read_varint(pos, end, count)	 ||
+		!treeset_read_varint(pos, end, gap_size) ||
+		!treeset_read_varint(pos, end, &zigzag)	 ||
+		*count == 0 || *count > TREESET_PACKED_BLOCK_SIZE)
+		return 0;
+
+	*first = (int)((zigzag >> 1) ^ (0U - (zigzag & 1)));
+	return 1;
+}
+
+/*
+ * treeset_packed_iter_next(...) in the form of next() of treeset_add_sorted_stream(...)
+ */
+static int
+treeset_packed_stream_next(void *ctx, int *data)
+{
+	return treeset_packed_iter_next((struct treeset_packed_iter *)ctx, data);
+}
+
+/*
+ * Predicate for treeset_retain_if(...) that keeps data iff it is decoded from the cursor.
+ * As data is given in accending order, the cursor only moves forward.
+ */
+static int
+treeset_keep_if_found_in_packed(int data, void *ctx)
+{
+	struct treeset_packed_cursor *cursor;
+
+	cursor = (struct treeset_packed_cursor *)ctx;
+	while (cursor->has_data && cursor->data < data)
+		cursor->has_data = treeset_packed_iter_next(&(cursor->iter), &(cursor->data));
+
+	return cursor->has_data && cursor->data == data;
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2015 Masaru Nomura
+// Released under the MIT license
+// http://opensource.org/licenses/mit-license.php
+
+#ifndef TREESET_PACKED_H
+#define TREESET_PACKED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "treeset.h"
+
+/*
+ * Compressed, read-only form of a tree set.
+ *
+ * As elements of a chain are sorted, consecutive elements differ by small gaps.
+ * Elements are grouped into blocks of up to TREESET_PACKED_BLOCK_SIZE elements,
+ * and each block is encoded as LEB128 varints:
+ *
+ *     count | size of gaps in bytes | zigzag(first element) | gap-1 | gap-1 | ...
+ *
+ * Dense sets take about 1 byte per element instead of sizeof(struct avlnode).
+ * The same bytes are used for runs of packed snapshot files (see hashset_io.h).
+ */
+#define TREESET_PACKED_BLOCK_SIZE 128
+
+struct treeset_packed_block {
+	int		 first;		// first element of the block
+	uint32_t offset;	// offset of the block from the beginning of bytes
+};
+
+struct treeset_packed {
+	int		size;				// total number of elements
+	int		num_blocks;
+	size_t	nbytes;				// size of bytes
+	unsigned char *bytes;
+	struct treeset_packed_block *blocks;	// index to search blocks by element
+};
+
+/*
+ * Cursor that decodes packed bytes on the fly in accending order.
+ * No memory is allocated. error is set if the bytes turn out to be broken.
+ */
+struct treeset_packed_iter {
+	const unsigned char *pos, *end;
+	int left;		// elements left in the current block
+	int started;	// 1 once the first element is read
+	int data;		// last element read
+	int error;
+};
+
+struct treeset_packed *treeset_pack(struct tree_set *set);
+struct treeset_packed *treeset_packed_from_bytes(const unsigned char *bytes, size_t nbytes, int size);
+void treeset_packed_free(struct treeset_packed *packed);
+int  treeset_packed_find(struct treeset_packed *packed, int data);
+struct tree_set *treeset_unpack(struct treeset_packed *packed);
+void treeset_packed_iter_init(struct treeset_packed_iter *iter, const unsigned char *bytes, size_t nbytes);
+int  treeset_packed_iter_next(struct treeset_packed_iter *iter, int *data);
+int  treeset_add_packed(struct tree_set *set, struct treeset_packed *packed);
+int  treeset_remove_packed(struct tree_set *set, struct treeset_packed *packed);
+int  treeset_find_packed(struct tree_set *set, struct treeset_packed *packed);
+int  treeset_retain_packed(struct tree_set *set, struct treeset_packed *packed);
+
+#endif